@@ -0,0 +1,566 @@
+// Benchmarks run with "./upscaler bench"
+#pragma once
+
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <utility>
+#include <vector>
+#include "esrgan_worker.h"
+#include "metrics.h"
+#include "nn_engine.h"
+#include "psnr_stream.h"
+#include "resample.h"
+#include "ssim.h"
+#include "thread_pool.h"
+
+// wall time of the fastest of a few runs, in seconds
+inline double timeBestOf(int runs, const std::function<void()>& work) {
+    double best = 1e30;
+    for (int i = 0; i < runs; ++i) {
+        auto start = std::chrono::steady_clock::now();
+        work();
+        auto end = std::chrono::steady_clock::now();
+        best = std::min(best, std::chrono::duration<double>(end - start).count());
+    }
+    return best;
+}
+
+// deterministic RGB test pattern: smooth gradients plus a little noise, so it behaves like a photo
+inline std::vector<unsigned char> makeTestImage(int width, int height) {
+    std::vector<unsigned char> image(static_cast<size_t>(width) * height * 3);
+    unsigned seed = 2463534242u;
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            seed ^= seed << 13;
+            seed ^= seed >> 17;
+            seed ^= seed << 5;
+            int noise = static_cast<int>(seed & 15) - 8;
+            unsigned char* pixel = &image[(static_cast<size_t>(y) * width + x) * 3];
+            pixel[0] = static_cast<unsigned char>(std::clamp(x * 255 / width + noise, 0, 255));
+            pixel[1] = static_cast<unsigned char>(std::clamp(y * 255 / height + noise, 0, 255));
+            pixel[2] = static_cast<unsigned char>(std::clamp((x + y) * 255 / (width + height) + noise, 0, 255));
+        }
+    }
+    return image;
+}
+
+// 4x upscale of a 3840x2160 frame with 1..maxThreads threads
+inline void runResampleScalingBenchmark(int maxThreads) {
+    const int width = 3840, height = 2160, scaleFactor = 4;
+    std::vector<unsigned char> input = makeTestImage(width, height);
+    std::vector<unsigned char> output(static_cast<size_t>(width) * scaleFactor * height * scaleFactor * 3);
+
+    std::vector<int> threadCounts;
+    for (int t = 1; t < maxThreads; t *= 2) threadCounts.push_back(t);
+    threadCounts.push_back(maxThreads);
+
+    std::cout << "Resample scaling: " << width << "x" << height << " -> "
+              << width * scaleFactor << "x" << height * scaleFactor << ", kernel "
+              << simdLevelName(activeSimdLevel()) << "\n";
+    std::cout << std::setw(8) << "threads"
+              << std::setw(20) << "bilinear s (x)"
+              << std::setw(20) << "fixed s (x)"
+              << std::setw(20) << "nearest s (x)" << "\n";
+
+    double base[3] = {0, 0, 0};
+    for (int threads : threadCounts) {
+        ThreadPool pool(threads);
+        double times[3] = {
+            timeBestOf(3, [&] { bilinearResize(input.data(), width, height, 3, output.data(), scaleFactor, activeSimdLevel(), pool); }),
+            timeBestOf(3, [&] { bilinearResizeFixed(input.data(), width, height, 3, output.data(), scaleFactor, activeSimdLevel(), pool); }),
+            timeBestOf(3, [&] { nearestResize(input.data(), width, height, 3, output.data(), scaleFactor, pool); }),
+        };
+        if (threads == 1) std::copy(times, times + 3, base);
+
+        std::cout << std::setw(8) << threads;
+        for (int i = 0; i < 3; ++i) {
+            std::ostringstream cell;
+            cell << std::fixed << std::setprecision(3) << times[i] << " (" << std::setprecision(2) << base[i] / times[i] << "x)";
+            std::cout << std::setw(20) << cell.str();
+        }
+        std::cout << "\n";
+    }
+}
+
+// MSE of a 4x upscaled 3840x2160 frame (bilinear against nearest neighbour): the old double loop,
+// then every integer kernel on one thread and the best one on 1..maxThreads threads, then the
+// one-pass evaluator behind computeAndPrintPSNR
+inline void runMetricsBenchmark(int maxThreads) {
+    const int width = 3840, height = 2160, scaleFactor = 4;
+    std::vector<unsigned char> input = makeTestImage(width, height);
+    ConstImageView source(input.data(), width, height, 3);
+    Image bilinear(width * scaleFactor, height * scaleFactor, 3), nearest(width * scaleFactor, height * scaleFactor, 3);
+    bilinearResize(source, bilinear.view(), scaleFactor);
+    nearestResize(source, nearest.view(), scaleFactor);
+    const double gigabytes = 2.0 * bilinear.rowBytes() * bilinear.height / 1e9;
+
+    std::cout << "MSE of two " << bilinear.width << "x" << bilinear.height << " frames:\n";
+    std::cout << std::setw(10) << "kernel" << std::setw(9) << "threads" << std::setw(12) << "ms" << std::setw(10) << "x"
+              << std::setw(10) << "GB/s" << std::setw(12) << "MSE" << "\n";
+    double reference = 0, mse = 0;
+    auto report = [&](const char* kernel, int threads, double seconds) {
+        if (reference == 0) reference = seconds;
+        std::cout << std::setw(10) << kernel << std::setw(9) << threads << std::fixed << std::setprecision(1) << std::setw(12)
+                  << seconds * 1000 << std::setprecision(2) << std::setw(10) << reference / seconds << std::setw(10)
+                  << gigabytes / seconds << std::setprecision(4) << std::setw(12) << mse << "\n" << std::defaultfloat;
+    };
+    report("double", 1, timeBestOf(1, [&] { mse = computeMSEReference(bilinear.view(), nearest.view()); }));
+
+    ThreadPool single(1);
+    for (int level = static_cast<int>(SimdLevel::Scalar); level <= static_cast<int>(detectSimdLevel()); ++level) {
+        SimdLevel simd = static_cast<SimdLevel>(level);
+        report(simdLevelName(simd), 1, timeBestOf(3, [&] { mse = computeMSE(bilinear.view(), nearest.view(), simd, single); }));
+    }
+    for (int threads = 2; threads <= maxThreads; threads *= 2) {
+        ThreadPool pool(threads);
+        report(simdLevelName(activeSimdLevel()), threads,
+               timeBestOf(3, [&] { mse = computeMSE(bilinear.view(), nearest.view(), activeSimdLevel(), pool); }));
+    }
+
+    //everything computeAndPrintPSNR reports, from one read of both frames
+    ImageMetrics metrics;
+    for (int threads = 1; threads <= maxThreads; threads *= 2) {
+        ThreadPool pool(threads);
+        const double seconds = timeBestOf(3, [&] { metrics = evaluateImage(bilinear.view(), nearest.view(), pool); });
+        mse = metrics.mse();
+        report("all", threads, seconds);
+    }
+    std::cout << "(all = overall, R/G/B and luma PSNR " << std::fixed << std::setprecision(2) << metrics.psnr() << "/"
+              << metrics.channelPSNR(0) << "/" << metrics.channelPSNR(1) << "/" << metrics.channelPSNR(2) << "/" << metrics.lumaPSNR()
+              << " dB, max error " << metrics.maxError() << " and the error histogram in one pass)\n" << std::defaultfloat;
+}
+
+// SSIM and MS-SSIM of an 8K frame (bilinear against nearest neighbour, 4x from 1920x1080) with every
+// kernel on one thread, then the best one on 1..maxThreads threads
+inline void runSsimBenchmark(int maxThreads) {
+    const int width = 1920, height = 1080, scaleFactor = 4;
+    std::vector<unsigned char> input = makeTestImage(width, height);
+    ConstImageView source(input.data(), width, height, 3);
+    Image bilinear(width * scaleFactor, height * scaleFactor, 3), nearest(width * scaleFactor, height * scaleFactor, 3);
+    bilinearResize(source, bilinear.view(), scaleFactor);
+    nearestResize(source, nearest.view(), scaleFactor);
+    const double megapixels = bilinear.width * static_cast<double>(bilinear.height) / 1e6;
+
+    std::cout << "\nSSIM of two " << bilinear.width << "x" << bilinear.height << " frames:\n";
+    std::cout << std::setw(10) << "metric" << std::setw(10) << "kernel" << std::setw(9) << "threads" << std::setw(12) << "ms"
+              << std::setw(10) << "Mpx/s" << std::setw(10) << "value" << "\n";
+    auto report = [&](const char* metric, SimdLevel simd, int threads, double seconds, double value) {
+        std::cout << std::setw(10) << metric << std::setw(10) << simdLevelName(simd) << std::setw(9) << threads << std::fixed
+                  << std::setprecision(1) << std::setw(12) << seconds * 1000 << std::setw(10) << megapixels / seconds
+                  << std::setprecision(4) << std::setw(10) << value << "\n" << std::defaultfloat;
+    };
+    ThreadPool single(1);
+    double value = 0;
+    for (int level = static_cast<int>(SimdLevel::Scalar); level <= static_cast<int>(detectSimdLevel()); ++level) {
+        SimdLevel simd = static_cast<SimdLevel>(level);
+        const double seconds = timeBestOf(1, [&] { value = computeSSIM(bilinear.view(), nearest.view(), nullptr, simd, single); });
+        report("ssim", simd, 1, seconds, value);
+    }
+    for (int threads = 1; threads <= maxThreads; threads *= 2) {
+        ThreadPool pool(threads);
+        const double seconds = timeBestOf(1, [&] { value = computeMSSSIM(bilinear.view(), nearest.view(), activeSimdLevel(), pool); });
+        report("ms-ssim", activeSimdLevel(), threads, seconds, value);
+    }
+}
+
+// PSNR of a 16K bilinear upscale (4x from 3840x2160) against the nearest-neighbour ground truth: both
+// frames made and then compared, against streaming the bilinear rows past ground truth rows made on
+// the fly (psnr_stream.h). memory is what each holds besides the input: two frames, or per thread the
+// bilinear row cache (four float rows), an output row and a truth row
+inline void runStreamingPsnrBenchmark(int maxThreads) {
+    const int width = 3840, height = 2160, scaleFactor = 4;
+    std::vector<unsigned char> input = makeTestImage(width, height);
+    ConstImageView source(input.data(), width, height, 3);
+    const size_t rowBytes = static_cast<size_t>(width) * scaleFactor * 3;
+
+    std::cout << "\nPSNR of a " << width * scaleFactor << "x" << height * scaleFactor << " bilinear upscale:\n";
+    std::cout << std::setw(10) << "path" << std::setw(9) << "threads" << std::setw(12) << "ms" << std::setw(12) << "MB held"
+              << std::setw(12) << "PSNR" << "\n";
+    auto report = [&](const char* path, int threads, double seconds, double megabytes, double psnr) {
+        std::cout << std::setw(10) << path << std::setw(9) << threads << std::fixed << std::setprecision(1) << std::setw(12)
+                  << seconds * 1000 << std::setw(12) << megabytes << std::setprecision(4) << std::setw(12) << psnr << "\n"
+                  << std::defaultfloat;
+    };
+    for (int threads = 1; threads <= maxThreads; threads *= 2) {
+        ThreadPool pool(threads);
+        double whole = 0, streamed = 0;
+        const double wholeSeconds = timeBestOf(1, [&] {
+            Image bilinear(width * scaleFactor, height * scaleFactor, 3), nearest(width * scaleFactor, height * scaleFactor, 3);
+            bilinearResize(source, bilinear.view(), scaleFactor, activeSimdLevel(), pool);
+            nearestResize(source, nearest.view(), scaleFactor, pool);
+            whole = psnrFromMSE(computeMSE(nearest.view(), bilinear.view(), activeSimdLevel(), pool));
+        });
+        report("frames", threads, wholeSeconds, 2.0 * rowBytes * height * scaleFactor / 1e6, whole);
+        const double streamSeconds = timeBestOf(1, [&] { streamed = streamBilinearPSNR(source, source, scaleFactor, false, activeSimdLevel(), pool); });
+        report("streamed", threads, streamSeconds, threads * (4.0 * sizeof(float) + 2.0) * rowBytes / 1e6, streamed);
+        if (streamed != whole) std::cout << "  streamed PSNR differs from the whole frames!\n";
+    }
+}
+
+// nominal clock from /proc/cpuinfo, 0 if unknown (e.g. not on Linux)
+inline double cpuGHz() {
+    std::ifstream cpuinfo("/proc/cpuinfo");
+    std::string line;
+    while (std::getline(cpuinfo, line)) {
+        if (line.rfind("cpu MHz", 0) == 0) return std::stod(line.substr(line.find(':') + 1)) / 1000.0;
+    }
+    return 0.0;
+}
+
+// single-precision flops per cycle per core, assuming two FMA ports (two add/mul ports without FMA)
+inline int peakFlopsPerCycle(SimdLevel level) {
+    GemmTile tile = gemmTile(level);
+    if (tile.nr == 32) return 16 * 2 * 2;
+    if (tile.nr == 24) return 8 * 2 * 2;
+    return 4 * 2;
+}
+
+// 3x3 pad 1 convolution layer with random weights, as if loaded from a .param/.bin pair
+inline ConvolutionLayer makeBenchConvolution(int inputChannels, int outputChannels) {
+    ConvolutionLayer layer;
+    ParamDict pd;
+    for (std::string token : {"0=" + std::to_string(outputChannels), std::string("1=3"), std::string("4=1"), std::string("5=1"),
+                              "6=" + std::to_string(outputChannels * inputChannels * 9)}) {
+        pd.parse(token);
+    }
+    layer.loadParam(pd);
+
+    std::vector<float> values(static_cast<size_t>(outputChannels) * inputChannels * 9 + outputChannels);
+    unsigned seed = 1;
+    for (float& value : values) {
+        seed = seed * 1664525u + 1013904223u;
+        value = static_cast<float>(static_cast<int>(seed >> 20) - 2048) / 65536.0f;
+    }
+    std::vector<unsigned char> bytes(4 + values.size() * sizeof(float), 0); //float32 tag is 0
+    std::memcpy(bytes.data() + 4, values.data(), values.size() * sizeof(float));
+    ModelBin mb(std::move(bytes));
+    layer.loadModel(mb);
+    return layer;
+}
+
+// largest |a - b| over the largest |a|
+inline double relativeMaxError(const Tensor& a, const Tensor& b) {
+    double error = 0, magnitude = 0;
+    for (int q = 0; q < a.c; ++q) {
+        for (int y = 0; y < a.h; ++y) {
+            const float* pa = a.row(q, y);
+            const float* pb = b.row(q, y);
+            for (int x = 0; x < a.w; ++x) {
+                error = std::max(error, static_cast<double>(std::fabs(pa[x] - pb[x])));
+                magnitude = std::max(magnitude, static_cast<double>(std::fabs(pa[x])));
+            }
+        }
+    }
+    return magnitude > 0 ? error / magnitude : error;
+}
+
+// makeTestImage as a size x size Image
+inline Image makeTestFrame(int size) {
+    std::vector<unsigned char> pixels = makeTestImage(size, size);
+    Image image(size, size, 3);
+    for (int y = 0; y < size; ++y) std::memcpy(image.row(y), &pixels[static_cast<size_t>(y) * size * 3], static_cast<size_t>(size) * 3);
+    return image;
+}
+
+// "8-bit max diff N, PSNR X dB" of result against reference
+inline void printImageDifference(const Image& reference, const Image& result) {
+    double squared = 0;
+    int maxDiff = 0;
+    for (int y = 0; y < result.height; ++y) {
+        for (int i = 0; i < result.width * result.channels; ++i) {
+            int diff = std::abs(result.row(y)[i] - reference.row(y)[i]);
+            squared += diff * diff;
+            maxDiff = std::max(maxDiff, diff);
+        }
+    }
+    double mse = squared / (static_cast<double>(result.width) * result.height * result.channels);
+    std::cout << "8-bit max diff " << maxDiff << ", PSNR ";
+    if (mse == 0) std::cout << "inf (identical)";
+    else std::cout << std::fixed << std::setprecision(1) << 10.0 * std::log10(255.0 * 255.0 / mse) << std::defaultfloat << " dB";
+}
+
+// GFLOP/s of the convolution backends on the layer shapes of the shipped models
+inline void runConvBenchmark(ThreadPool& pool) {
+    const int size = 128;
+    const std::pair<int, int> shapes[] = {{3, 64}, {64, 64}, {64, 48}, {64, 32}, {96, 32}, {128, 32}, {160, 32}, {192, 64}};
+    std::vector<SimdLevel> levels = {SimdLevel::Scalar};
+    if (gemmTile(SimdLevel::AVX2).nr == 24) levels.push_back(SimdLevel::AVX2);
+    if (gemmTile(SimdLevel::AVX512).nr == 32) levels.push_back(SimdLevel::AVX512);
+
+    const double ghz = cpuGHz();
+    std::cout << "3x3 convolution on a " << size << "x" << size << " tile, " << pool.threadCount() << " threads";
+    if (ghz > 0) std::cout << ", " << ghz << " GHz";
+    std::cout << "\nGFLOP/s (% of theoretical peak, assuming 2 FMA ports); Winograd counts the direct FLOPs it replaces,\n"
+              << "its error is the largest difference from direct relative to the largest output\n";
+    std::cout << std::setw(10) << "in->out" << std::setw(18) << "direct";
+    for (SimdLevel level : levels) std::cout << std::setw(18) << (std::string("gemm ") + simdLevelName(level));
+    std::cout << std::setw(18) << (std::string("winograd ") + simdLevelName(activeSimdLevel())) << std::setw(12) << "error" << "\n";
+
+    auto cell = [&](double seconds, double flops, SimdLevel level) {
+        std::ostringstream text;
+        double gflops = flops / seconds * 1e-9;
+        text << std::fixed << std::setprecision(1) << gflops;
+        if (ghz > 0) text << " (" << std::setprecision(0) << 100.0 * gflops / (ghz * peakFlopsPerCycle(level) * pool.threadCount()) << "%)";
+        return text.str();
+    };
+
+    for (auto [inputChannels, outputChannels] : shapes) {
+        ConvolutionLayer layer = makeBenchConvolution(inputChannels, outputChannels);
+        Tensor input(size, size, inputChannels);
+        for (int q = 0; q < inputChannels; ++q) {
+            for (size_t i = 0; i < input.planeSize(); ++i) input.channel(q)[i] = static_cast<float>((i * 7 + q) % 13) / 13.0f;
+        }
+        const double flops = 2.0 * outputChannels * inputChannels * 9 * size * size;
+        std::vector<Tensor> outputs(1);
+
+        std::cout << std::setw(10) << (std::to_string(inputChannels) + "->" + std::to_string(outputChannels));
+        double direct = timeBestOf(3, [&] { layer.forwardDirect(input, pool); });
+        std::cout << std::setw(18) << cell(direct, flops, activeSimdLevel());
+        layer.setAlgorithm(ConvAlgorithm::Gemm);
+        for (SimdLevel level : levels) {
+            layer.packed = packGemmWeights(layer.weights.data(), outputChannels, inputChannels * 9, level);
+            double gemm = timeBestOf(3, [&] { layer.forward({input}, outputs, pool); });
+            std::cout << std::setw(18) << cell(gemm, flops, level);
+        }
+
+        layer.setAlgorithm(ConvAlgorithm::Winograd);
+        double winograd = timeBestOf(3, [&] { layer.forward({input}, outputs, pool); });
+        Tensor reference = layer.forwardDirect(input, pool);
+        std::cout << std::setw(18) << cell(winograd, flops, activeSimdLevel()) << std::setw(12) << std::scientific << std::setprecision(1)
+                  << relativeMaxError(reference, outputs[0]) << std::defaultfloat << "\n";
+    }
+}
+
+// error of the fast convolutions on a whole shipped model, against the direct loops: largest float
+// difference of the network output and PSNR of the 8-bit result
+inline void runConvErrorReport(ThreadPool& pool, const std::string& modelName = "realesr-animevideov3-x4") {
+    Net net;
+    try {
+        net.load("models", modelName);
+    } catch (const std::exception& e) {
+        std::cout << "Skipping the model error report: " << e.what() << "\n";
+        return;
+    }
+    const int size = 64;
+    Tensor input = imageToTensor(makeTestFrame(size).view());
+
+    net.setConvAlgorithm(ConvAlgorithm::Direct);
+    Tensor reference = net.forward(input, pool);
+    Image referenceImage(reference.w, reference.h, reference.c);
+    tensorToImage(reference, referenceImage.view());
+
+    std::cout << modelName << " on a " << size << "x" << size << " test image, compared with direct convolution:\n";
+    for (ConvAlgorithm algorithm : {ConvAlgorithm::Gemm, ConvAlgorithm::Winograd}) {
+        net.setConvAlgorithm(algorithm);
+        Tensor result = net.forward(input, pool);
+        Image resultImage(result.w, result.h, result.c);
+        tensorToImage(result, resultImage.view());
+
+        std::cout << std::setw(10) << convAlgorithmName(algorithm) << ": max float error " << std::scientific << std::setprecision(2)
+                  << relativeMaxError(reference, result) << std::defaultfloat << ", ";
+        printImageDifference(referenceImage, resultImage);
+        std::cout << "\n";
+    }
+}
+
+// 16-bit activation and weight storage (Net::setStorage) on a whole shipped model: time and bytes per
+// forward(), and how far the 8-bit output moves from float storage
+inline void runStorageReport(ThreadPool& pool, const std::string& modelName = "realesr-animevideov3-x4") {
+    Net net;
+    try {
+        net.load("models", modelName);
+    } catch (const std::exception& e) {
+        std::cout << "Skipping the storage report: " << e.what() << "\n";
+        return;
+    }
+    const int size = 256;
+    Tensor input = imageToTensor(makeTestFrame(size).view());
+
+    std::cout << modelName << " on a " << size << "x" << size << " test image by activation storage (arena and traffic in MB):\n";
+    Image reference;
+    double referenceSeconds = 0;
+    for (StorageType type : {StorageType::Float32, StorageType::BFloat16, StorageType::Float16}) {
+        net.setStorage(type);
+        Tensor result;
+        const double seconds = timeBestOf(3, [&] { result = net.forward(input, pool); });
+        Image resultImage(result.w, result.h, result.c);
+        tensorToImage(result, resultImage.view());
+
+        std::cout << std::setw(6) << storageTypeName(type) << ": " << std::fixed << std::setprecision(1) << seconds * 1e3 << " ms, "
+                  << std::setprecision(2) << result.planeSize() / seconds * 1e-6 << std::setprecision(1) << " Mpixel/s";
+        if (type == StorageType::Float32) {
+            reference = std::move(resultImage);
+            referenceSeconds = seconds;
+        } else {
+            std::cout << " (" << std::showpos << 100.0 * (referenceSeconds / seconds - 1.0) << std::noshowpos << "%)";
+        }
+        std::cout << ", arena " << net.memoryPlan(size, size).arenaBytes / 1048576.0 << ", traffic " << net.trafficBytes(size, size) / 1048576.0
+                  << std::defaultfloat;
+        if (type != StorageType::Float32) {
+            std::cout << ", vs fp32: ";
+            printImageDifference(reference, resultImage);
+        }
+        std::cout << "\n";
+    }
+}
+
+// what the load-time fusion pass saves on a 1920x1080 input: activation bytes moved by one forward()
+// (from the layer shapes), and time from running a tile both ways (models without weights only get the bytes)
+inline void runFusionReport(ThreadPool& pool) {
+    const int frameW = 1920, frameH = 1080, tile = 128;
+    std::cout << "Layer fusion, per " << frameW << "x" << frameH << " frame:\n";
+    for (const std::string modelName : {"realesr-animevideov3-x4", "realesrgan-x4plus"}) {
+        Net plain, fused;
+        plain.fuseOnLoad = false;
+        bool weights = true;
+        try {
+            plain.load("models", modelName);
+            fused.load("models", modelName);
+        } catch (const std::exception&) {
+            //no .bin: the graph alone still shows what fusion removes
+            weights = false;
+            std::ifstream param("models/" + modelName + ".param");
+            if (!param) continue;
+            plain.loadParam(param);
+            param.clear();
+            param.seekg(0);
+            fused.loadParam(param);
+            fused.fuseLayers();
+        }
+
+        const double before = plain.trafficBytes(frameW, frameH) / 1e9, after = fused.trafficBytes(frameW, frameH) / 1e9;
+        std::cout << std::setw(24) << modelName << ": " << fused.fusedLayerCount() << " layers fused, " << std::fixed << std::setprecision(1)
+                  << before << " -> " << after << " GB moved (-" << std::setprecision(0) << 100.0 * (before - after) / before << "%)";
+        if (weights) {
+            std::vector<unsigned char> pixels = makeTestImage(tile, tile);
+            Image image(tile, tile, 3);
+            for (int y = 0; y < tile; ++y) std::memcpy(image.row(y), &pixels[static_cast<size_t>(y) * tile * 3], static_cast<size_t>(tile) * 3);
+            Tensor input = imageToTensor(image.view());
+            const double frameTiles = static_cast<double>(frameW) * frameH / (tile * tile);
+            double plainTime = timeBestOf(3, [&] { plain.forward(input, pool); }) * frameTiles;
+            double fusedTime = timeBestOf(3, [&] { fused.forward(input, pool); }) * frameTiles;
+            std::cout << ", " << std::setprecision(2) << plainTime << " -> " << fusedTime << " s (saves " << plainTime - fusedTime << " s)";
+        } else {
+            std::cout << " (no weights, not timed)";
+        }
+        std::cout << std::defaultfloat << "\n";
+    }
+}
+
+// what planConcatBuffers saves on realesrgan-x4plus (graph only, it has no weights here): Concat copies
+// per 1080p frame and peak activation memory of one tile
+inline void runConcatPlanReport() {
+    const std::string modelName = "realesrgan-x4plus";
+    std::ifstream param("models/" + modelName + ".param");
+    if (!param) return;
+    Net copying, planned;
+    copying.loadParam(param);
+    param.clear();
+    param.seekg(0);
+    planned.loadParam(param);
+    copying.fuseLayers();
+    planned.fuseLayers();
+    int concats = 0;
+    for (const auto& layer : planned.layerList()) concats += layer->type == "Concat";
+    const int views = planned.planConcatBuffers();
+
+    const int tile = 256;
+    std::cout << modelName << ": " << views << " of " << concats << " Concats are views of a dense-block buffer, "
+              << std::fixed << std::setprecision(1) << copying.trafficBytes(1920, 1080) / 1e9 << " -> "
+              << planned.trafficBytes(1920, 1080) / 1e9 << " GB moved per 1920x1080 frame, peak memory of a " << tile << "x" << tile
+              << " tile " << (copying.peakMemoryBytes(tile, tile) >> 20) << " -> " << (planned.peakMemoryBytes(tile, tile) >> 20) << " MB\n"
+              << std::defaultfloat;
+}
+
+// activation memory of one tile, from the memory plan alone (nothing is run, weights are not needed):
+// a fresh tensor per blob, the most bytes live at once, and the packed arena forward() allocates
+inline void runMemoryPlanReport(const std::string& modelName) {
+    Net net;
+    try {
+        net.load("models", modelName);
+    } catch (const std::exception&) {
+        std::ifstream param("models/" + modelName + ".param");
+        if (!param) throw std::runtime_error("Failed to open models/" + modelName + ".param");
+        net.loadParam(param);
+        net.fuseLayers();
+        net.planConcatBuffers();
+    }
+    std::cout << modelName << ": activation memory per tile (MB; input side including overlap)\n";
+    std::cout << std::setw(8) << "tile" << std::setw(12) << "buffers" << std::setw(14) << "per blob" << std::setw(12) << "live peak"
+              << std::setw(12) << "arena" << std::setw(12) << "total" << "\n";
+    for (int size : {32, 64, 128, 256, 512, 1024}) {
+        MemoryPlan plan = net.memoryPlan(size, size);
+        size_t separate = 0;
+        for (const MemoryPlan::Buffer& buffer : plan.buffers) separate += buffer.bytes;
+        auto mb = [](size_t bytes) { return bytes / 1048576.0; };
+        std::cout << std::fixed << std::setprecision(1) << std::setw(8) << size << std::setw(12) << plan.buffers.size() << std::setw(14)
+                  << mb(separate) << std::setw(12) << mb(plan.liveBytes) << std::setw(12) << mb(plan.arenaBytes) << std::setw(12)
+                  << mb(net.peakMemoryBytes(size, size)) << "\n"
+                  << std::defaultfloat;
+    }
+}
+
+#if !defined(_WIN32)
+// per-image latency of upscaling small thumbnails: a new worker process per image (spawn + model load
+// + job, the cost structure of runESRGAN's system() call), one persistent worker over a socketpair and
+// over a Unix socket, and the net called in-process as the floor (thumbnails fit one tile)
+inline void runWorkerLatencyReport(const std::string& executable, const std::string& modelName, int size = 32, int count = 8) {
+    std::vector<Image> thumbnails;
+    for (int i = 0; i < count; ++i) {
+        Image frame = makeTestFrame(size + 4 * i); //a few different sizes, so no job is a repeat
+        thumbnails.push_back(std::move(frame));
+    }
+    const std::vector<std::string> args = {"--model", modelName};
+    using Clock = std::chrono::steady_clock;
+    auto ms = [](Clock::time_point begin) { return std::chrono::duration<double, std::milli>(Clock::now() - begin).count(); };
+    auto report = [&](const std::string& label, double total, double spawn) {
+        std::cout << std::setw(24) << label << ": " << std::fixed << std::setprecision(1) << total / count << " ms/image";
+        if (spawn > 0) std::cout << " (" << spawn / total << "x faster)";
+        std::cout << "\n" << std::defaultfloat;
+    };
+    std::cout << modelName << ", " << count << " thumbnails of " << size << "-" << size + 4 * (count - 1) << " px:\n";
+
+    auto begin = Clock::now();
+    for (const Image& image : thumbnails) EsrganWorkerClient::spawn(executable, args).upscale(image.view());
+    const double spawned = ms(begin);
+    report("process per image", spawned, 0);
+
+    begin = Clock::now();
+    EsrganWorkerClient piped = EsrganWorkerClient::spawn(executable, args);
+    piped.upscale(thumbnails[0].view());
+    const double startup = ms(begin);
+    begin = Clock::now();
+    for (const Image& image : thumbnails) piped.upscale(image.view());
+    report("persistent, socketpair", ms(begin), spawned);
+    std::cout << std::setw(24) << "(startup + first job" << ": " << std::fixed << std::setprecision(1) << startup << " ms)\n" << std::defaultfloat;
+    piped.close();
+
+    const std::string path = "/tmp/upscaler-worker-" + std::to_string(::getpid()) + ".sock";
+    std::vector<std::string> socketArgs = args;
+    socketArgs.insert(socketArgs.end(), {"--socket", path});
+    EsrganWorkerClient server = EsrganWorkerClient::spawn(executable, socketArgs); //listens, never reads its stdin
+    {
+        EsrganWorkerClient client = EsrganWorkerClient::connect(path);
+        client.upscale(thumbnails[0].view());
+        begin = Clock::now();
+        for (const Image& image : thumbnails) client.upscale(image.view());
+        report("persistent, Unix socket", ms(begin), spawned);
+        client.stop();
+    }
+    server.close();
+
+    Net net;
+    net.load("models", modelName);
+    esrganUpscale(net, thumbnails[0].view());
+    begin = Clock::now();
+    for (const Image& image : thumbnails) esrganUpscale(net, image.view());
+    report("in-process", ms(begin), spawned);
+}
+#endif
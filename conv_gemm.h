@@ -0,0 +1,326 @@
+// im2col + cache-blocked SGEMM convolution for the native inference engine
+//
+// a convolution is C[M][N] = A[M][K] * B[K][N] with M output channels, N output pixels and
+// K = input channels * kernel taps. A (the weights) is packed once at model load into panels of mr
+// rows stored k-major, so the micro-kernel reads mr weights per step from one cache line. B is the
+// im2col matrix; it is never built whole: each task expands a kc x nc block of it (a few hundred
+// pixels, one row per tap) into a thread-local buffer, which stays in L2 while every weight panel
+// streams over it. the micro-kernels keep an mr x nr tile of C in registers and issue one FMA per
+// register per k step: 8 x 32 on AVX-512, 4 x 24 on AVX2+FMA, and a portable 4 x 8 kernel otherwise.
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <vector>
+#include "cpu_features.h"
+#include "half_float.h"
+#include "thread_pool.h"
+
+// how a convolution maps input pixels to output pixels
+struct ConvGeometry {
+    int inW = 0, inH = 0, inC = 0;
+    int outW = 0, outH = 0;
+    int kernelW = 3, kernelH = 3;
+    int strideW = 1, strideH = 1;
+    int dilationW = 1, dilationH = 1;
+    int padLeft = 0, padTop = 0;
+
+    int taps() const { return kernelW * kernelH; }
+    int depth() const { return inC * taps(); }
+    int pixels() const { return outW * outH; }
+};
+
+// block sizes: a kc x nc slice of im2col is ~200-400 KB and stays in L2
+constexpr int kGemmKc = 256;
+constexpr int kGemmNc = 384;
+
+struct GemmTile {
+    int mr;
+    int nr;
+};
+
+inline bool gemmHasAVX2(const CpuFeatures& features) { return features.avx2 && features.fma; }
+
+inline GemmTile gemmTile(SimdLevel level) {
+#if defined(UPSCALER_X86)
+    if (level == SimdLevel::AVX512 && cpuFeatures().avx512f) return {8, 32};
+    if (level >= SimdLevel::AVX2 && gemmHasAVX2(cpuFeatures())) return {4, 24};
+#endif
+    (void)level;
+    return {4, 8};
+}
+
+// weights reordered into mr-row panels: panel p holds rows [p*mr, p*mr + mr) as k-major groups of
+// mr values, zero-padded past the last row
+struct PackedWeights {
+    int m = 0;
+    int k = 0;
+    GemmTile tile{4, 8};
+    SimdLevel level = SimdLevel::Scalar;
+    std::vector<float> data;
+
+    bool empty() const { return data.empty(); }
+    const float* panel(int p) const { return data.data() + static_cast<size_t>(p) * k * tile.mr; }
+};
+
+// weights are [m][k], row-major (ncnn's [out][in][kh][kw])
+inline PackedWeights packGemmWeights(const float* weights, int m, int k, SimdLevel level) {
+    PackedWeights packed;
+    packed.m = m;
+    packed.k = k;
+    packed.tile = gemmTile(level);
+    packed.level = level;
+    const int mr = packed.tile.mr;
+    const int panels = (m + mr - 1) / mr;
+    packed.data.assign(static_cast<size_t>(panels) * k * mr, 0.0f);
+    for (int p = 0; p < panels; ++p) {
+        float* dst = packed.data.data() + static_cast<size_t>(p) * k * mr;
+        for (int kk = 0; kk < k; ++kk) {
+            for (int r = 0; r < mr && p * mr + r < m; ++r) dst[kk * mr + r] = weights[static_cast<size_t>(p * mr + r) * k + kk];
+        }
+    }
+    return packed;
+}
+
+// a convolution's input planes, cstep values apart: floats, or bf16/fp16 values that are widened
+// as they are packed
+struct ConvInput {
+    const void* data = nullptr;
+    size_t cstep = 0;
+    StorageType type = StorageType::Float32;
+
+    const float* floats() const { return static_cast<const float*>(data); }
+    const uint16_t* halves() const { return static_cast<const uint16_t*>(data); }
+};
+
+// expand rows [k0, k0 + kc) and pixels [n0, n0 + nc) of the im2col matrix into b (ldb values per
+// row); columns past nc are zeroed so micro-kernels can always load full nr-wide vectors. copy(src,
+// dst, count) moves each run of input values, converting them if S is not T
+template <typename T, typename S, typename Copy>
+void packIm2colRuns(const ConvGeometry& g, const S* input, size_t inputCstep, int k0, int kc, int n0, int nc, T* b, int ldb,
+                    const Copy& copy) {
+    for (int kk = 0; kk < kc; ++kk) {
+        const int k = k0 + kk;
+        const int ic = k / g.taps();
+        const int ky = (k % g.taps()) / g.kernelW;
+        const int kx = k % g.kernelW;
+        const S* plane = input + static_cast<size_t>(ic) * inputCstep;
+        T* dst = b + static_cast<size_t>(kk) * ldb;
+
+        int oy = n0 / g.outW;
+        int ox = n0 % g.outW;
+        for (int j = 0; j < nc;) {
+            //one run of output pixels on the same output row
+            const int run = std::min(nc - j, g.outW - ox);
+            const int iy = oy * g.strideH + ky * g.dilationH - g.padTop;
+            T* out = dst + j;
+            if (iy < 0 || iy >= g.inH) {
+                std::fill(out, out + run, T(0));
+            } else {
+                const S* src = plane + static_cast<size_t>(iy) * g.inW;
+                const int ixStart = ox * g.strideW + kx * g.dilationW - g.padLeft;
+                if (g.strideW == 1) {
+                    //contiguous: zeros left of the image, a copy, zeros right of it
+                    int lead = std::clamp(-ixStart, 0, run);
+                    int body = std::clamp(g.inW - ixStart, 0, run) - lead;
+                    body = std::max(body, 0);
+                    std::fill(out, out + lead, T(0));
+                    copy(src + ixStart + lead, out + lead, body);
+                    std::fill(out + lead + body, out + run, T(0));
+                } else {
+                    for (int t = 0; t < run; ++t) {
+                        int ix = ixStart + t * g.strideW;
+                        if (ix >= 0 && ix < g.inW) copy(src + ix, out + t, 1);
+                        else out[t] = T(0);
+                    }
+                }
+            }
+            j += run;
+            ox = 0;
+            ++oy;
+        }
+        std::fill(dst + nc, dst + ldb, T(0));
+    }
+}
+
+// im2col of an input already in the kernel's type: float, or int8_t for quantized inputs
+template <typename T>
+void packIm2col(const ConvGeometry& g, const T* input, size_t inputCstep, int k0, int kc, int n0, int nc, T* b, int ldb) {
+    packIm2colRuns(g, input, inputCstep, k0, kc, n0, nc, b, ldb, [](const T* src, T* dst, int count) { std::memcpy(dst, src, sizeof(T) * count); });
+}
+
+// im2col of a float or 16-bit input into float rows
+inline void packIm2col(const ConvGeometry& g, const ConvInput& input, int k0, int kc, int n0, int nc, float* b, int ldb) {
+    if (input.type == StorageType::Float32) return packIm2col(g, input.floats(), input.cstep, k0, kc, n0, nc, b, ldb);
+    packIm2colRuns(g, input.halves(), input.cstep, k0, kc, n0, nc, b, ldb,
+                   [&input](const uint16_t* src, float* dst, int count) { widenRow(src, dst, count, input.type); });
+}
+
+// c[rows x cols] (+)= a panel (kc x mr) * b (kc x nr, ldb floats per row)
+using GemmMicroKernel = void (*)(int kc, const float* a, const float* b, size_t ldb, float* c, size_t ldc, int rows, int cols,
+                                 bool accumulate);
+
+// write an mr x nr register tile that was spilled to `tile`, clipped to rows x cols
+inline void storeGemmTile(const float* tile, int nr, float* c, size_t ldc, int rows, int cols, bool accumulate) {
+    for (int i = 0; i < rows; ++i) {
+        float* dst = c + i * ldc;
+        const float* src = tile + i * nr;
+        if (accumulate) {
+            for (int j = 0; j < cols; ++j) dst[j] += src[j];
+        } else {
+            std::copy(src, src + cols, dst);
+        }
+    }
+}
+
+inline void gemmMicroKernelScalar(int kc, const float* a, const float* b, size_t ldb, float* c, size_t ldc, int rows, int cols,
+                                  bool accumulate) {
+    float acc[4][8] = {};
+    for (int p = 0; p < kc; ++p) {
+        const float* bp = b + p * ldb;
+        for (int i = 0; i < 4; ++i) {
+            for (int j = 0; j < 8; ++j) acc[i][j] += a[i] * bp[j];
+        }
+        a += 4;
+    }
+    storeGemmTile(&acc[0][0], 8, c, ldc, rows, cols, accumulate);
+}
+
+#if defined(UPSCALER_X86)
+UPSCALER_TARGET("avx2,fma")
+inline void gemmMicroKernelAVX2(int kc, const float* a, const float* b, size_t ldb, float* c, size_t ldc, int rows, int cols,
+                                bool accumulate) {
+    __m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps(), c02 = _mm256_setzero_ps();
+    __m256 c10 = _mm256_setzero_ps(), c11 = _mm256_setzero_ps(), c12 = _mm256_setzero_ps();
+    __m256 c20 = _mm256_setzero_ps(), c21 = _mm256_setzero_ps(), c22 = _mm256_setzero_ps();
+    __m256 c30 = _mm256_setzero_ps(), c31 = _mm256_setzero_ps(), c32 = _mm256_setzero_ps();
+    for (int p = 0; p < kc; ++p) {
+        const float* bp = b + p * ldb;
+        __m256 b0 = _mm256_loadu_ps(bp), b1 = _mm256_loadu_ps(bp + 8), b2 = _mm256_loadu_ps(bp + 16);
+        __m256 a0 = _mm256_broadcast_ss(a);
+        c00 = _mm256_fmadd_ps(a0, b0, c00); c01 = _mm256_fmadd_ps(a0, b1, c01); c02 = _mm256_fmadd_ps(a0, b2, c02);
+        __m256 a1 = _mm256_broadcast_ss(a + 1);
+        c10 = _mm256_fmadd_ps(a1, b0, c10); c11 = _mm256_fmadd_ps(a1, b1, c11); c12 = _mm256_fmadd_ps(a1, b2, c12);
+        __m256 a2 = _mm256_broadcast_ss(a + 2);
+        c20 = _mm256_fmadd_ps(a2, b0, c20); c21 = _mm256_fmadd_ps(a2, b1, c21); c22 = _mm256_fmadd_ps(a2, b2, c22);
+        __m256 a3 = _mm256_broadcast_ss(a + 3);
+        c30 = _mm256_fmadd_ps(a3, b0, c30); c31 = _mm256_fmadd_ps(a3, b1, c31); c32 = _mm256_fmadd_ps(a3, b2, c32);
+        a += 4;
+    }
+
+    alignas(32) float tile[4 * 24];
+    __m256 acc[12] = {c00, c01, c02, c10, c11, c12, c20, c21, c22, c30, c31, c32};
+    if (rows == 4 && cols == 24) {
+        for (int i = 0; i < 4; ++i) {
+            for (int v = 0; v < 3; ++v) {
+                float* dst = c + i * ldc + v * 8;
+                __m256 value = acc[i * 3 + v];
+                if (accumulate) value = _mm256_add_ps(value, _mm256_loadu_ps(dst));
+                _mm256_storeu_ps(dst, value);
+            }
+        }
+        return;
+    }
+    for (int i = 0; i < 12; ++i) _mm256_store_ps(tile + i * 8, acc[i]);
+    storeGemmTile(tile, 24, c, ldc, rows, cols, accumulate);
+}
+
+UPSCALER_TARGET("avx512f")
+inline void gemmMicroKernelAVX512(int kc, const float* a, const float* b, size_t ldb, float* c, size_t ldc, int rows, int cols,
+                                  bool accumulate) {
+    __m512 c00 = _mm512_setzero_ps(), c01 = _mm512_setzero_ps(), c10 = _mm512_setzero_ps(), c11 = _mm512_setzero_ps();
+    __m512 c20 = _mm512_setzero_ps(), c21 = _mm512_setzero_ps(), c30 = _mm512_setzero_ps(), c31 = _mm512_setzero_ps();
+    __m512 c40 = _mm512_setzero_ps(), c41 = _mm512_setzero_ps(), c50 = _mm512_setzero_ps(), c51 = _mm512_setzero_ps();
+    __m512 c60 = _mm512_setzero_ps(), c61 = _mm512_setzero_ps(), c70 = _mm512_setzero_ps(), c71 = _mm512_setzero_ps();
+    for (int p = 0; p < kc; ++p) {
+        const float* bp = b + p * ldb;
+        __m512 b0 = _mm512_loadu_ps(bp), b1 = _mm512_loadu_ps(bp + 16);
+        __m512 a0 = _mm512_set1_ps(a[0]);
+        c00 = _mm512_fmadd_ps(a0, b0, c00); c01 = _mm512_fmadd_ps(a0, b1, c01);
+        __m512 a1 = _mm512_set1_ps(a[1]);
+        c10 = _mm512_fmadd_ps(a1, b0, c10); c11 = _mm512_fmadd_ps(a1, b1, c11);
+        __m512 a2 = _mm512_set1_ps(a[2]);
+        c20 = _mm512_fmadd_ps(a2, b0, c20); c21 = _mm512_fmadd_ps(a2, b1, c21);
+        __m512 a3 = _mm512_set1_ps(a[3]);
+        c30 = _mm512_fmadd_ps(a3, b0, c30); c31 = _mm512_fmadd_ps(a3, b1, c31);
+        __m512 a4 = _mm512_set1_ps(a[4]);
+        c40 = _mm512_fmadd_ps(a4, b0, c40); c41 = _mm512_fmadd_ps(a4, b1, c41);
+        __m512 a5 = _mm512_set1_ps(a[5]);
+        c50 = _mm512_fmadd_ps(a5, b0, c50); c51 = _mm512_fmadd_ps(a5, b1, c51);
+        __m512 a6 = _mm512_set1_ps(a[6]);
+        c60 = _mm512_fmadd_ps(a6, b0, c60); c61 = _mm512_fmadd_ps(a6, b1, c61);
+        __m512 a7 = _mm512_set1_ps(a[7]);
+        c70 = _mm512_fmadd_ps(a7, b0, c70); c71 = _mm512_fmadd_ps(a7, b1, c71);
+        a += 8;
+    }
+
+    alignas(64) float tile[8 * 32];
+    __m512 acc[16] = {c00, c01, c10, c11, c20, c21, c30, c31, c40, c41, c50, c51, c60, c61, c70, c71};
+    if (rows == 8 && cols == 32) {
+        for (int i = 0; i < 8; ++i) {
+            for (int v = 0; v < 2; ++v) {
+                float* dst = c + i * ldc + v * 16;
+                __m512 value = acc[i * 2 + v];
+                if (accumulate) value = _mm512_add_ps(value, _mm512_loadu_ps(dst));
+                _mm512_storeu_ps(dst, value);
+            }
+        }
+        return;
+    }
+    for (int i = 0; i < 16; ++i) _mm512_store_ps(tile + i * 16, acc[i]);
+    storeGemmTile(tile, 32, c, ldc, rows, cols, accumulate);
+}
+#endif
+
+inline GemmMicroKernel gemmMicroKernel(const GemmTile& tile) {
+#if defined(UPSCALER_X86)
+    if (tile.mr == 8 && tile.nr == 32) return gemmMicroKernelAVX512;
+    if (tile.mr == 4 && tile.nr == 24) return gemmMicroKernelAVX2;
+#endif
+    return gemmMicroKernelScalar;
+}
+
+// output[oc] = sum over taps of weights * input, for every output pixel; output planes are
+// outputCstep floats apart. bias and activation are left to the caller's epilogue, which gets each
+// finished run of output values while it is still in cache: epilogue(oc, offset, values, count), where
+// values are the count pixels of channel oc starting at pixel offset (row-major) of the output plane.
+// with a null output the values live in a per-thread buffer and the epilogue stores them (16-bit outputs)
+template <typename Epilogue>
+void convolutionGemm(const ConvGeometry& g, const ConvInput& input, const PackedWeights& weights, float* output,
+                     size_t outputCstep, ThreadPool& pool, const Epilogue& epilogue) {
+    const int m = weights.m;
+    const int k = weights.k;
+    const int n = g.pixels();
+    const int mr = weights.tile.mr;
+    const int nr = weights.tile.nr;
+    const GemmMicroKernel kernel = gemmMicroKernel(weights.tile);
+
+    //split K evenly so the last block is not a sliver
+    const int kBlocks = (k + kGemmKc - 1) / kGemmKc;
+    const int kc = (k + kBlocks - 1) / kBlocks;
+    const int ldb = (kGemmNc + nr - 1) / nr * nr;
+    const int nBlocks = (n + kGemmNc - 1) / kGemmNc;
+
+    pool.parallelFor(nBlocks, [&](int block) {
+        thread_local std::vector<float> packed, staged;
+        packed.resize(static_cast<size_t>(kc) * ldb);
+        if (!output) staged.resize(static_cast<size_t>(m) * ldb);
+
+        const int n0 = block * kGemmNc;
+        const int nc = std::min(kGemmNc, n - n0);
+        float* c = output ? output + n0 : staged.data();
+        const size_t ldc = output ? outputCstep : ldb;
+        for (int k0 = 0; k0 < k; k0 += kc) {
+            const int kcBlock = std::min(kc, k - k0);
+            packIm2col(g, input, k0, kcBlock, n0, nc, packed.data(), ldb);
+            for (int j = 0; j < nc; j += nr) {
+                for (int i = 0; i < m; i += mr) {
+                    kernel(kcBlock, weights.panel(i / mr) + static_cast<size_t>(k0) * mr, packed.data() + j, ldb, c + i * ldc + j, ldc,
+                           std::min(mr, m - i), std::min(nr, nc - j), k0 > 0);
+                }
+            }
+        }
+        for (int oc = 0; oc < m; ++oc) epilogue(oc, static_cast<size_t>(n0), c + oc * ldc, nc);
+    });
+}
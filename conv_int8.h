@@ -0,0 +1,369 @@
+// int8 convolution for post-training-quantized models
+//
+// same im2col blocking as conv_gemm.h, with 8-bit operands and 32-bit accumulators. weights are
+// quantized per output channel at load (q = round(w * weightScale), weightScale = 127 / max|w|) and
+// the layer input once per forward with one per-tensor scale found by calibration. the products are
+// exact in int32, so every kernel gives the same bits; the micro-kernels dequantize the finished tile
+// by 1 / (weightScale * inputScale) as they store it.
+//
+// K is consumed 4 taps at a time: weight panels hold groups of 4 consecutive k for each of mr rows and
+// the im2col block holds groups of 4 k per pixel, so one 32-bit lane of each holds a 4-term dot
+// product. AVX-512 VNNI does that with one vpdpbusd per 16 lanes (8 x 32 tile); it wants unsigned x
+// signed bytes, so the packed input is offset by +128 and 128 * sum(q) is subtracted again per row.
+// AVX2 widens to 16 bits and uses pmaddwd (4 x 8 tile), and the portable kernel is 4 x 8.
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+#include "conv_gemm.h"
+
+constexpr int kInt8Nc = 256;
+
+inline bool int8HasVNNI(const CpuFeatures& features) { return features.avx512f && features.avx512vnni; }
+
+inline GemmTile int8Tile(SimdLevel level) {
+#if defined(UPSCALER_X86)
+    if (level == SimdLevel::AVX512 && int8HasVNNI(cpuFeatures())) return {8, 32};
+    if (level >= SimdLevel::AVX2 && cpuFeatures().avx2) return {4, 8};
+#endif
+    (void)level;
+    return {4, 8};
+}
+
+inline SimdLevel int8KernelLevel(SimdLevel level) {
+#if defined(UPSCALER_X86)
+    if (level == SimdLevel::AVX512 && int8HasVNNI(cpuFeatures())) return SimdLevel::AVX512;
+    if (level >= SimdLevel::AVX2 && cpuFeatures().avx2) return SimdLevel::AVX2;
+#endif
+    (void)level;
+    return SimdLevel::Scalar;
+}
+
+inline int8_t quantizeInt8(float value, float scale) {
+    float q = std::nearbyint(value * scale);
+    return static_cast<int8_t>(std::max(-127.0f, std::min(127.0f, q)));
+}
+
+// symmetric per-row scales for [m][k] weights; all-zero rows get scale 1
+inline std::vector<float> int8WeightScales(const float* weights, int m, int k) {
+    std::vector<float> scales(m, 1.0f);
+    for (int i = 0; i < m; ++i) {
+        float absMax = 0.0f;
+        for (int j = 0; j < k; ++j) absMax = std::max(absMax, std::fabs(weights[static_cast<size_t>(i) * k + j]));
+        if (absMax > 0.0f) scales[i] = 127.0f / absMax;
+    }
+    return scales;
+}
+
+// quantized weights in mr-row panels: panel p holds, for every group of 4 k, mr rows of 4 bytes each;
+// k is padded to a multiple of 4 and rows past m are zero
+struct Int8Weights {
+    int m = 0;
+    int k = 0;
+    int kGroups = 0;
+    GemmTile tile{4, 8};
+    SimdLevel level = SimdLevel::Scalar;
+    std::vector<int8_t> data;
+    std::vector<float> scales;       //per row
+    std::vector<int32_t> correction; //per row, subtracted from the accumulator (the VNNI input offset)
+
+    bool empty() const { return data.empty(); }
+    const int8_t* panel(int p) const { return data.data() + static_cast<size_t>(p) * kGroups * tile.mr * 4; }
+};
+
+// q is [m][k] row-major, already quantized with the given per-row scales
+inline Int8Weights packInt8Weights(const int8_t* q, const float* scales, int m, int k, SimdLevel level) {
+    Int8Weights packed;
+    packed.m = m;
+    packed.k = k;
+    packed.kGroups = (k + 3) / 4;
+    packed.level = int8KernelLevel(level);
+    packed.tile = int8Tile(packed.level);
+    packed.scales.assign(scales, scales + m);
+    packed.correction.assign(m, 0);
+    const int mr = packed.tile.mr;
+    const int panels = (m + mr - 1) / mr;
+    packed.data.assign(static_cast<size_t>(panels) * packed.kGroups * mr * 4, 0);
+    for (int i = 0; i < m; ++i) {
+        int8_t* dst = packed.data.data() + static_cast<size_t>(i / mr) * packed.kGroups * mr * 4 + (i % mr) * 4;
+        int32_t sum = 0;
+        for (int kk = 0; kk < k; ++kk) {
+            int8_t value = q[static_cast<size_t>(i) * k + kk];
+            dst[(kk / 4) * mr * 4 + kk % 4] = value;
+            sum += value;
+        }
+        if (packed.level == SimdLevel::AVX512) packed.correction[i] = 128 * sum;
+    }
+    return packed;
+}
+
+// quantize count values into int8 with one scale (cvtps rounds to nearest even, like nearbyint)
+inline void quantizeInt8RowScalar(const float* src, int8_t* dst, size_t count, float scale) {
+    for (size_t i = 0; i < count; ++i) dst[i] = quantizeInt8(src[i], scale);
+}
+
+#if defined(UPSCALER_X86)
+UPSCALER_TARGET("avx2")
+inline void quantizeInt8RowAVX2(const float* src, int8_t* dst, size_t count, float scale) {
+    const __m256 s = _mm256_set1_ps(scale);
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+    const __m256i low = _mm256_set1_epi8(-127);
+    size_t i = 0;
+    for (; i + 32 <= count; i += 32) {
+        __m256i a = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(src + i), s));
+        __m256i b = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(src + i + 8), s));
+        __m256i c = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(src + i + 16), s));
+        __m256i d = _mm256_cvtps_epi32(_mm256_mul_ps(_mm256_loadu_ps(src + i + 24), s));
+        //the saturating packs work per 128-bit lane; the permute restores the order
+        __m256i bytes = _mm256_packs_epi16(_mm256_packs_epi32(a, b), _mm256_packs_epi32(c, d));
+        bytes = _mm256_max_epi8(_mm256_permutevar8x32_epi32(bytes, order), low);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), bytes);
+    }
+    quantizeInt8RowScalar(src + i, dst + i, count - i, scale);
+}
+
+UPSCALER_TARGET("avx512f")
+inline void quantizeInt8RowAVX512(const float* src, int8_t* dst, size_t count, float scale) {
+    const __m512 s = _mm512_set1_ps(scale);
+    const __m128i low = _mm_set1_epi8(-127);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m128i bytes = _mm512_cvtsepi32_epi8(_mm512_cvtps_epi32(_mm512_mul_ps(_mm512_loadu_ps(src + i), s)));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm_max_epi8(bytes, low));
+    }
+    quantizeInt8RowScalar(src + i, dst + i, count - i, scale);
+}
+#endif
+
+inline void quantizeInt8Row(const float* src, int8_t* dst, size_t count, float scale, SimdLevel level) {
+#if defined(UPSCALER_X86)
+    if (level == SimdLevel::AVX512) return quantizeInt8RowAVX512(src, dst, count, scale);
+    if (level == SimdLevel::AVX2) return quantizeInt8RowAVX2(src, dst, count, scale);
+#endif
+    (void)level;
+    quantizeInt8RowScalar(src, dst, count, scale);
+}
+
+// interleave 4 im2col rows of ldb bytes into groups of 4 bytes per pixel (ldb is a multiple of 16);
+// offset adds 128 to every byte (flips the sign bit) for the unsigned operand of vpdpbusd
+inline void interleaveInt8Rows(const int8_t* rows, int ldb, int8_t* dst, bool offset) {
+    const int8_t* r0 = rows;
+    const int8_t* r1 = rows + ldb;
+    const int8_t* r2 = rows + 2 * ldb;
+    const int8_t* r3 = rows + 3 * ldb;
+#if defined(UPSCALER_X86)
+    const __m128i flip = _mm_set1_epi8(offset ? static_cast<char>(0x80) : 0);
+    for (int n = 0; n < ldb; n += 16) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(r0 + n));
+        __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(r1 + n));
+        __m128i c = _mm_loadu_si128(reinterpret_cast<const __m128i*>(r2 + n));
+        __m128i d = _mm_loadu_si128(reinterpret_cast<const __m128i*>(r3 + n));
+        __m128i abLo = _mm_unpacklo_epi8(a, b), abHi = _mm_unpackhi_epi8(a, b);
+        __m128i cdLo = _mm_unpacklo_epi8(c, d), cdHi = _mm_unpackhi_epi8(c, d);
+        __m128i* out = reinterpret_cast<__m128i*>(dst + n * 4);
+        _mm_storeu_si128(out, _mm_xor_si128(_mm_unpacklo_epi16(abLo, cdLo), flip));
+        _mm_storeu_si128(out + 1, _mm_xor_si128(_mm_unpackhi_epi16(abLo, cdLo), flip));
+        _mm_storeu_si128(out + 2, _mm_xor_si128(_mm_unpacklo_epi16(abHi, cdHi), flip));
+        _mm_storeu_si128(out + 3, _mm_xor_si128(_mm_unpackhi_epi16(abHi, cdHi), flip));
+    }
+#else
+    const int8_t flip = offset ? static_cast<int8_t>(-128) : 0;
+    for (int n = 0; n < ldb; ++n) {
+        dst[n * 4] = r0[n] ^ flip;
+        dst[n * 4 + 1] = r1[n] ^ flip;
+        dst[n * 4 + 2] = r2[n] ^ flip;
+        dst[n * 4 + 3] = r3[n] ^ flip;
+    }
+#endif
+}
+
+// c[rows x cols] = (a panel (kGroups x mr x 4) * b (kGroups x ldb x 4) - correction) * scale, with one
+// correction and scale per row; c is float, ldc values per row
+using Int8MicroKernel = void (*)(int kGroups, const int8_t* a, const int8_t* b, size_t ldb, float* c, size_t ldc, int rows,
+                                 int cols, const int32_t* correction, const float* scale);
+
+inline void int8MicroKernelScalar(int kGroups, const int8_t* a, const int8_t* b, size_t ldb, float* c, size_t ldc, int rows,
+                                  int cols, const int32_t* correction, const float* scale) {
+    int32_t acc[4][8] = {};
+    for (int p = 0; p < kGroups; ++p) {
+        const int8_t* bp = b + p * ldb * 4;
+        for (int i = 0; i < 4; ++i) {
+            for (int j = 0; j < 8; ++j) {
+                for (int t = 0; t < 4; ++t) acc[i][j] += a[i * 4 + t] * bp[j * 4 + t];
+            }
+        }
+        a += 16;
+    }
+    for (int i = 0; i < rows; ++i) {
+        for (int j = 0; j < cols; ++j) c[i * ldc + j] = static_cast<float>(acc[i][j] - correction[i]) * scale[i];
+    }
+}
+
+#if defined(UPSCALER_X86)
+UPSCALER_TARGET("avx2")
+inline void int8MicroKernelAVX2(int kGroups, const int8_t* a, const int8_t* b, size_t ldb, float* c, size_t ldc, int rows,
+                                int cols, const int32_t* correction, const float* scale) {
+    //each pmaddwd lane holds half of a 4-term dot product; the halves are folded after the loop
+    __m256i c00 = _mm256_setzero_si256(), c01 = _mm256_setzero_si256(), c10 = _mm256_setzero_si256(), c11 = _mm256_setzero_si256();
+    __m256i c20 = _mm256_setzero_si256(), c21 = _mm256_setzero_si256(), c30 = _mm256_setzero_si256(), c31 = _mm256_setzero_si256();
+    for (int p = 0; p < kGroups; ++p) {
+        const int8_t* bp = b + p * ldb * 4;
+        __m256i b0 = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(bp)));
+        __m256i b1 = _mm256_cvtepi8_epi16(_mm_loadu_si128(reinterpret_cast<const __m128i*>(bp + 16)));
+        int32_t w;
+        std::memcpy(&w, a, 4);
+        __m256i a0 = _mm256_cvtepi8_epi16(_mm_set1_epi32(w));
+        c00 = _mm256_add_epi32(c00, _mm256_madd_epi16(a0, b0)); c01 = _mm256_add_epi32(c01, _mm256_madd_epi16(a0, b1));
+        std::memcpy(&w, a + 4, 4);
+        __m256i a1 = _mm256_cvtepi8_epi16(_mm_set1_epi32(w));
+        c10 = _mm256_add_epi32(c10, _mm256_madd_epi16(a1, b0)); c11 = _mm256_add_epi32(c11, _mm256_madd_epi16(a1, b1));
+        std::memcpy(&w, a + 8, 4);
+        __m256i a2 = _mm256_cvtepi8_epi16(_mm_set1_epi32(w));
+        c20 = _mm256_add_epi32(c20, _mm256_madd_epi16(a2, b0)); c21 = _mm256_add_epi32(c21, _mm256_madd_epi16(a2, b1));
+        std::memcpy(&w, a + 12, 4);
+        __m256i a3 = _mm256_cvtepi8_epi16(_mm_set1_epi32(w));
+        c30 = _mm256_add_epi32(c30, _mm256_madd_epi16(a3, b0)); c31 = _mm256_add_epi32(c31, _mm256_madd_epi16(a3, b1));
+        a += 16;
+    }
+
+    //hadd gives pixels 0 1 4 5 | 2 3 6 7; the permute puts them back in order
+    __m256i acc[4] = {_mm256_permute4x64_epi64(_mm256_hadd_epi32(c00, c01), 0xD8),
+                      _mm256_permute4x64_epi64(_mm256_hadd_epi32(c10, c11), 0xD8),
+                      _mm256_permute4x64_epi64(_mm256_hadd_epi32(c20, c21), 0xD8),
+                      _mm256_permute4x64_epi64(_mm256_hadd_epi32(c30, c31), 0xD8)};
+    alignas(32) float tile[8];
+    for (int i = 0; i < rows; ++i) {
+        __m256i value = _mm256_sub_epi32(acc[i], _mm256_set1_epi32(correction[i]));
+        __m256 result = _mm256_mul_ps(_mm256_cvtepi32_ps(value), _mm256_set1_ps(scale[i]));
+        if (cols == 8) {
+            _mm256_storeu_ps(c + i * ldc, result);
+        } else {
+            _mm256_store_ps(tile, result);
+            std::copy(tile, tile + cols, c + i * ldc);
+        }
+    }
+}
+
+// b is already offset by +128 (see interleaveInt8Rows)
+UPSCALER_TARGET("avx512f,avx512vnni")
+inline void int8MicroKernelVNNI(int kGroups, const int8_t* a, const int8_t* b, size_t ldb, float* c, size_t ldc, int rows,
+                                int cols, const int32_t* correction, const float* scale) {
+    __m512i c00 = _mm512_setzero_si512(), c01 = _mm512_setzero_si512(), c10 = _mm512_setzero_si512(), c11 = _mm512_setzero_si512();
+    __m512i c20 = _mm512_setzero_si512(), c21 = _mm512_setzero_si512(), c30 = _mm512_setzero_si512(), c31 = _mm512_setzero_si512();
+    __m512i c40 = _mm512_setzero_si512(), c41 = _mm512_setzero_si512(), c50 = _mm512_setzero_si512(), c51 = _mm512_setzero_si512();
+    __m512i c60 = _mm512_setzero_si512(), c61 = _mm512_setzero_si512(), c70 = _mm512_setzero_si512(), c71 = _mm512_setzero_si512();
+    for (int p = 0; p < kGroups; ++p) {
+        const int8_t* bp = b + p * ldb * 4;
+        __m512i b0 = _mm512_loadu_si512(bp), b1 = _mm512_loadu_si512(bp + 64);
+        int32_t w[8]; //4 weights of one row per lane
+        std::memcpy(w, a, sizeof(w));
+        __m512i a0 = _mm512_set1_epi32(w[0]);
+        c00 = _mm512_dpbusd_epi32(c00, b0, a0); c01 = _mm512_dpbusd_epi32(c01, b1, a0);
+        __m512i a1 = _mm512_set1_epi32(w[1]);
+        c10 = _mm512_dpbusd_epi32(c10, b0, a1); c11 = _mm512_dpbusd_epi32(c11, b1, a1);
+        __m512i a2 = _mm512_set1_epi32(w[2]);
+        c20 = _mm512_dpbusd_epi32(c20, b0, a2); c21 = _mm512_dpbusd_epi32(c21, b1, a2);
+        __m512i a3 = _mm512_set1_epi32(w[3]);
+        c30 = _mm512_dpbusd_epi32(c30, b0, a3); c31 = _mm512_dpbusd_epi32(c31, b1, a3);
+        __m512i a4 = _mm512_set1_epi32(w[4]);
+        c40 = _mm512_dpbusd_epi32(c40, b0, a4); c41 = _mm512_dpbusd_epi32(c41, b1, a4);
+        __m512i a5 = _mm512_set1_epi32(w[5]);
+        c50 = _mm512_dpbusd_epi32(c50, b0, a5); c51 = _mm512_dpbusd_epi32(c51, b1, a5);
+        __m512i a6 = _mm512_set1_epi32(w[6]);
+        c60 = _mm512_dpbusd_epi32(c60, b0, a6); c61 = _mm512_dpbusd_epi32(c61, b1, a6);
+        __m512i a7 = _mm512_set1_epi32(w[7]);
+        c70 = _mm512_dpbusd_epi32(c70, b0, a7); c71 = _mm512_dpbusd_epi32(c71, b1, a7);
+        a += 32;
+    }
+
+    __m512i acc[16] = {c00, c01, c10, c11, c20, c21, c30, c31, c40, c41, c50, c51, c60, c61, c70, c71};
+    const __mmask16 mask0 = static_cast<__mmask16>(cols >= 16 ? 0xFFFF : (1u << cols) - 1);
+    const __mmask16 mask1 = static_cast<__mmask16>(cols >= 32 ? 0xFFFF : cols <= 16 ? 0 : (1u << (cols - 16)) - 1);
+    for (int i = 0; i < rows; ++i) {
+        const __m512i offset = _mm512_set1_epi32(correction[i]);
+        const __m512 s = _mm512_set1_ps(scale[i]);
+        __m512 v0 = _mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_sub_epi32(acc[i * 2], offset)), s);
+        __m512 v1 = _mm512_mul_ps(_mm512_cvtepi32_ps(_mm512_sub_epi32(acc[i * 2 + 1], offset)), s);
+        _mm512_mask_storeu_ps(c + i * ldc, mask0, v0);
+        _mm512_mask_storeu_ps(c + i * ldc + 16, mask1, v1);
+    }
+}
+#endif
+
+inline Int8MicroKernel int8MicroKernel(SimdLevel level) {
+#if defined(UPSCALER_X86)
+    if (level == SimdLevel::AVX512) return int8MicroKernelVNNI;
+    if (level == SimdLevel::AVX2) return int8MicroKernelAVX2;
+#endif
+    (void)level;
+    return int8MicroKernelScalar;
+}
+
+// same contract as convolutionGemm; the input is quantized with inputScale first
+template <typename Epilogue>
+void convolutionInt8(const ConvGeometry& g, const ConvInput& input, float inputScale, const Int8Weights& weights,
+                     float* output, size_t outputCstep, ThreadPool& pool, const Epilogue& epilogue) {
+    const int m = weights.m;
+    const int k = weights.k;
+    const int n = g.pixels();
+    const int mr = weights.tile.mr;
+    const int nr = weights.tile.nr;
+    const Int8MicroKernel kernel = int8MicroKernel(weights.level);
+
+    const size_t inputCstep = input.cstep;
+    std::vector<int8_t> quantized(static_cast<size_t>(g.inC) * inputCstep);
+    pool.parallelFor(g.inC, [&](int c) {
+        const size_t plane = static_cast<size_t>(g.inW) * g.inH;
+        int8_t* dst = quantized.data() + c * inputCstep;
+        if (input.type == StorageType::Float32) {
+            quantizeInt8Row(input.floats() + c * inputCstep, dst, plane, inputScale, weights.level);
+            return;
+        }
+        float wide[1024];
+        for (size_t i = 0; i < plane; i += 1024) {
+            const size_t count = std::min<size_t>(1024, plane - i);
+            widenRow(input.halves() + c * inputCstep + i, wide, count, input.type);
+            quantizeInt8Row(wide, dst + i, count, inputScale, weights.level);
+        }
+    });
+
+    //whole K per block: the int32 tile cannot be re-quantized between k blocks, and a 256-pixel
+    //block of even a 576-deep im2col is only 144 KB of bytes
+    const int ldb = (kInt8Nc + 31) / 32 * 32;
+    const int nBlocks = (n + kInt8Nc - 1) / kInt8Nc;
+    const bool offset = weights.level == SimdLevel::AVX512;
+    std::vector<float> dequantize(m);
+    for (int oc = 0; oc < m; ++oc) dequantize[oc] = 1.0f / (weights.scales[oc] * inputScale);
+
+    pool.parallelFor(nBlocks, [&](int block) {
+        thread_local std::vector<int8_t> packed, rows;
+        thread_local std::vector<float> staged;
+        packed.resize(static_cast<size_t>(weights.kGroups) * ldb * 4);
+        rows.resize(static_cast<size_t>(4) * ldb);
+        if (!output) staged.resize(static_cast<size_t>(m) * ldb);
+
+        const int n0 = block * kInt8Nc;
+        const int nc = std::min(kInt8Nc, n - n0);
+        float* c = output ? output + n0 : staged.data();
+        const size_t ldc = output ? outputCstep : ldb;
+        for (int group = 0; group < weights.kGroups; ++group) {
+            const int k0 = group * 4;
+            const int kc = std::min(4, k - k0);
+            packIm2col(g, quantized.data(), inputCstep, k0, kc, n0, nc, rows.data(), ldb);
+            if (kc < 4) std::fill(rows.begin() + static_cast<size_t>(kc) * ldb, rows.end(), int8_t(0));
+            interleaveInt8Rows(rows.data(), ldb, packed.data() + static_cast<size_t>(group) * ldb * 4, offset);
+        }
+        for (int j = 0; j < nc; j += nr) {
+            for (int i = 0; i < m; i += mr) {
+                kernel(weights.kGroups, weights.panel(i / mr), packed.data() + static_cast<size_t>(j) * 4, ldb,
+                       c + i * ldc + j, ldc, std::min(mr, m - i), std::min(nr, nc - j),
+                       weights.correction.data() + i, dequantize.data() + i);
+            }
+        }
+        for (int oc = 0; oc < m; ++oc) epilogue(oc, static_cast<size_t>(n0), c + oc * ldc, nc);
+    });
+}
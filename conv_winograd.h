@@ -0,0 +1,361 @@
+// Winograd F(4x4, 3x3) convolution for 3x3 stride-1 layers
+//
+// each 4x4 block of output pixels is computed from a 6x6 input patch: the patch is transformed
+// (V = Bt d B), multiplied element-wise with the transformed kernel (U = G g Gt) and summed over
+// input channels, then transformed back (Y = At M A). 36 multiplies per 16 outputs instead of
+// 144, a 4x cut. summing over input channels is 36 independent GEMMs, M[xi] = U[xi] * V[xi]
+// (out x in times in x tiles), which reuse the SGEMM micro-kernels; U is transformed and packed
+// once at model load. tiles are processed in blocks of kWinogradTilesPerBlock so V and M stay in L2.
+// the transforms run over all tiles of a block at once, so the compiler vectorizes them.
+#pragma once
+
+#include <algorithm>
+#include <vector>
+#include "conv_gemm.h"
+#include "thread_pool.h"
+
+constexpr int kWinogradTilesPerBlock = 64;
+
+// transformed weights, one packed GEMM operand (out x in) per transform position
+struct WinogradWeights {
+    int outC = 0;
+    int inC = 0;
+    std::vector<PackedWeights> positions; //36
+
+    bool empty() const { return positions.empty(); }
+};
+
+// weights are ncnn's [out][in][3][3]
+inline WinogradWeights transformWinogradWeights(const float* weights, int outC, int inC, SimdLevel level) {
+    static const float G[6][3] = {
+        {1.0f / 4, 0.0f, 0.0f},
+        {-1.0f / 6, -1.0f / 6, -1.0f / 6},
+        {-1.0f / 6, 1.0f / 6, -1.0f / 6},
+        {1.0f / 24, 1.0f / 12, 1.0f / 6},
+        {1.0f / 24, -1.0f / 12, 1.0f / 6},
+        {0.0f, 0.0f, 1.0f},
+    };
+
+    std::vector<std::vector<float>> u(36, std::vector<float>(static_cast<size_t>(outC) * inC));
+    for (int oc = 0; oc < outC; ++oc) {
+        for (int ic = 0; ic < inC; ++ic) {
+            const float* g = weights + (static_cast<size_t>(oc) * inC + ic) * 9;
+            float gg[6][3]; //G g
+            for (int i = 0; i < 6; ++i) {
+                for (int j = 0; j < 3; ++j) gg[i][j] = G[i][0] * g[j] + G[i][1] * g[3 + j] + G[i][2] * g[6 + j];
+            }
+            for (int i = 0; i < 6; ++i) {
+                for (int j = 0; j < 6; ++j) {
+                    u[i * 6 + j][static_cast<size_t>(oc) * inC + ic] = gg[i][0] * G[j][0] + gg[i][1] * G[j][1] + gg[i][2] * G[j][2];
+                }
+            }
+        }
+    }
+
+    WinogradWeights transformed;
+    transformed.outC = outC;
+    transformed.inC = inC;
+    for (int xi = 0; xi < 36; ++xi) transformed.positions.push_back(packGemmWeights(u[xi].data(), outC, inC, level));
+    return transformed;
+}
+
+// 1-D transforms over n lanes (one lane per tile); src and dst are 6 input and 6 (Bt) or 4 (At) output rows
+using WinogradTransformKernel = void (*)(const float* const src[6], float* const dst[6], int n);
+
+// Bt along one axis
+inline void winogradInputTransformScalar(const float* const d[6], float* const r[6], int n) {
+    for (int j = 0; j < n; ++j) {
+        float d0 = d[0][j], d1 = d[1][j], d2 = d[2][j], d3 = d[3][j], d4 = d[4][j], d5 = d[5][j];
+        r[0][j] = 4 * d0 - 5 * d2 + d4;
+        r[1][j] = -4 * (d1 + d2) + d3 + d4;
+        r[2][j] = 4 * (d1 - d2) - d3 + d4;
+        r[3][j] = -2 * (d1 - d3) - d2 + d4;
+        r[4][j] = 2 * (d1 - d3) - d2 + d4;
+        r[5][j] = 4 * d1 - 5 * d3 + d5;
+    }
+}
+
+// At along one axis
+inline void winogradOutputTransformScalar(const float* const m[6], float* const o[6], int n) {
+    for (int j = 0; j < n; ++j) {
+        float m0 = m[0][j], m1 = m[1][j], m2 = m[2][j], m3 = m[3][j], m4 = m[4][j], m5 = m[5][j];
+        float a = m1 + m2, b = m1 - m2, c = m3 + m4, d = m3 - m4;
+        o[0][j] = m0 + a + c;
+        o[1][j] = b + 2 * d;
+        o[2][j] = a + 4 * c;
+        o[3][j] = b + 8 * d + m5;
+    }
+}
+
+#if defined(UPSCALER_X86)
+// the SIMD versions need n to be a multiple of their width (the block width is)
+UPSCALER_TARGET("sse2")
+inline void winogradInputTransformSSE2(const float* const d[6], float* const r[6], int n) {
+    const __m128 two = _mm_set1_ps(2), four = _mm_set1_ps(4), five = _mm_set1_ps(5);
+    for (int j = 0; j < n; j += 4) {
+        __m128 d0 = _mm_loadu_ps(d[0] + j), d1 = _mm_loadu_ps(d[1] + j), d2 = _mm_loadu_ps(d[2] + j);
+        __m128 d3 = _mm_loadu_ps(d[3] + j), d4 = _mm_loadu_ps(d[4] + j), d5 = _mm_loadu_ps(d[5] + j);
+        __m128 d13 = _mm_sub_ps(d1, d3), d42 = _mm_sub_ps(d4, d2);
+        _mm_storeu_ps(r[0] + j, _mm_sub_ps(_mm_add_ps(_mm_mul_ps(four, d0), d4), _mm_mul_ps(five, d2)));
+        _mm_storeu_ps(r[1] + j, _mm_sub_ps(_mm_add_ps(d3, d4), _mm_mul_ps(four, _mm_add_ps(d1, d2))));
+        _mm_storeu_ps(r[2] + j, _mm_add_ps(_mm_mul_ps(four, _mm_sub_ps(d1, d2)), _mm_sub_ps(d4, d3)));
+        _mm_storeu_ps(r[3] + j, _mm_sub_ps(d42, _mm_mul_ps(two, d13)));
+        _mm_storeu_ps(r[4] + j, _mm_add_ps(d42, _mm_mul_ps(two, d13)));
+        _mm_storeu_ps(r[5] + j, _mm_sub_ps(_mm_add_ps(_mm_mul_ps(four, d1), d5), _mm_mul_ps(five, d3)));
+    }
+}
+
+UPSCALER_TARGET("sse2")
+inline void winogradOutputTransformSSE2(const float* const m[6], float* const o[6], int n) {
+    const __m128 two = _mm_set1_ps(2), four = _mm_set1_ps(4), eight = _mm_set1_ps(8);
+    for (int j = 0; j < n; j += 4) {
+        __m128 m1 = _mm_loadu_ps(m[1] + j), m2 = _mm_loadu_ps(m[2] + j), m3 = _mm_loadu_ps(m[3] + j), m4 = _mm_loadu_ps(m[4] + j);
+        __m128 a = _mm_add_ps(m1, m2), b = _mm_sub_ps(m1, m2), c = _mm_add_ps(m3, m4), d = _mm_sub_ps(m3, m4);
+        _mm_storeu_ps(o[0] + j, _mm_add_ps(_mm_add_ps(_mm_loadu_ps(m[0] + j), a), c));
+        _mm_storeu_ps(o[1] + j, _mm_add_ps(b, _mm_mul_ps(two, d)));
+        _mm_storeu_ps(o[2] + j, _mm_add_ps(a, _mm_mul_ps(four, c)));
+        _mm_storeu_ps(o[3] + j, _mm_add_ps(_mm_add_ps(b, _mm_loadu_ps(m[5] + j)), _mm_mul_ps(eight, d)));
+    }
+}
+
+UPSCALER_TARGET("avx2,fma")
+inline void winogradInputTransformAVX2(const float* const d[6], float* const r[6], int n) {
+    const __m256 two = _mm256_set1_ps(2), four = _mm256_set1_ps(4), five = _mm256_set1_ps(5);
+    for (int j = 0; j < n; j += 8) {
+        __m256 d0 = _mm256_loadu_ps(d[0] + j), d1 = _mm256_loadu_ps(d[1] + j), d2 = _mm256_loadu_ps(d[2] + j);
+        __m256 d3 = _mm256_loadu_ps(d[3] + j), d4 = _mm256_loadu_ps(d[4] + j), d5 = _mm256_loadu_ps(d[5] + j);
+        __m256 d13 = _mm256_sub_ps(d1, d3), d42 = _mm256_sub_ps(d4, d2);
+        _mm256_storeu_ps(r[0] + j, _mm256_fnmadd_ps(five, d2, _mm256_fmadd_ps(four, d0, d4)));
+        _mm256_storeu_ps(r[1] + j, _mm256_fnmadd_ps(four, _mm256_add_ps(d1, d2), _mm256_add_ps(d3, d4)));
+        _mm256_storeu_ps(r[2] + j, _mm256_fmadd_ps(four, _mm256_sub_ps(d1, d2), _mm256_sub_ps(d4, d3)));
+        _mm256_storeu_ps(r[3] + j, _mm256_fnmadd_ps(two, d13, d42));
+        _mm256_storeu_ps(r[4] + j, _mm256_fmadd_ps(two, d13, d42));
+        _mm256_storeu_ps(r[5] + j, _mm256_fnmadd_ps(five, d3, _mm256_fmadd_ps(four, d1, d5)));
+    }
+}
+
+UPSCALER_TARGET("avx2,fma")
+inline void winogradOutputTransformAVX2(const float* const m[6], float* const o[6], int n) {
+    const __m256 two = _mm256_set1_ps(2), four = _mm256_set1_ps(4), eight = _mm256_set1_ps(8);
+    for (int j = 0; j < n; j += 8) {
+        __m256 m1 = _mm256_loadu_ps(m[1] + j), m2 = _mm256_loadu_ps(m[2] + j);
+        __m256 m3 = _mm256_loadu_ps(m[3] + j), m4 = _mm256_loadu_ps(m[4] + j);
+        __m256 a = _mm256_add_ps(m1, m2), b = _mm256_sub_ps(m1, m2), c = _mm256_add_ps(m3, m4), d = _mm256_sub_ps(m3, m4);
+        _mm256_storeu_ps(o[0] + j, _mm256_add_ps(_mm256_add_ps(_mm256_loadu_ps(m[0] + j), a), c));
+        _mm256_storeu_ps(o[1] + j, _mm256_fmadd_ps(two, d, b));
+        _mm256_storeu_ps(o[2] + j, _mm256_fmadd_ps(four, c, a));
+        _mm256_storeu_ps(o[3] + j, _mm256_fmadd_ps(eight, d, _mm256_add_ps(b, _mm256_loadu_ps(m[5] + j))));
+    }
+}
+
+UPSCALER_TARGET("avx512f")
+inline void winogradInputTransformAVX512(const float* const d[6], float* const r[6], int n) {
+    const __m512 two = _mm512_set1_ps(2), four = _mm512_set1_ps(4), five = _mm512_set1_ps(5);
+    for (int j = 0; j < n; j += 16) {
+        __m512 d0 = _mm512_loadu_ps(d[0] + j), d1 = _mm512_loadu_ps(d[1] + j), d2 = _mm512_loadu_ps(d[2] + j);
+        __m512 d3 = _mm512_loadu_ps(d[3] + j), d4 = _mm512_loadu_ps(d[4] + j), d5 = _mm512_loadu_ps(d[5] + j);
+        __m512 d13 = _mm512_sub_ps(d1, d3), d42 = _mm512_sub_ps(d4, d2);
+        _mm512_storeu_ps(r[0] + j, _mm512_fnmadd_ps(five, d2, _mm512_fmadd_ps(four, d0, d4)));
+        _mm512_storeu_ps(r[1] + j, _mm512_fnmadd_ps(four, _mm512_add_ps(d1, d2), _mm512_add_ps(d3, d4)));
+        _mm512_storeu_ps(r[2] + j, _mm512_fmadd_ps(four, _mm512_sub_ps(d1, d2), _mm512_sub_ps(d4, d3)));
+        _mm512_storeu_ps(r[3] + j, _mm512_fnmadd_ps(two, d13, d42));
+        _mm512_storeu_ps(r[4] + j, _mm512_fmadd_ps(two, d13, d42));
+        _mm512_storeu_ps(r[5] + j, _mm512_fnmadd_ps(five, d3, _mm512_fmadd_ps(four, d1, d5)));
+    }
+}
+
+UPSCALER_TARGET("avx512f")
+inline void winogradOutputTransformAVX512(const float* const m[6], float* const o[6], int n) {
+    const __m512 two = _mm512_set1_ps(2), four = _mm512_set1_ps(4), eight = _mm512_set1_ps(8);
+    for (int j = 0; j < n; j += 16) {
+        __m512 m1 = _mm512_loadu_ps(m[1] + j), m2 = _mm512_loadu_ps(m[2] + j);
+        __m512 m3 = _mm512_loadu_ps(m[3] + j), m4 = _mm512_loadu_ps(m[4] + j);
+        __m512 a = _mm512_add_ps(m1, m2), b = _mm512_sub_ps(m1, m2), c = _mm512_add_ps(m3, m4), d = _mm512_sub_ps(m3, m4);
+        _mm512_storeu_ps(o[0] + j, _mm512_add_ps(_mm512_add_ps(_mm512_loadu_ps(m[0] + j), a), c));
+        _mm512_storeu_ps(o[1] + j, _mm512_fmadd_ps(two, d, b));
+        _mm512_storeu_ps(o[2] + j, _mm512_fmadd_ps(four, c, a));
+        _mm512_storeu_ps(o[3] + j, _mm512_fmadd_ps(eight, d, _mm512_add_ps(b, _mm512_loadu_ps(m[5] + j))));
+    }
+}
+#endif
+
+// transforms matching the GEMM kernel the weights were packed for; the block width is a multiple of
+// its nr, and so of the vector width
+inline void winogradTransformKernels(const GemmTile& tile, WinogradTransformKernel& input, WinogradTransformKernel& output) {
+    input = winogradInputTransformScalar;
+    output = winogradOutputTransformScalar;
+#if defined(UPSCALER_X86)
+    if (tile.nr == 32) {
+        input = winogradInputTransformAVX512;
+        output = winogradOutputTransformAVX512;
+    } else if (tile.nr == 24) {
+        input = winogradInputTransformAVX2;
+        output = winogradOutputTransformAVX2;
+    } else if (cpuFeatures().sse2) {
+        input = winogradInputTransformSSE2;
+        output = winogradOutputTransformSSE2;
+    }
+#endif
+}
+
+// the 6x6 input patches of count tiles from one input plane, as 36 rows of ld values (row r * 6 + c
+// holds patch element (r, c) of every tile); origins[j] is tile j's patch offset in the plane, or -1
+// where the patch reaches into the padding
+template <typename S>
+void gatherWinogradPatches(const ConvGeometry& g, const S* plane, const int* origins, int tile0, int count, int tilesX, S* patch, int ld) {
+    for (int j = 0; j < count; ++j) {
+        if (origins[j] >= 0) {
+            const S* src = plane + origins[j];
+            for (int r = 0; r < 6; ++r, src += g.inW) {
+                for (int c = 0; c < 6; ++c) patch[(r * 6 + c) * ld + j] = src[c];
+            }
+            continue;
+        }
+        const int ty = (tile0 + j) / tilesX, tx = (tile0 + j) % tilesX;
+        const int y0 = ty * 4 - g.padTop, x0 = tx * 4 - g.padLeft;
+        for (int r = 0; r < 6; ++r) {
+            const int iy = y0 + r;
+            const bool rowInside = iy >= 0 && iy < g.inH;
+            for (int c = 0; c < 6; ++c) {
+                const int ix = x0 + c;
+                patch[(r * 6 + c) * ld + j] = rowInside && ix >= 0 && ix < g.inW ? plane[static_cast<size_t>(iy) * g.inW + ix] : S(0);
+            }
+        }
+    }
+}
+
+// same contract as convolutionGemm for a 3x3, stride 1, dilation 1 layer:
+// epilogue(oc, offset, values, count) runs on each output row segment a block of tiles has just stored
+template <typename Epilogue>
+void convolutionWinograd(const ConvGeometry& g, const ConvInput& input, const WinogradWeights& weights,
+                         float* output, size_t outputCstep, ThreadPool& pool, const Epilogue& epilogue) {
+    const int inC = weights.inC;
+    const int outC = weights.outC;
+    const GemmTile tile = weights.positions[0].tile;
+    const GemmMicroKernel kernel = gemmMicroKernel(tile);
+    WinogradTransformKernel inputTransform, outputTransform;
+    winogradTransformKernels(tile, inputTransform, outputTransform);
+    const int tilesX = (g.outW + 3) / 4;
+    const int tilesY = (g.outH + 3) / 4;
+    const int tileCount = tilesX * tilesY;
+    const int nt = kWinogradTilesPerBlock;
+    const int ld = (nt + tile.nr - 1) / tile.nr * tile.nr; //columns per row of V and M
+    const int blocks = (tileCount + nt - 1) / nt;
+
+    pool.parallelFor(blocks, [&](int block) {
+        thread_local std::vector<float> v, m, scratch, staged;
+        thread_local std::vector<uint16_t> patch16;
+        thread_local std::vector<int> origins;
+        v.resize(static_cast<size_t>(36) * inC * ld); //columns past `count` hold stale but finite values, their results are dropped
+        m.resize(static_cast<size_t>(36) * outC * ld);
+        //the transforms always run over the full block width; lanes past `count` are ignored
+        scratch.resize(static_cast<size_t>(36 + 36) * ld);
+        float* patch = scratch.data();
+        float* temp = scratch.data() + static_cast<size_t>(36) * ld;
+
+        const int tile0 = block * nt;
+        const int count = std::min(nt, tileCount - tile0);
+
+        //input offset of each tile's 6x6 patch, -1 where it needs padding
+        origins.resize(count);
+        for (int j = 0; j < count; ++j) {
+            const int ty = (tile0 + j) / tilesX, tx = (tile0 + j) % tilesX;
+            const int y0 = ty * 4 - g.padTop, x0 = tx * 4 - g.padLeft;
+            const bool inside = y0 >= 0 && x0 >= 0 && y0 + 6 <= g.inH && x0 + 6 <= g.inW;
+            origins[j] = inside ? y0 * g.inW + x0 : -1;
+        }
+
+        //input transform, all tiles of the block at once
+        if (input.type != StorageType::Float32) patch16.resize(static_cast<size_t>(36) * ld);
+        for (int ic = 0; ic < inC; ++ic) {
+            if (input.type == StorageType::Float32) {
+                gatherWinogradPatches(g, input.floats() + static_cast<size_t>(ic) * input.cstep, origins.data(), tile0, count, tilesX, patch, ld);
+            } else {
+                //gather the 16-bit values as they are, then widen each patch row in one go
+                gatherWinogradPatches(g, input.halves() + static_cast<size_t>(ic) * input.cstep, origins.data(), tile0, count, tilesX,
+                                      patch16.data(), ld);
+                for (int row = 0; row < 36; ++row) widenRow(patch16.data() + static_cast<size_t>(row) * ld, patch + static_cast<size_t>(row) * ld, count, input.type);
+            }
+            for (int c = 0; c < 6; ++c) {
+                const float* d[6];
+                float* r[6];
+                for (int i = 0; i < 6; ++i) {
+                    d[i] = patch + (i * 6 + c) * ld;
+                    r[i] = temp + (i * 6 + c) * ld;
+                }
+                inputTransform(d, r, ld);
+            }
+            for (int row = 0; row < 6; ++row) {
+                const float* d[6];
+                float* r[6];
+                for (int i = 0; i < 6; ++i) {
+                    d[i] = temp + (row * 6 + i) * ld;
+                    r[i] = v.data() + (static_cast<size_t>(row * 6 + i) * inC + ic) * ld;
+                }
+                inputTransform(d, r, ld);
+            }
+        }
+
+        //36 GEMMs: M[xi] (out x tiles) = U[xi] (out x in) * V[xi] (in x tiles)
+        for (int xi = 0; xi < 36; ++xi) {
+            const PackedWeights& u = weights.positions[xi];
+            const float* b = v.data() + static_cast<size_t>(xi) * inC * ld;
+            float* c = m.data() + static_cast<size_t>(xi) * outC * ld;
+            for (int k0 = 0; k0 < inC; k0 += kGemmKc) {
+                const int kc = std::min(kGemmKc, inC - k0);
+                for (int j = 0; j < count; j += tile.nr) {
+                    for (int i = 0; i < outC; i += tile.mr) {
+                        kernel(kc, u.panel(i / tile.mr) + static_cast<size_t>(k0) * tile.mr, b + static_cast<size_t>(k0) * ld + j, ld,
+                               c + static_cast<size_t>(i) * ld + j, ld, std::min(tile.mr, outC - i), std::min(tile.nr, count - j), k0 > 0);
+                    }
+                }
+            }
+        }
+
+        //output transform, epilogue and store, one output channel at a time. without an output the
+        //block's rows (whole output rows from its first tile row) are staged for the epilogue to store
+        const size_t base = output ? 0 : static_cast<size_t>(tile0 / tilesX) * 4 * g.outW;
+        if (!output) {
+            const int rowEnd = std::min(g.outH, ((tile0 + count - 1) / tilesX + 1) * 4);
+            staged.resize(static_cast<size_t>(rowEnd) * g.outW - base);
+        }
+        for (int oc = 0; oc < outC; ++oc) {
+            for (int c = 0; c < 6; ++c) {
+                const float* src[6];
+                float* dst[6];
+                for (int i = 0; i < 6; ++i) src[i] = m.data() + (static_cast<size_t>(i * 6 + c) * outC + oc) * ld;
+                for (int i = 0; i < 4; ++i) dst[i] = temp + (i * 6 + c) * ld;
+                outputTransform(src, dst, ld);
+            }
+            for (int row = 0; row < 4; ++row) {
+                const float* src[6];
+                float* dst[6];
+                for (int i = 0; i < 6; ++i) src[i] = temp + (row * 6 + i) * ld;
+                for (int i = 0; i < 4; ++i) dst[i] = patch + (row * 4 + i) * ld;
+                outputTransform(src, dst, ld);
+            }
+
+            float* plane = output ? output + static_cast<size_t>(oc) * outputCstep : staged.data(); //pixel offset base is plane[0]
+            for (int j = 0; j < count; ++j) {
+                const int ty = (tile0 + j) / tilesX, tx = (tile0 + j) % tilesX;
+                const int rows = std::min(4, g.outH - ty * 4), cols = std::min(4, g.outW - tx * 4);
+                for (int r = 0; r < rows; ++r) {
+                    float* dst = plane + (static_cast<size_t>(ty * 4 + r) * g.outW + tx * 4 - base);
+                    for (int c = 0; c < cols; ++c) dst[c] = patch[(r * 4 + c) * ld + j];
+                }
+            }
+
+            //the block covers runs of whole tiles in one or more tile rows; their output rows are contiguous
+            for (int j = 0; j < count;) {
+                const int ty = (tile0 + j) / tilesX, tx = (tile0 + j) % tilesX;
+                const int run = std::min(count - j, tilesX - tx);
+                const int x0 = tx * 4, width = std::min(g.outW, (tx + run) * 4) - x0;
+                for (int y = ty * 4; y < std::min(g.outH, ty * 4 + 4); ++y) {
+                    const size_t offset = static_cast<size_t>(y) * g.outW + x0;
+                    epilogue(oc, offset, plane + (offset - base), width);
+                }
+                j += run;
+            }
+        }
+    });
+}
@@ -0,0 +1,117 @@
+// Runtime CPU feature detection (cpuid) used to pick SIMD kernels at startup
+#pragma once
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define UPSCALER_X86 1
+#if defined(_MSC_VER)
+#include <intrin.h>
+#else
+#include <cpuid.h>
+#endif
+#include <immintrin.h>
+#endif
+
+// compile a single function for a wider ISA than the rest of the program
+// fp-contract is switched off so mul+add pairs are never fused into FMA, which keeps the
+// SIMD kernels bit-identical to the scalar reference
+#if defined(UPSCALER_X86) && defined(__clang__)
+#define UPSCALER_TARGET(isa) __attribute__((target(isa)))
+#elif defined(UPSCALER_X86) && defined(__GNUC__)
+#define UPSCALER_TARGET(isa) __attribute__((target(isa), optimize("fp-contract=off")))
+#else
+#define UPSCALER_TARGET(isa)
+#endif
+
+enum class SimdLevel { Scalar = 0, SSE2, AVX2, AVX512 };
+
+inline const char* simdLevelName(SimdLevel level) {
+    switch (level) {
+        case SimdLevel::SSE2: return "sse2";
+        case SimdLevel::AVX2: return "avx2";
+        case SimdLevel::AVX512: return "avx512";
+        default: return "scalar";
+    }
+}
+
+struct CpuFeatures {
+    bool sse2 = false;
+    bool avx2 = false;
+    bool fma = false;
+    bool f16c = false; // float <-> fp16 conversions (vcvtph2ps)
+    bool avx512f = false;
+    bool avx512bw = false; // byte/word ops on 512-bit registers (vpmaddwd, vpunpcklbw)
+    bool avx512vnni = false; // int8 dot products (vpdpbusd)
+};
+
+#if defined(UPSCALER_X86)
+inline void cpuidQuery(unsigned leaf, unsigned subleaf, unsigned regs[4]) {
+#if defined(_MSC_VER)
+    int out[4];
+    __cpuidex(out, static_cast<int>(leaf), static_cast<int>(subleaf));
+    for (int i = 0; i < 4; ++i) regs[i] = static_cast<unsigned>(out[i]);
+#else
+    if (!__get_cpuid_count(leaf, subleaf, &regs[0], &regs[1], &regs[2], &regs[3])) {
+        regs[0] = regs[1] = regs[2] = regs[3] = 0;
+    }
+#endif
+}
+
+//which register states the OS saves on context switch (XCR0)
+inline unsigned long long readXCR0() {
+#if defined(_MSC_VER)
+    return _xgetbv(0);
+#else
+    unsigned eax, edx;
+    __asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+    return (static_cast<unsigned long long>(edx) << 32) | eax;
+#endif
+}
+#endif
+
+inline CpuFeatures detectCpuFeatures() {
+    CpuFeatures features;
+#if defined(UPSCALER_X86)
+    unsigned leaf1[4], leaf7[4];
+    cpuidQuery(0, 0, leaf1);
+    unsigned maxLeaf = leaf1[0];
+    cpuidQuery(1, 0, leaf1);
+    if (maxLeaf >= 7) cpuidQuery(7, 0, leaf7);
+    else leaf7[0] = leaf7[1] = leaf7[2] = leaf7[3] = 0;
+
+    features.sse2 = (leaf1[3] >> 26) & 1;
+
+    //AVX state must be enabled by the OS, not just present in the CPU
+    bool osxsave = (leaf1[2] >> 27) & 1;
+    unsigned long long xcr0 = osxsave ? readXCR0() : 0;
+    bool avxState = (xcr0 & 0x6) == 0x6;
+    bool avx512State = (xcr0 & 0xE6) == 0xE6;
+
+    bool avx = ((leaf1[2] >> 28) & 1) && avxState;
+    features.avx2 = avx && ((leaf7[1] >> 5) & 1);
+    features.fma = avx && ((leaf1[2] >> 12) & 1);
+    features.f16c = avx && ((leaf1[2] >> 29) & 1);
+    features.avx512f = features.avx2 && avx512State && ((leaf7[1] >> 16) & 1);
+    features.avx512bw = features.avx512f && ((leaf7[1] >> 30) & 1);
+    features.avx512vnni = features.avx512f && ((leaf7[2] >> 11) & 1);
+#endif
+    return features;
+}
+
+inline const CpuFeatures& cpuFeatures() {
+    static const CpuFeatures features = detectCpuFeatures();
+    return features;
+}
+
+inline SimdLevel detectSimdLevel() {
+    const CpuFeatures& features = cpuFeatures();
+    if (features.avx512f) return SimdLevel::AVX512;
+    if (features.avx2) return SimdLevel::AVX2;
+    if (features.sse2) return SimdLevel::SSE2;
+    return SimdLevel::Scalar;
+}
+
+//kernel level used by default; chosen once at startup, can be lowered for testing
+inline SimdLevel& activeSimdLevel() {
+    static SimdLevel level = detectSimdLevel();
+    return level;
+}
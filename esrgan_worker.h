@@ -0,0 +1,319 @@
+// Persistent ESRGAN worker: load a model once, then upscale any number of images sent to it
+//
+// runESRGAN pays a process spawn and a model load for every image, which is most of the time on a
+// thumbnail. a worker ("./upscaler worker") keeps the net loaded and reads jobs from a stream:
+// stdin/stdout when a client spawned it (EsrganWorkerClient::spawn), or a Unix socket that any number
+// of clients connect to one after another ("./upscaler worker --socket PATH"). images travel as raw
+// 8-bit pixels, never as files. POSIX only.
+#pragma once
+
+#if !defined(_WIN32)
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "image.h"
+#include "nn_engine.h"
+#include "nn_tiling.h"
+#include "thread_pool.h"
+
+constexpr uint32_t kWorkerMagic = 0x4B524F57; //"WORK"
+
+// largest image a frame may carry (width * height * channels): the 4x reply for a 4460x2973 photo
+// (636 MB) fits, a corrupt header claiming 65536 x 65536 x 4 (16 GiB) does not
+constexpr uint64_t kMaxWorkerFrameBytes = uint64_t(1) << 30;
+
+// one image on the wire: this header, then height rows of width * channels bytes (no padding). a
+// reply with errorBytes > 0 carries that many bytes of error message instead of pixels; a job of
+// 0 x 0 pixels tells the worker to stop. fields are in the host's byte order (both ends are local)
+struct WorkerFrame {
+    uint32_t magic = kWorkerMagic;
+    int32_t width = 0, height = 0, channels = 0;
+    uint32_t errorBytes = 0;
+};
+
+// read size bytes; false on end of stream before the first byte, throws if it ends part way
+inline bool readFully(int fd, void* destination, size_t size) {
+    unsigned char* dst = static_cast<unsigned char*>(destination);
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = ::read(fd, dst + done, size - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) throw std::runtime_error(std::string("Worker stream read failed: ") + std::strerror(errno));
+        if (n == 0) {
+            if (done == 0) return false;
+            throw std::runtime_error("Worker stream ended in the middle of a frame");
+        }
+        done += static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// sockets are written without SIGPIPE, so a peer that went away is an exception, not a dead process
+inline void writeFully(int fd, const void* source, size_t size) {
+    const unsigned char* src = static_cast<const unsigned char*>(source);
+    size_t done = 0;
+    while (done < size) {
+        ssize_t n = ::send(fd, src + done, size - done, MSG_NOSIGNAL);
+        if (n < 0 && errno == ENOTSOCK) n = ::write(fd, src + done, size - done);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) throw std::runtime_error(std::string("Worker stream write failed: ") + std::strerror(errno));
+        done += static_cast<size_t>(n);
+    }
+}
+
+inline void writeImageFrame(int fd, const ConstImageView& image) {
+    WorkerFrame frame;
+    frame.width = image.width;
+    frame.height = image.height;
+    frame.channels = image.channels;
+    writeFully(fd, &frame, sizeof(frame));
+    for (int y = 0; y < image.height; ++y) writeFully(fd, image.row(y), image.rowBytes());
+}
+
+inline void writeErrorFrame(int fd, const std::string& message) {
+    WorkerFrame frame;
+    frame.errorBytes = static_cast<uint32_t>(message.size());
+    writeFully(fd, &frame, sizeof(frame));
+    writeFully(fd, message.data(), message.size());
+}
+
+// the next frame's header; false at the end of the stream
+inline bool readFrameHeader(int fd, WorkerFrame& frame) {
+    if (!readFully(fd, &frame, sizeof(frame))) return false;
+    //a corrupt header must not turn into a huge allocation: the pixel count is capped as a whole
+    if (frame.magic != kWorkerMagic || frame.width < 0 || frame.height < 0 || frame.channels < 0 || frame.channels > 4 ||
+        frame.errorBytes > (1u << 20)) {
+        throw std::runtime_error("Malformed worker frame");
+    }
+    const uint64_t pixels = static_cast<uint64_t>(frame.width) * static_cast<uint64_t>(frame.height);
+    if (pixels > 0 && frame.channels == 0) throw std::runtime_error("Malformed worker frame: an image without channels");
+    if (pixels * static_cast<uint64_t>(frame.channels) > kMaxWorkerFrameBytes) {
+        throw std::runtime_error("Malformed worker frame: " + std::to_string(frame.width) + "x" + std::to_string(frame.height) + "x" +
+                                 std::to_string(frame.channels) + " is over the frame size limit");
+    }
+    return true;
+}
+
+inline Image readImageRows(int fd, const WorkerFrame& frame) {
+    Image image(frame.width, frame.height, frame.channels);
+    for (int y = 0; y < image.height; ++y) {
+        if (!readFully(fd, image.row(y), static_cast<size_t>(image.width) * image.channels)) {
+            throw std::runtime_error("Worker stream ended in the middle of a frame");
+        }
+    }
+    return image;
+}
+
+// read past a job's pixels without keeping them, a row at a time
+inline void skipImageRows(int fd, const WorkerFrame& frame) {
+    std::vector<unsigned char> row(static_cast<size_t>(frame.width) * frame.channels);
+    for (int y = 0; y < frame.height; ++y) {
+        if (!readFully(fd, row.data(), row.size())) throw std::runtime_error("Worker stream ended in the middle of a frame");
+    }
+}
+
+// bytes of the reply net makes for a job, from the scale of a 16x16 probe (the job's own width times
+// the scale can overflow an int)
+inline uint64_t workerReplyBytes(const Net& net, const WorkerFrame& job) {
+    const TensorShape probe = net.outputShape(16, 16, job.channels);
+    return static_cast<uint64_t>(job.width) * static_cast<uint64_t>(job.height) * static_cast<uint64_t>(probe.w) *
+           static_cast<uint64_t>(probe.h) * static_cast<uint64_t>(probe.c) / 256;
+}
+
+// answer jobs from in on out until the stream ends (true) or a client sends the stop job (false). a
+// job that fails, or whose reply would be over the frame limit, gets an error reply and the worker
+// carries on with the next one
+inline bool serveWorker(const Net& net, int in, int out, const TileOptions& tiles, ThreadPool& pool = globalThreadPool()) {
+    WorkerFrame job;
+    while (readFrameHeader(in, job)) {
+        if (job.width == 0 && job.height == 0) return false;
+        Image output;
+        std::string error;
+        //a reply over the frame limit would only be refused by the client after all the work, so the
+        //job's pixels are read past (keeping the stream in step) and it is answered with an error
+        if (workerReplyBytes(net, job) > kMaxWorkerFrameBytes) {
+            skipImageRows(in, job);
+            error = "Upscaling " + std::to_string(job.width) + "x" + std::to_string(job.height) + "x" + std::to_string(job.channels) +
+                    " would make a reply over the frame size limit";
+        } else {
+            Image input = readImageRows(in, job);
+            try {
+                output = esrganUpscaleTiled(net, input.view(), tiles, pool);
+            } catch (const std::exception& e) {
+                error = e.what();
+            }
+        }
+        if (error.empty()) {
+            writeImageFrame(out, output.view());
+        } else {
+            writeErrorFrame(out, error);
+        }
+    }
+    return true;
+}
+
+// listen on a Unix socket at path and serve each connection in turn until one sends the stop job
+inline void serveWorkerSocket(const Net& net, const std::string& path, const TileOptions& tiles, ThreadPool& pool = globalThreadPool()) {
+    sockaddr_un address{};
+    address.sun_family = AF_UNIX;
+    if (path.size() >= sizeof(address.sun_path)) throw std::runtime_error("Socket path is too long: " + path);
+    std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+    int listener = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0) throw std::runtime_error(std::string("socket failed: ") + std::strerror(errno));
+    ::unlink(path.c_str());
+    if (::bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 || ::listen(listener, 8) != 0) {
+        const std::string reason = std::strerror(errno);
+        ::close(listener);
+        throw std::runtime_error("Failed to listen on " + path + ": " + reason);
+    }
+    std::cerr << "Worker listening on " << path << "\n";
+
+    bool serving = true;
+    while (serving) {
+        int connection = ::accept(listener, nullptr, nullptr);
+        if (connection < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        try {
+            serving = serveWorker(net, connection, connection, tiles, pool);
+        } catch (const std::exception& e) {
+            std::cerr << "Worker connection dropped: " << e.what() << "\n"; //the next client still gets served
+        }
+        ::close(connection);
+    }
+    ::close(listener);
+    ::unlink(path.c_str());
+}
+
+// the client end: send images to a worker and get the upscaled ones back, one job at a time
+class EsrganWorkerClient {
+public:
+    // talk to a worker on an open stream socket, taking it over; pid is the worker process to wait
+    // for on close, if this client started it
+    explicit EsrganWorkerClient(int fd, pid_t pid = -1) : fd(fd), pid(pid) {}
+
+    EsrganWorkerClient(EsrganWorkerClient&& other) noexcept : fd(other.fd), pid(other.pid) {
+        other.fd = -1;
+        other.pid = -1;
+    }
+    EsrganWorkerClient& operator=(EsrganWorkerClient&& other) noexcept {
+        if (this != &other) {
+            close();
+            std::swap(fd, other.fd);
+            std::swap(pid, other.pid);
+        }
+        return *this;
+    }
+    EsrganWorkerClient(const EsrganWorkerClient&) = delete;
+    EsrganWorkerClient& operator=(const EsrganWorkerClient&) = delete;
+    ~EsrganWorkerClient() { close(); }
+
+    // start "executable worker args..." with its stdin and stdout on a socket to this client
+    static EsrganWorkerClient spawn(const std::string& executable, const std::vector<std::string>& args) {
+        int fds[2];
+        if (::socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) throw std::runtime_error(std::string("socketpair failed: ") + std::strerror(errno));
+        //other workers must not inherit this client's end, or they keep it open after it closes
+        ::fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+
+        //built before fork: the child only dup2s and execs
+        std::vector<std::string> words = {executable, "worker"};
+        words.insert(words.end(), args.begin(), args.end());
+        std::vector<char*> argv;
+        for (std::string& word : words) argv.push_back(word.data());
+        argv.push_back(nullptr);
+
+        pid_t child = ::fork();
+        if (child < 0) {
+            ::close(fds[0]);
+            ::close(fds[1]);
+            throw std::runtime_error(std::string("fork failed: ") + std::strerror(errno));
+        }
+        if (child == 0) {
+            ::dup2(fds[1], 0);
+            ::dup2(fds[1], 1);
+            ::close(fds[1]);
+            ::execv(argv[0], argv.data());
+            ::_exit(127);
+        }
+        ::close(fds[1]);
+        return EsrganWorkerClient(fds[0], child);
+    }
+
+    // connect to a worker listening on a Unix socket, waiting up to timeoutSeconds for it to come up
+    static EsrganWorkerClient connect(const std::string& path, double timeoutSeconds = 30.0) {
+        sockaddr_un address{};
+        address.sun_family = AF_UNIX;
+        if (path.size() >= sizeof(address.sun_path)) throw std::runtime_error("Socket path is too long: " + path);
+        std::memcpy(address.sun_path, path.c_str(), path.size() + 1);
+
+        const auto deadline = std::chrono::steady_clock::now() + std::chrono::duration<double>(timeoutSeconds);
+        for (;;) {
+            int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+            if (fd < 0) throw std::runtime_error(std::string("socket failed: ") + std::strerror(errno));
+            if (::connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof(address)) == 0) return EsrganWorkerClient(fd);
+            ::close(fd);
+            if (std::chrono::steady_clock::now() > deadline) throw std::runtime_error("No worker listening on " + path);
+            std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+    }
+
+    // upscale one image; throws with the worker's message if the job failed
+    Image upscale(const ConstImageView& image) {
+        if (fd < 0) throw std::runtime_error("Worker connection is closed");
+        if (image.width == 0 || image.height == 0) throw std::runtime_error("Cannot upscale an empty image");
+        writeImageFrame(fd, image);
+        WorkerFrame reply;
+        if (!readFrameHeader(fd, reply)) throw std::runtime_error("Worker exited");
+        if (reply.errorBytes > 0) {
+            std::string message(reply.errorBytes, '\0');
+            readFully(fd, message.data(), message.size());
+            throw std::runtime_error("Worker job failed: " + message);
+        }
+        return readImageRows(fd, reply);
+    }
+
+    // ask the worker to exit (a socket worker stops listening too), then close
+    void stop() {
+        if (fd >= 0) writeFully(fd, &kStopJob, sizeof(kStopJob));
+        close();
+    }
+
+    // close the stream; a spawned worker sees it end, exits, and is waited for
+    void close() {
+        if (fd >= 0) ::close(fd);
+        fd = -1;
+        if (pid > 0) ::waitpid(pid, nullptr, 0);
+        pid = -1;
+    }
+
+private:
+    static constexpr WorkerFrame kStopJob{};
+    int fd = -1;
+    pid_t pid = -1;
+};
+
+// path of the running executable, to spawn workers from (argv[0] where /proc is not available)
+inline std::string selfExecutable(const char* argv0) {
+    char path[4096];
+    ssize_t length = ::readlink("/proc/self/exe", path, sizeof(path) - 1);
+    if (length > 0) return std::string(path, static_cast<size_t>(length));
+    return argv0;
+}
+
+#endif
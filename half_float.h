@@ -0,0 +1,228 @@
+// 16-bit floats for the native engine: fp16 (the ncnn weight format) and bf16 activation storage
+//
+// bf16 is the top half of a float: the same 8-bit exponent and range, a 7-bit mantissa (~2-3
+// significant digits). fp16 keeps 10 mantissa bits but only 5 exponent bits, so it tops out at
+// 65504, which the Real-ESRGAN activations stay well inside. narrowing rounds to nearest even.
+// whole rows convert with AVX-512, AVX2 (F16C for fp16) or scalar code, picked per call from
+// activeSimdLevel(); every path gives the same bits as the scalar one (except NaN payloads).
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include "cpu_features.h"
+
+// how a tensor stores its values
+enum class StorageType { Float32, BFloat16, Float16 };
+
+inline const char* storageTypeName(StorageType type) {
+    switch (type) {
+        case StorageType::BFloat16: return "bf16";
+        case StorageType::Float16: return "fp16";
+        default: return "fp32";
+    }
+}
+
+// inverse of storageTypeName
+inline StorageType parseStorageType(const std::string& name) {
+    for (StorageType type : {StorageType::Float32, StorageType::BFloat16, StorageType::Float16}) {
+        if (name == storageTypeName(type)) return type;
+    }
+    throw std::runtime_error("Unknown storage type " + name + " (fp32, bf16 or fp16)");
+}
+
+inline size_t storageBytes(StorageType type) { return type == StorageType::Float32 ? 4 : 2; }
+
+inline float halfToFloat(uint16_t half) {
+    uint32_t sign = static_cast<uint32_t>(half & 0x8000) << 16;
+    uint32_t exponent = (half >> 10) & 0x1F;
+    uint32_t mantissa = half & 0x3FF;
+    uint32_t bits;
+
+    if (exponent == 0) {
+        if (mantissa == 0) {
+            bits = sign;
+        } else {
+            //subnormal half: normalize into a float exponent
+            exponent = 127 - 15 + 1;
+            while (!(mantissa & 0x400)) {
+                mantissa <<= 1;
+                --exponent;
+            }
+            bits = sign | (exponent << 23) | ((mantissa & 0x3FF) << 13);
+        }
+    } else if (exponent == 0x1F) {
+        bits = sign | 0x7F800000 | (mantissa << 13);
+    } else {
+        bits = sign | ((exponent + 127 - 15) << 23) | (mantissa << 13);
+    }
+
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+// round to nearest even; out of range values become infinity
+inline uint16_t floatToHalf(float value) {
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    uint16_t sign = static_cast<uint16_t>((bits >> 16) & 0x8000);
+    uint32_t magnitude = bits & 0x7FFFFFFF;
+
+    if (magnitude >= 0x7F800000) return sign | 0x7C00 | (magnitude > 0x7F800000 ? 0x200 : 0);
+    if (magnitude >= 0x477FF000) return sign | 0x7C00;
+    if (magnitude < 0x38800000) {
+        //subnormal half (or zero): let the float adder do the rounding
+        float shifted;
+        std::memcpy(&shifted, &magnitude, sizeof(shifted));
+        shifted += 0.5f;
+        uint32_t shiftedBits;
+        std::memcpy(&shiftedBits, &shifted, sizeof(shiftedBits));
+        return sign | static_cast<uint16_t>(shiftedBits - 0x3F000000);
+    }
+    uint32_t mantissaOdd = (magnitude >> 13) & 1;
+    magnitude += 0xC8000FFF + mantissaOdd; //rebias exponent and round
+    return sign | static_cast<uint16_t>(magnitude >> 13);
+}
+
+inline float bfloat16ToFloat(uint16_t value) {
+    uint32_t bits = static_cast<uint32_t>(value) << 16;
+    float result;
+    std::memcpy(&result, &bits, sizeof(result));
+    return result;
+}
+
+// round to nearest even; NaNs stay (quiet) NaNs instead of rounding into infinity
+inline uint16_t floatToBFloat16(float value) {
+    uint32_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    if ((bits & 0x7FFFFFFF) > 0x7F800000) return static_cast<uint16_t>((bits >> 16) | 0x40);
+    bits += 0x7FFF + ((bits >> 16) & 1);
+    return static_cast<uint16_t>(bits >> 16);
+}
+
+inline void widenRowScalar(const uint16_t* src, float* dst, size_t count, StorageType type) {
+    if (type == StorageType::BFloat16) {
+        for (size_t i = 0; i < count; ++i) dst[i] = bfloat16ToFloat(src[i]);
+    } else {
+        for (size_t i = 0; i < count; ++i) dst[i] = halfToFloat(src[i]);
+    }
+}
+
+inline void narrowRowScalar(const float* src, uint16_t* dst, size_t count, StorageType type) {
+    if (type == StorageType::BFloat16) {
+        for (size_t i = 0; i < count; ++i) dst[i] = floatToBFloat16(src[i]);
+    } else {
+        for (size_t i = 0; i < count; ++i) dst[i] = floatToHalf(src[i]);
+    }
+}
+
+#if defined(UPSCALER_X86)
+UPSCALER_TARGET("avx2,f16c")
+inline void widenRowAVX2(const uint16_t* src, float* dst, size_t count, StorageType type) {
+    size_t i = 0;
+    if (type == StorageType::BFloat16) {
+        for (; i + 8 <= count; i += 8) {
+            __m256i wide = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i)));
+            _mm256_storeu_ps(dst + i, _mm256_castsi256_ps(_mm256_slli_epi32(wide, 16)));
+        }
+    } else {
+        for (; i + 8 <= count; i += 8) _mm256_storeu_ps(dst + i, _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i))));
+    }
+    widenRowScalar(src + i, dst + i, count - i, type);
+}
+
+UPSCALER_TARGET("avx2,f16c")
+inline void narrowRowAVX2(const float* src, uint16_t* dst, size_t count, StorageType type) {
+    size_t i = 0;
+    if (type == StorageType::BFloat16) {
+        const __m256i bias = _mm256_set1_epi32(0x7FFF), one = _mm256_set1_epi32(1), quiet = _mm256_set1_epi32(0x40);
+        for (; i + 16 <= count; i += 16) {
+            __m256i halves[2];
+            for (int h = 0; h < 2; ++h) {
+                __m256 v = _mm256_loadu_ps(src + i + h * 8);
+                __m256i bits = _mm256_castps_si256(v);
+                __m256i odd = _mm256_and_si256(_mm256_srli_epi32(bits, 16), one);
+                __m256i rounded = _mm256_srli_epi32(_mm256_add_epi32(bits, _mm256_add_epi32(bias, odd)), 16);
+                __m256i nan = _mm256_or_si256(_mm256_srli_epi32(bits, 16), quiet);
+                halves[h] = _mm256_blendv_epi8(rounded, nan, _mm256_castps_si256(_mm256_cmp_ps(v, v, _CMP_UNORD_Q)));
+            }
+            //packus works per 128-bit lane: [a0-3 b0-3 a4-7 b4-7], put the quarters back in order
+            __m256i packed = _mm256_packus_epi32(halves[0], halves[1]);
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm256_permute4x64_epi64(packed, 0xD8));
+        }
+    } else {
+        for (; i + 8 <= count; i += 8) {
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i), _mm256_cvtps_ph(_mm256_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+        }
+    }
+    narrowRowScalar(src + i, dst + i, count - i, type);
+}
+
+UPSCALER_TARGET("avx512f")
+inline void widenRowAVX512(const uint16_t* src, float* dst, size_t count, StorageType type) {
+    size_t i = 0;
+    if (type == StorageType::BFloat16) {
+        for (; i + 16 <= count; i += 16) {
+            __m512i wide = _mm512_cvtepu16_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i)));
+            _mm512_storeu_ps(dst + i, _mm512_castsi512_ps(_mm512_slli_epi32(wide, 16)));
+        }
+    } else {
+        for (; i + 16 <= count; i += 16) _mm512_storeu_ps(dst + i, _mm512_cvtph_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i))));
+    }
+    widenRowScalar(src + i, dst + i, count - i, type);
+}
+
+UPSCALER_TARGET("avx512f")
+inline void narrowRowAVX512(const float* src, uint16_t* dst, size_t count, StorageType type) {
+    size_t i = 0;
+    if (type == StorageType::BFloat16) {
+        const __m512i bias = _mm512_set1_epi32(0x7FFF), one = _mm512_set1_epi32(1), quiet = _mm512_set1_epi32(0x40);
+        for (; i + 16 <= count; i += 16) {
+            __m512 v = _mm512_loadu_ps(src + i);
+            __m512i bits = _mm512_castps_si512(v);
+            __m512i odd = _mm512_and_si512(_mm512_srli_epi32(bits, 16), one);
+            __m512i rounded = _mm512_srli_epi32(_mm512_add_epi32(bits, _mm512_add_epi32(bias, odd)), 16);
+            __mmask16 nan = _mm512_cmp_ps_mask(v, v, _CMP_UNORD_Q);
+            rounded = _mm512_mask_mov_epi32(rounded, nan, _mm512_or_si512(_mm512_srli_epi32(bits, 16), quiet));
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm512_cvtepi32_epi16(rounded));
+        }
+    } else {
+        for (; i + 16 <= count; i += 16) {
+            _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i), _mm512_cvtps_ph(_mm512_loadu_ps(src + i), _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC));
+        }
+    }
+    narrowRowScalar(src + i, dst + i, count - i, type);
+}
+#endif
+
+// count 16-bit values of type to floats
+inline void widenRow(const uint16_t* src, float* dst, size_t count, StorageType type) {
+#if defined(UPSCALER_X86)
+    const SimdLevel level = activeSimdLevel();
+    const CpuFeatures& features = cpuFeatures();
+    if (level == SimdLevel::AVX512 && features.avx512f) return widenRowAVX512(src, dst, count, type);
+    if (level >= SimdLevel::AVX2 && features.avx2 && features.f16c) return widenRowAVX2(src, dst, count, type);
+#endif
+    widenRowScalar(src, dst, count, type);
+}
+
+// count floats to 16-bit values of type
+inline void narrowRow(const float* src, uint16_t* dst, size_t count, StorageType type) {
+#if defined(UPSCALER_X86)
+    const SimdLevel level = activeSimdLevel();
+    const CpuFeatures& features = cpuFeatures();
+    if (level == SimdLevel::AVX512 && features.avx512f) return narrowRowAVX512(src, dst, count, type);
+    if (level >= SimdLevel::AVX2 && features.avx2 && features.f16c) return narrowRowAVX2(src, dst, count, type);
+#endif
+    narrowRowScalar(src, dst, count, type);
+}
+
+// value as it reads back after a round trip through type
+inline float roundToStorage(float value, StorageType type) {
+    if (type == StorageType::BFloat16) return bfloat16ToFloat(floatToBFloat16(value));
+    if (type == StorageType::Float16) return halfToFloat(floatToHalf(value));
+    return value;
+}
@@ -0,0 +1,118 @@
+// In-memory 8-bit interleaved image passed between pipeline stages
+//
+// images carry a row stride: owned images are 64-byte aligned with every row padded to a multiple
+// of 64 bytes, views point into another image (tiles, ROIs) without copying, and adopt() takes over
+// a buffer from another allocator (e.g. stbi_load) without copying it either.
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <type_traits>
+
+constexpr size_t kImageAlignment = 64;
+
+// non-owning window into image memory; T is unsigned char or const unsigned char
+template <typename T>
+struct BasicImageView {
+    T* data = nullptr;
+    int width = 0;
+    int height = 0;
+    int channels = 0;
+    size_t stride = 0; //bytes from one row to the next
+
+    BasicImageView() = default;
+    BasicImageView(T* data, int width, int height, int channels, size_t stride = 0)
+        : data(data), width(width), height(height), channels(channels),
+          stride(stride ? stride : static_cast<size_t>(width) * channels) {}
+
+    //a writable view can be passed wherever a read-only one is expected
+    template <typename U, typename = std::enable_if_t<std::is_same_v<T, const U>>>
+    BasicImageView(const BasicImageView<U>& other)
+        : data(other.data), width(other.width), height(other.height), channels(other.channels), stride(other.stride) {}
+
+    T* row(int y) const { return data + static_cast<size_t>(y) * stride; }
+    size_t rowBytes() const { return static_cast<size_t>(width) * channels; }
+    bool contiguous() const { return stride == rowBytes(); }
+
+    // sub-rectangle sharing the same memory
+    BasicImageView crop(int x, int y, int cropWidth, int cropHeight) const {
+        if (x < 0 || y < 0 || cropWidth < 0 || cropHeight < 0 || x + cropWidth > width || y + cropHeight > height) {
+            throw std::out_of_range("Image crop outside of the image");
+        }
+        return BasicImageView(row(y) + static_cast<size_t>(x) * channels, cropWidth, cropHeight, channels, stride);
+    }
+};
+
+using ImageView = BasicImageView<unsigned char>;
+using ConstImageView = BasicImageView<const unsigned char>;
+
+class Image {
+public:
+    int width = 0;
+    int height = 0;
+    int channels = 0;
+    size_t stride = 0;
+
+    Image() = default;
+
+    // uninitialized, 64-byte aligned, rows padded to 64 bytes
+    Image(int width, int height, int channels)
+        : width(width), height(height), channels(channels),
+          stride((static_cast<size_t>(width) * channels + kImageAlignment - 1) / kImageAlignment * kImageAlignment),
+          storage(allocateAligned(stride * height), &releaseAligned) {}
+
+    // take ownership of a tightly packed buffer; release is called on it when the image dies
+    static Image adopt(unsigned char* data, int width, int height, int channels, void (*release)(void*)) {
+        Image image;
+        image.width = width;
+        image.height = height;
+        image.channels = channels;
+        image.stride = static_cast<size_t>(width) * channels;
+        image.storage = Storage(data, release);
+        return image;
+    }
+
+    //images can be large, so copies must be explicit (see clone)
+    Image(Image&&) noexcept = default;
+    Image& operator=(Image&&) noexcept = default;
+    Image(const Image&) = delete;
+    Image& operator=(const Image&) = delete;
+
+    Image clone() const {
+        Image copy(width, height, channels);
+        for (int y = 0; y < height; ++y) {
+            std::copy(row(y), row(y) + rowBytes(), copy.row(y));
+        }
+        return copy;
+    }
+
+    bool empty() const { return storage == nullptr; }
+    unsigned char* row(int y) { return storage.get() + static_cast<size_t>(y) * stride; }
+    const unsigned char* row(int y) const { return storage.get() + static_cast<size_t>(y) * stride; }
+    size_t rowBytes() const { return static_cast<size_t>(width) * channels; }
+
+    ImageView view() { return ImageView(storage.get(), width, height, channels, stride); }
+    ConstImageView view() const { return ConstImageView(storage.get(), width, height, channels, stride); }
+    ImageView crop(int x, int y, int cropWidth, int cropHeight) { return view().crop(x, y, cropWidth, cropHeight); }
+    ConstImageView crop(int x, int y, int cropWidth, int cropHeight) const { return view().crop(x, y, cropWidth, cropHeight); }
+
+    bool sameShape(const Image& other) const {
+        return width == other.width && height == other.height && channels == other.channels;
+    }
+
+private:
+    using Storage = std::unique_ptr<unsigned char, void (*)(void*)>;
+
+    static unsigned char* allocateAligned(size_t bytes) {
+        return static_cast<unsigned char*>(::operator new(bytes ? bytes : 1, std::align_val_t(kImageAlignment)));
+    }
+
+    static void releaseAligned(void* data) {
+        ::operator delete(data, std::align_val_t(kImageAlignment));
+    }
+
+    Storage storage{nullptr, &releaseAligned};
+};
@@ -0,0 +1,228 @@
+// LPIPS (Zhang et al.): perceptual distance from the features of a trained net, run in process on
+// the same engine and convolution kernels as ESRGAN (nn_engine.h), no Python or torch involved
+//
+// both images go through a feature net (the conv stack of AlexNet or VGG16, converted to ncnn
+// .param/.bin, e.g. by pnnx from torchvision's weights) and the feature maps at a few taps (the ReLU
+// outputs) are normalized to unit length along the channels at every position. the squared
+// differences are weighted per channel by LPIPS's linear layers, averaged over the positions and
+// summed over the taps: 0 is identical, larger is more different.
+//
+// a model is three files in models/: <name>.param and <name>.bin for the net and <name>.lpips for the
+// taps, one line each: the blob name, its channel count and the linear weight of every channel (lines
+// starting with # are comments). the net takes RGB scaled as LPIPS does it: to [-1, 1], then
+// (x - shift) / scale per channel.
+//
+// images larger than tileSize are scored as the mean over tileSize x tileSize tiles (the last row
+// and column of tiles moved back inside the image): the feature maps of a 4x frame would take
+// gigabytes, and LPIPS was trained on 64x64 patches anyway. one LpipsModel scores any number of
+// pairs; distances() extracts a reference's features once per tile for every candidate against it.
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <istream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <utility>
+#include <vector>
+#include "image.h"
+#include "nn_engine.h"
+#include "thread_pool.h"
+
+constexpr float kLpipsShift[3] = {-0.030f, -0.088f, -0.188f};
+constexpr float kLpipsScale[3] = {0.458f, 0.448f, 0.450f};
+
+// a feature map LPIPS compares and the linear layer's weight for each of its channels
+struct LpipsTap {
+    std::string blob;
+    std::vector<float> weights;
+};
+
+// the taps of one image, each normalized along the channels
+using LpipsFeatures = std::vector<Tensor>;
+
+inline std::vector<LpipsTap> parseLpipsTaps(std::istream& in) {
+    std::vector<LpipsTap> taps;
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        LpipsTap tap;
+        if (!(fields >> tap.blob) || tap.blob[0] == '#') continue;
+        int channels = 0;
+        if (!(fields >> channels) || channels <= 0) throw std::runtime_error("Malformed LPIPS tap: " + line);
+        tap.weights.resize(channels);
+        for (float& weight : tap.weights) {
+            if (!(fields >> weight)) throw std::runtime_error("LPIPS tap " + tap.blob + " has too few weights");
+        }
+        taps.push_back(std::move(tap));
+    }
+    if (taps.empty()) throw std::runtime_error("LPIPS model has no taps");
+    return taps;
+}
+
+// an RGB image as the feature net takes it: planar floats, (x / 127.5 - 1 - shift) / scale
+inline Tensor lpipsInput(const ConstImageView& image) {
+    if (image.channels < 3) throw std::runtime_error("LPIPS needs an RGB image");
+    Tensor tensor(image.width, image.height, 3);
+    for (int y = 0; y < image.height; ++y) {
+        const unsigned char* src = image.row(y);
+        for (int q = 0; q < 3; ++q) {
+            float* dst = tensor.row(q, y);
+            const float scale = 1.0f / kLpipsScale[q], offset = (-1.0f - kLpipsShift[q]) / kLpipsScale[q];
+            for (int x = 0; x < image.width; ++x) dst[x] = src[x * image.channels + q] * (scale / 127.5f) + offset;
+        }
+    }
+    return tensor;
+}
+
+// top-left corners of size x size tiles covering length (one tile of the whole length if it is shorter)
+inline std::vector<int> lpipsTileStarts(int length, int size) {
+    if (length <= size) return {0};
+    std::vector<int> starts;
+    for (int start = 0; start < length; start += size) starts.push_back(std::min(start, length - size));
+    return starts;
+}
+
+class LpipsModel {
+public:
+    int tileSize = 256; //images larger than this are scored tile by tile
+
+    void load(const std::string& directory, const std::string& name) {
+        net.load(directory, name);
+        std::ifstream taps(directory + "/" + name + ".lpips");
+        if (!taps) throw std::runtime_error("Failed to open " + directory + "/" + name + ".lpips");
+        setTaps(parseLpipsTaps(taps));
+    }
+
+    // a net built some other way (the tests make one in memory)
+    void load(std::istream& param, std::vector<unsigned char> bin, std::istream& taps) {
+        net.loadParam(param);
+        net.loadModel(std::move(bin));
+        setTaps(parseLpipsTaps(taps));
+    }
+
+    const std::vector<LpipsTap>& tapList() const { return taps; }
+
+    // the normalized feature maps of one image (not tiled)
+    LpipsFeatures features(const ConstImageView& image, ThreadPool& pool = globalThreadPool()) const {
+        LpipsFeatures maps = net.forwardBlobs(lpipsInput(image), blobs, pool);
+        for (size_t t = 0; t < maps.size(); ++t) {
+            const Tensor& map = maps[t];
+            if (map.c != static_cast<int>(taps[t].weights.size())) {
+                throw std::runtime_error("LPIPS tap " + taps[t].blob + " has " + std::to_string(map.c) + " channels, not " +
+                                         std::to_string(taps[t].weights.size()));
+            }
+            pool.parallelFor(map.h, [&](int y) {
+                std::vector<float> norms(map.w, 0.0f);
+                for (int q = 0; q < map.c; ++q) {
+                    const float* src = map.row(q, y);
+                    for (int x = 0; x < map.w; ++x) norms[x] += src[x] * src[x];
+                }
+                for (int x = 0; x < map.w; ++x) norms[x] = 1.0f / (std::sqrt(norms[x]) + 1e-10f);
+                for (int q = 0; q < map.c; ++q) {
+                    float* dst = map.row(q, y);
+                    for (int x = 0; x < map.w; ++x) dst[x] *= norms[x];
+                }
+            });
+        }
+        return maps;
+    }
+
+    // LPIPS between the features of two images of the same size
+    double distance(const LpipsFeatures& a, const LpipsFeatures& b, ThreadPool& pool = globalThreadPool()) const {
+        if (a.size() != taps.size() || b.size() != taps.size()) throw std::runtime_error("LPIPS features from another model");
+        double total = 0.0;
+        for (size_t t = 0; t < taps.size(); ++t) {
+            const Tensor& x = a[t];
+            const Tensor& y = b[t];
+            if (x.w != y.w || x.h != y.h || x.c != y.c) throw std::runtime_error("LPIPS features differ in shape");
+            //one sum per row, added in row order, so the thread count does not change the result
+            std::vector<double> rowSums(x.h, 0.0);
+            pool.parallelFor(x.h, [&](int row) {
+                std::vector<float> weighted(x.w, 0.0f);
+                for (int q = 0; q < x.c; ++q) {
+                    const float* p = x.row(q, row);
+                    const float* r = y.row(q, row);
+                    const float weight = taps[t].weights[q];
+                    for (int i = 0; i < x.w; ++i) weighted[i] += weight * (p[i] - r[i]) * (p[i] - r[i]);
+                }
+                double sum = 0.0;
+                for (float value : weighted) sum += value;
+                rowSums[row] = sum;
+            });
+            double sum = 0.0;
+            for (double value : rowSums) sum += value;
+            total += sum / x.planeSize();
+        }
+        return total;
+    }
+
+    // LPIPS between two images of the same size
+    double distance(const ConstImageView& a, const ConstImageView& b, ThreadPool& pool = globalThreadPool()) const {
+        return distances(a, {b}, pool)[0];
+    }
+
+    // LPIPS of every candidate against reference (all the same size). each tile of the reference goes
+    // through the net once, and only one tile's features are held at a time
+    std::vector<double> distances(const ConstImageView& reference, const std::vector<ConstImageView>& candidates,
+                                  ThreadPool& pool = globalThreadPool()) const {
+        for (const ConstImageView& candidate : candidates) {
+            if (candidate.width != reference.width || candidate.height != reference.height || candidate.channels != reference.channels) {
+                throw std::runtime_error("Image dimensions or channels do not match!");
+            }
+        }
+        const std::vector<int> xs = lpipsTileStarts(reference.width, tileSize);
+        const std::vector<int> ys = lpipsTileStarts(reference.height, tileSize);
+        const int tileW = std::min(reference.width, tileSize), tileH = std::min(reference.height, tileSize);
+        std::vector<double> sums(candidates.size(), 0.0);
+        for (int y : ys) {
+            for (int x : xs) {
+                LpipsFeatures truth = features(reference.crop(x, y, tileW, tileH), pool);
+                for (size_t i = 0; i < candidates.size(); ++i) {
+                    sums[i] += distance(truth, features(candidates[i].crop(x, y, tileW, tileH), pool), pool);
+                }
+            }
+        }
+        for (double& sum : sums) sum /= static_cast<double>(xs.size() * ys.size());
+        return sums;
+    }
+
+    // LPIPS of every pair; pairs sharing a reference (the same pixels in memory) share its features
+    std::vector<double> distances(const std::vector<std::pair<ConstImageView, ConstImageView>>& pairs,
+                                  ThreadPool& pool = globalThreadPool()) const {
+        std::vector<double> results(pairs.size(), 0.0);
+        std::vector<bool> done(pairs.size(), false);
+        for (size_t i = 0; i < pairs.size(); ++i) {
+            if (done[i]) continue;
+            const ConstImageView& reference = pairs[i].first;
+            std::vector<size_t> group;
+            std::vector<ConstImageView> candidates;
+            for (size_t j = i; j < pairs.size(); ++j) {
+                const ConstImageView& other = pairs[j].first;
+                if (done[j] || other.data != reference.data || other.width != reference.width || other.height != reference.height ||
+                    other.stride != reference.stride) {
+                    continue;
+                }
+                done[j] = true;
+                group.push_back(j);
+                candidates.push_back(pairs[j].second);
+            }
+            std::vector<double> scores = distances(reference, candidates, pool);
+            for (size_t k = 0; k < group.size(); ++k) results[group[k]] = scores[k];
+        }
+        return results;
+    }
+
+private:
+    void setTaps(std::vector<LpipsTap> tapList) {
+        taps = std::move(tapList);
+        blobs.clear();
+        for (const LpipsTap& tap : taps) blobs.push_back(tap.blob);
+    }
+
+    Net net;
+    std::vector<LpipsTap> taps;
+    std::vector<std::string> blobs;
+};
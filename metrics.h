@@ -0,0 +1,304 @@
+// Image quality metrics of 8-bit images: MSE / PSNR with integer SIMD kernels, and a one-pass
+// evaluator for everything else (per-channel and luma PSNR, max error, error histogram)
+//
+// a squared difference of two bytes fits in 16 bits, and vpmaddwd adds two of them into a 32-bit
+// lane, so the kernels sum |a - b|^2 exactly in integers: 32-bit lanes over a chunk of a row, then
+// 64-bit totals. nothing is rounded, so every kernel, band split and thread count gives the same
+// MSE, bit for bit, as the scalar loop.
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+#include "cpu_features.h"
+#include "image.h"
+#include "thread_pool.h"
+
+// bytes summed into the 32-bit lanes before they are widened into the 64-bit totals. each lane
+// takes at most 2 * 2 * 255^2 per vector step (the low and high halves), so 64 KB stays far below
+// 2^32 at any vector width
+constexpr size_t kSquaredErrorChunkBytes = 65536;
+
+inline uint64_t squaredErrorScalar(const unsigned char* a, const unsigned char* b, size_t count) {
+    uint64_t sum = 0;
+    for (size_t i = 0; i < count; ++i) {
+        int diff = static_cast<int>(a[i]) - static_cast<int>(b[i]);
+        sum += static_cast<uint64_t>(diff * diff);
+    }
+    return sum;
+}
+
+#if defined(UPSCALER_X86)
+UPSCALER_TARGET("sse2")
+inline uint64_t squaredErrorSSE2(const unsigned char* a, const unsigned char* b, size_t count) {
+    const __m128i zero = _mm_setzero_si128();
+    __m128i total = zero; //2 x u64
+    size_t i = 0;
+    while (count - i >= 16) {
+        const size_t chunkEnd = i + std::min(kSquaredErrorChunkBytes, (count - i) & ~size_t(15));
+        __m128i lanes = zero; //4 x u32
+        for (; i < chunkEnd; i += 16) {
+            __m128i va = _mm_loadu_si128(reinterpret_cast<const __m128i*>(a + i));
+            __m128i vb = _mm_loadu_si128(reinterpret_cast<const __m128i*>(b + i));
+            //|a - b| from two saturating subtractions, then widened to 16 bits and squared pairwise
+            __m128i diff = _mm_or_si128(_mm_subs_epu8(va, vb), _mm_subs_epu8(vb, va));
+            __m128i low = _mm_unpacklo_epi8(diff, zero);
+            __m128i high = _mm_unpackhi_epi8(diff, zero);
+            lanes = _mm_add_epi32(lanes, _mm_madd_epi16(low, low));
+            lanes = _mm_add_epi32(lanes, _mm_madd_epi16(high, high));
+        }
+        total = _mm_add_epi64(total, _mm_unpacklo_epi32(lanes, zero));
+        total = _mm_add_epi64(total, _mm_unpackhi_epi32(lanes, zero));
+    }
+    uint64_t parts[2];
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(parts), total);
+    return parts[0] + parts[1] + squaredErrorScalar(a + i, b + i, count - i);
+}
+
+UPSCALER_TARGET("avx2")
+inline uint64_t squaredErrorAVX2(const unsigned char* a, const unsigned char* b, size_t count) {
+    const __m256i zero = _mm256_setzero_si256();
+    __m256i total = zero; //4 x u64
+    size_t i = 0;
+    while (count - i >= 32) {
+        const size_t chunkEnd = i + std::min(kSquaredErrorChunkBytes, (count - i) & ~size_t(31));
+        __m256i lanes = zero; //8 x u32
+        for (; i < chunkEnd; i += 32) {
+            __m256i va = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(a + i));
+            __m256i vb = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(b + i));
+            __m256i diff = _mm256_or_si256(_mm256_subs_epu8(va, vb), _mm256_subs_epu8(vb, va));
+            //unpack works within 128-bit lanes; the order does not matter for a sum
+            __m256i low = _mm256_unpacklo_epi8(diff, zero);
+            __m256i high = _mm256_unpackhi_epi8(diff, zero);
+            lanes = _mm256_add_epi32(lanes, _mm256_madd_epi16(low, low));
+            lanes = _mm256_add_epi32(lanes, _mm256_madd_epi16(high, high));
+        }
+        total = _mm256_add_epi64(total, _mm256_unpacklo_epi32(lanes, zero));
+        total = _mm256_add_epi64(total, _mm256_unpackhi_epi32(lanes, zero));
+    }
+    uint64_t parts[4];
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(parts), total);
+    return parts[0] + parts[1] + parts[2] + parts[3] + squaredErrorScalar(a + i, b + i, count - i);
+}
+
+UPSCALER_TARGET("avx512f,avx512bw")
+inline uint64_t squaredErrorAVX512(const unsigned char* a, const unsigned char* b, size_t count) {
+    const __m512i zero = _mm512_setzero_si512();
+    __m512i total = zero; //8 x u64
+    size_t i = 0;
+    while (count - i >= 64) {
+        const size_t chunkEnd = i + std::min(kSquaredErrorChunkBytes, (count - i) & ~size_t(63));
+        __m512i lanes = zero; //16 x u32
+        for (; i < chunkEnd; i += 64) {
+            __m512i va = _mm512_loadu_si512(a + i);
+            __m512i vb = _mm512_loadu_si512(b + i);
+            __m512i diff = _mm512_or_si512(_mm512_subs_epu8(va, vb), _mm512_subs_epu8(vb, va));
+            __m512i low = _mm512_unpacklo_epi8(diff, zero);
+            __m512i high = _mm512_unpackhi_epi8(diff, zero);
+            lanes = _mm512_add_epi32(lanes, _mm512_madd_epi16(low, low));
+            lanes = _mm512_add_epi32(lanes, _mm512_madd_epi16(high, high));
+        }
+        total = _mm512_add_epi64(total, _mm512_unpacklo_epi32(lanes, zero));
+        total = _mm512_add_epi64(total, _mm512_unpackhi_epi32(lanes, zero));
+    }
+    return static_cast<uint64_t>(_mm512_reduce_add_epi64(total)) + squaredErrorScalar(a + i, b + i, count - i);
+}
+#endif
+
+using SquaredErrorKernel = uint64_t (*)(const unsigned char*, const unsigned char*, size_t);
+
+inline SquaredErrorKernel squaredErrorKernel(SimdLevel level) {
+#if defined(UPSCALER_X86)
+    //the 512-bit kernel needs AVX-512BW for byte and word ops; AVX-512F alone gets the AVX2 one
+    if (level == SimdLevel::AVX512 && cpuFeatures().avx512bw) return squaredErrorAVX512;
+    if (level >= SimdLevel::AVX2) return squaredErrorAVX2;
+    if (level == SimdLevel::SSE2) return squaredErrorSSE2;
+#endif
+    return squaredErrorScalar;
+}
+
+// sum of (a - b)^2 over every byte of two same-sized images, exact, in row bands on the pool
+inline uint64_t sumSquaredError(const ConstImageView& a, const ConstImageView& b, SimdLevel level = activeSimdLevel(),
+                                ThreadPool& pool = globalThreadPool()) {
+    //source and output images must be the same size
+    if (a.width != b.width || a.height != b.height || a.channels != b.channels) {
+        throw std::runtime_error("Image sizes do not match for MSE");
+    }
+    const SquaredErrorKernel kernel = squaredErrorKernel(level);
+    const size_t rowBytes = a.rowBytes();
+    if (rowBytes == 0 || a.height == 0) return 0;
+
+    //one slot per band, keyed by its first row, added up in row order afterwards
+    std::vector<uint64_t> bandSums(a.height, 0);
+    const int minRows = static_cast<int>(std::max<size_t>(1, (256 * 1024) / rowBytes));
+    parallelRowBands(pool, a.height, minRows, [&](int begin, int end) {
+        uint64_t sum = 0;
+        //rows may be padded or belong to a larger image, so walk them one at a time
+        for (int y = begin; y < end; ++y) sum += kernel(a.row(y), b.row(y), rowBytes);
+        bandSums[begin] = sum;
+    });
+    uint64_t total = 0;
+    for (uint64_t sum : bandSums) total += sum;
+    return total;
+}
+
+//compute the MSE to help calc PSNR
+inline double computeMSE(const ConstImageView& a, const ConstImageView& b, SimdLevel level = activeSimdLevel(),
+                         ThreadPool& pool = globalThreadPool()) {
+    const uint64_t sum = sumSquaredError(a, b, level, pool);
+    if (a.rowBytes() == 0 || a.height == 0) return 0.0;
+    return static_cast<double>(sum) / (static_cast<double>(a.rowBytes()) * a.height);
+}
+
+//the byte-by-byte double loop computeMSE used to be; the reference for tests and the benchmark
+inline double computeMSEReference(const ConstImageView& a, const ConstImageView& b) {
+    if (a.width != b.width || a.height != b.height || a.channels != b.channels) {
+        throw std::runtime_error("Image sizes do not match for MSE");
+    }
+    double sum = 0.0;
+    for (int y = 0; y < a.height; ++y) {
+        const unsigned char* rowA = a.row(y);
+        const unsigned char* rowB = b.row(y);
+        for (size_t i = 0; i < a.rowBytes(); ++i) {
+            double diff = static_cast<double>(rowA[i]) - static_cast<double>(rowB[i]);
+            sum += diff * diff;
+        }
+    }
+    return sum / (static_cast<double>(a.rowBytes()) * a.height);
+}
+
+//PSNR of 8-bit images from their MSE
+inline double psnrFromMSE(double mse) {
+    //image a is the same as image b
+    if (mse == 0) return INFINITY;
+
+    //PSNR formula
+    return 10.0 * log10((255.0 * 255.0) / mse);
+}
+
+// everything evaluateImage measures in its one pass over a ground-truth/test pair. the sums are
+// integers, so they are exact and merging bands in any order gives the same numbers
+struct ImageMetrics {
+    int channels = 0;
+    uint64_t pixels = 0;
+    //how many samples of each channel are off by d, for d = 0..255; squared errors and the max error
+    //all come from these
+    uint64_t histogram[4][256] = {};
+    //sum of (Ya - Yb)^2 with Y * 256 = 66 R + 129 G + 25 B (BT.601 studio-range luma; the +16 offset
+    //cancels), from the first three channels. not used for images with fewer than three
+    uint64_t lumaSquaredError = 0;
+
+    uint64_t channelSquaredError(int c) const {
+        uint64_t sum = 0;
+        for (int d = 1; d < 256; ++d) sum += static_cast<uint64_t>(d * d) * histogram[c][d];
+        return sum;
+    }
+    uint64_t squaredError() const {
+        uint64_t sum = 0;
+        for (int c = 0; c < channels; ++c) sum += channelSquaredError(c);
+        return sum;
+    }
+    double mse() const { return pixels ? static_cast<double>(squaredError()) / (static_cast<double>(pixels) * channels) : 0.0; }
+    double channelMSE(int c) const { return pixels ? static_cast<double>(channelSquaredError(c)) / pixels : 0.0; }
+    //MSE of 8-bit luma (Y on the 0-255 scale, unrounded)
+    double lumaMSE() const {
+        if (channels < 3) return channelMSE(0);
+        return pixels ? static_cast<double>(lumaSquaredError) / (65536.0 * pixels) : 0.0;
+    }
+    double psnr() const { return psnrFromMSE(mse()); }
+    double channelPSNR(int c) const { return psnrFromMSE(channelMSE(c)); }
+    double lumaPSNR() const { return psnrFromMSE(lumaMSE()); }
+
+    //error histogram over all channels
+    uint64_t errorCount(int d) const {
+        uint64_t count = 0;
+        for (int c = 0; c < channels; ++c) count += histogram[c][d];
+        return count;
+    }
+    int maxError() const {
+        for (int d = 255; d > 0; --d) {
+            if (errorCount(d)) return d;
+        }
+        return 0;
+    }
+    //smallest error that at least fraction of all samples are within
+    int errorPercentile(double fraction) const {
+        const uint64_t total = pixels * channels;
+        uint64_t within = 0;
+        for (int d = 0; d < 256; ++d) {
+            within += errorCount(d);
+            if (within >= fraction * total) return d;
+        }
+        return 255;
+    }
+
+    void merge(const ImageMetrics& other) {
+        pixels += other.pixels;
+        for (int c = 0; c < 4; ++c) {
+            for (int d = 0; d < 256; ++d) histogram[c][d] += other.histogram[c][d];
+        }
+        lumaSquaredError += other.lumaSquaredError;
+    }
+};
+
+// one row of pixels into the histograms and luma sum; a channel count known at compile time keeps the
+// per-channel histograms in fixed slots. the histogram increments are scalar and set the pace (a
+// couple of ns per sample), so this is worth it when several numbers are wanted; computeMSE alone
+// is much faster
+template <int Channels>
+inline void accumulateMetricsRow(const unsigned char* a, const unsigned char* b, int width, ImageMetrics& metrics) {
+    //32-bit counts for the row, widened into the 64-bit histograms once at the end
+    uint32_t counts[Channels][256] = {};
+    uint64_t luma = 0;
+    for (int x = 0; x < width; ++x, a += Channels, b += Channels) {
+        for (int c = 0; c < Channels; ++c) {
+            int diff = static_cast<int>(a[c]) - static_cast<int>(b[c]);
+            ++counts[c][diff < 0 ? -diff : diff];
+        }
+        //|luma difference| <= 220 * 255, so its square fits an unsigned 32-bit product
+        if constexpr (Channels >= 3) {
+            uint32_t diff = static_cast<uint32_t>(66 * (a[0] - b[0]) + 129 * (a[1] - b[1]) + 25 * (a[2] - b[2]));
+            luma += diff * diff;
+        }
+    }
+    for (int c = 0; c < Channels; ++c) {
+        for (int d = 0; d < 256; ++d) metrics.histogram[c][d] += counts[c][d];
+    }
+    metrics.lumaSquaredError += luma;
+    metrics.pixels += width;
+}
+
+// overall and per-channel MSE/PSNR, luma PSNR, max error and the error histogram of two same-sized
+// images, all from one read of each: the separate passes each metric used to make would read both
+// frames again per number. row bands run on the pool and are merged in row order
+inline ImageMetrics evaluateImage(const ConstImageView& truth, const ConstImageView& test, ThreadPool& pool = globalThreadPool()) {
+    if (truth.width != test.width || truth.height != test.height || truth.channels != test.channels) {
+        throw std::runtime_error("Image sizes do not match for metrics");
+    }
+    if (truth.channels < 1 || truth.channels > 4) throw std::runtime_error("Metrics need 1 to 4 channels");
+    using RowFunction = void (*)(const unsigned char*, const unsigned char*, int, ImageMetrics&);
+    const RowFunction rowFunctions[] = {accumulateMetricsRow<1>, accumulateMetricsRow<2>, accumulateMetricsRow<3>, accumulateMetricsRow<4>};
+    const RowFunction accumulateRow = rowFunctions[truth.channels - 1];
+
+    ImageMetrics result;
+    result.channels = truth.channels;
+    if (truth.width == 0 || truth.height == 0) return result;
+
+    //each band fills its own 8 KB of histograms, keyed by its first row; bands are a few hundred KB
+    //of pixels at least so merging them costs nothing next to the pass
+    std::vector<std::unique_ptr<ImageMetrics>> bands(truth.height);
+    const int minRows = static_cast<int>(std::max<size_t>(1, (256 * 1024) / truth.rowBytes()));
+    parallelRowBands(pool, truth.height, minRows, [&](int begin, int end) {
+        auto band = std::make_unique<ImageMetrics>();
+        for (int y = begin; y < end; ++y) accumulateRow(truth.row(y), test.row(y), truth.width, *band);
+        bands[begin] = std::move(band);
+    });
+    for (const auto& band : bands) {
+        if (band) result.merge(*band);
+    }
+    return result;
+}
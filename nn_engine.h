@@ -0,0 +1,2072 @@
+// Native CPU inference engine for the ncnn .param/.bin models in models/
+//
+// parses the text .param graph and the matching .bin weights written by ncnn, then runs the layers
+// in file order on float CHW tensors (or bf16/fp16 ones, see Net::setStorage). only the layer types
+// used by the shipped Real-ESRGAN models (Input, Convolution, PReLU, PixelShuffle, Interp, BinaryOp,
+// Eltwise, Split, Concat) and by the LPIPS feature nets (ReLU, Pooling, see lpips.h) are implemented;
+// anything else is rejected at load time.
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <functional>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <tuple>
+#include <vector>
+#include "conv_gemm.h"
+#include "conv_int8.h"
+#include "conv_winograd.h"
+#include "half_float.h"
+#include "image.h"
+#include "thread_pool.h"
+
+// ---------------------------------------------------------------------------------------------
+// Tensor: w x h x c values, channel planes cstep values apart (each plane starts 64-byte aligned).
+// values are floats, or bf16/fp16 when the net stores activations in 16 bits (Net::setStorage)
+// ---------------------------------------------------------------------------------------------
+
+struct Tensor {
+    int w = 0;
+    int h = 0;
+    int c = 0;
+    size_t cstep = 0;
+    StorageType type = StorageType::Float32;
+    float* data = nullptr;      //float tensors
+    uint16_t* data16 = nullptr; //bf16/fp16 tensors
+    std::shared_ptr<void> storage;
+
+    Tensor() = default;
+
+    Tensor(int w, int h, int c, StorageType type = StorageType::Float32) : w(w), h(h), c(c), type(type) {
+        cstep = alignedPlane(w, h, type);
+        size_t bytes = std::max<size_t>(1, cstep * c * storageBytes(type));
+        void* memory = ::operator new(bytes, std::align_val_t(kImageAlignment));
+        storage = std::shared_ptr<void>(memory, [](void* p) { ::operator delete(p, std::align_val_t(kImageAlignment)); });
+        setValues(memory);
+    }
+
+    // a w x h x c tensor at values inside storage someone else allocated (an arena), laid out like an owned one
+    Tensor(int w, int h, int c, void* values, std::shared_ptr<void> storage, StorageType type = StorageType::Float32)
+        : w(w), h(h), c(c), type(type), storage(std::move(storage)) {
+        cstep = alignedPlane(w, h, type);
+        setValues(values);
+    }
+
+    bool empty() const { return data == nullptr && data16 == nullptr; }
+    size_t planeSize() const { return static_cast<size_t>(w) * h; }
+    float* channel(int q) const { return data + static_cast<size_t>(q) * cstep; }
+    float* row(int q, int y) const { return channel(q) + static_cast<size_t>(y) * w; }
+    uint16_t* channel16(int q) const { return data16 + static_cast<size_t>(q) * cstep; }
+    // plane q whatever the type
+    void* channelValues(int q) const {
+        return type == StorageType::Float32 ? static_cast<void*>(channel(q)) : static_cast<void*>(channel16(q));
+    }
+
+    // count channels starting at first, sharing this tensor's storage
+    Tensor channelSlice(int first, int count) const {
+        Tensor slice = *this;
+        if (data) slice.data = channel(first);
+        if (data16) slice.data16 = channel16(first);
+        slice.c = count;
+        return slice;
+    }
+
+    void fill(float value) const {
+        const uint16_t narrow = type == StorageType::BFloat16 ? floatToBFloat16(value) : floatToHalf(value);
+        for (int q = 0; q < c; ++q) {
+            if (data) std::fill(channel(q), channel(q) + planeSize(), value);
+            else std::fill(channel16(q), channel16(q) + planeSize(), narrow);
+        }
+    }
+
+    // plane stride in values: w * h rounded up to whole 64-byte lines
+    static size_t alignedPlane(int w, int h, StorageType type) {
+        const size_t perLine = kImageAlignment / storageBytes(type);
+        return (static_cast<size_t>(w) * h + perLine - 1) / perLine * perLine;
+    }
+
+private:
+    void setValues(void* values) {
+        if (type == StorageType::Float32) data = static_cast<float*>(values);
+        else data16 = static_cast<uint16_t*>(values);
+    }
+};
+
+// copy channel q of src into channel p of dst, converting between the storage types
+inline void convertChannel(const Tensor& src, int q, const Tensor& dst, int p) {
+    const size_t count = src.planeSize();
+    if (src.type == dst.type) std::memcpy(dst.channelValues(p), src.channelValues(q), count * storageBytes(src.type));
+    else if (src.type == StorageType::Float32) narrowRow(src.channel(q), dst.channel16(p), count, dst.type);
+    else if (dst.type == StorageType::Float32) widenRow(src.channel16(q), dst.channel(p), count, src.type);
+    else {
+        //bf16 <-> fp16 through float, a row at a time
+        float wide[1024];
+        for (size_t i = 0; i < count; i += 1024) {
+            const size_t n = std::min<size_t>(1024, count - i);
+            widenRow(src.channel16(q) + i, wide, n, src.type);
+            narrowRow(wide, dst.channel16(p) + i, n, dst.type);
+        }
+    }
+}
+
+// tensor with its values stored as type (the tensor itself if they already are)
+inline Tensor convertTensor(const Tensor& tensor, StorageType type, ThreadPool& pool) {
+    if (tensor.type == type) return tensor;
+    Tensor converted(tensor.w, tensor.h, tensor.c, type);
+    pool.parallelFor(tensor.c, [&](int q) { convertChannel(tensor, q, converted, q); });
+    return converted;
+}
+
+// row access for layers that compute in float whatever the storage: float rows are used in place,
+// 16-bit rows go through buffer (w floats, see rowBuffer)
+inline const float* readRow(const Tensor& tensor, int q, int y, float* buffer) {
+    if (tensor.data) return tensor.row(q, y);
+    widenRow(tensor.channel16(q) + static_cast<size_t>(y) * tensor.w, buffer, tensor.w, tensor.type);
+    return buffer;
+}
+
+// where to compute row y of channel q; storeRow then narrows it if the tensor is 16-bit
+inline float* writeRow(const Tensor& tensor, int q, int y, float* buffer) { return tensor.data ? tensor.row(q, y) : buffer; }
+
+inline void storeRow(const Tensor& tensor, int q, int y, const float* values) {
+    if (tensor.data16) narrowRow(values, tensor.channel16(q) + static_cast<size_t>(y) * tensor.w, tensor.w, tensor.type);
+}
+
+// a per-thread buffer of width floats for readRow/writeRow; slot tells apart the rows one task holds at once
+inline float* rowBuffer(int slot, int width) {
+    thread_local std::vector<float> buffers[6];
+    buffers[slot].resize(width);
+    return buffers[slot].data();
+}
+
+// dimensions of a tensor without its data, for planning memory before running a graph
+struct TensorShape {
+    int w = 0;
+    int h = 0;
+    int c = 0;
+
+    // allocation size of a Tensor with this shape
+    size_t bytes(StorageType type = StorageType::Float32) const { return Tensor::alignedPlane(w, h, type) * c * storageBytes(type); }
+};
+
+// ---------------------------------------------------------------------------------------------
+// .param and .bin parsing
+// ---------------------------------------------------------------------------------------------
+
+// key=value pairs of one layer line; negative keys -233xx hold arrays for key xx
+class ParamDict {
+public:
+    void parse(const std::string& token) {
+        size_t eq = token.find('=');
+        if (eq == std::string::npos) throw std::runtime_error("Malformed layer parameter: " + token);
+        int key = std::stoi(token.substr(0, eq));
+        std::string value = token.substr(eq + 1);
+
+        if (key <= -23300) {
+            //array: count followed by the values
+            std::vector<float> values;
+            std::stringstream items(value);
+            std::string item;
+            std::getline(items, item, ',');
+            int count = std::stoi(item);
+            while (std::getline(items, item, ',')) values.push_back(std::stof(item));
+            if (static_cast<int>(values.size()) != count) throw std::runtime_error("Malformed array parameter: " + token);
+            arrays[-key - 23300] = values;
+        } else {
+            scalars[key] = std::stof(value);
+        }
+    }
+
+    int getInt(int key, int fallback) const {
+        auto it = scalars.find(key);
+        return it == scalars.end() ? fallback : static_cast<int>(it->second);
+    }
+
+    float getFloat(int key, float fallback) const {
+        auto it = scalars.find(key);
+        return it == scalars.end() ? fallback : it->second;
+    }
+
+    std::vector<float> getArray(int key) const {
+        auto it = arrays.find(key);
+        return it == arrays.end() ? std::vector<float>() : it->second;
+    }
+
+private:
+    std::map<int, float> scalars;
+    std::map<int, std::vector<float>> arrays;
+};
+
+// sequential reader over the .bin weights, in the order the layers consume them
+class ModelBin {
+public:
+    explicit ModelBin(std::vector<unsigned char> bytes) : bytes(std::move(bytes)) {}
+
+    // tagged blobs (convolution weights) start with a 4-byte storage flag; untagged ones are raw float32
+    std::vector<float> load(size_t count, bool tagged) {
+        std::vector<float> values(count);
+        if (!tagged) {
+            read(values.data(), count * sizeof(float));
+            return values;
+        }
+
+        uint32_t flag;
+        read(&flag, sizeof(flag));
+
+        if (flag == 0x01306B47) {
+            //float16, padded to 4 bytes
+            std::vector<uint16_t> halves(count);
+            read(halves.data(), count * sizeof(uint16_t));
+            skip((4 - (count * sizeof(uint16_t)) % 4) % 4);
+            for (size_t i = 0; i < count; ++i) values[i] = halfToFloat(halves[i]);
+        } else if (flag == kInt8Flag) {
+            throw std::runtime_error("int8 weights where float weights were expected");
+        } else if (flag == 0 || flag == 0x0002C056) {
+            read(values.data(), count * sizeof(float));
+        } else {
+            //8-bit indices into a 256-entry float table, padded to 4 bytes
+            std::vector<float> table(256);
+            read(table.data(), table.size() * sizeof(float));
+            std::vector<unsigned char> indices(count);
+            read(indices.data(), count);
+            skip((4 - count % 4) % 4);
+            for (size_t i = 0; i < count; ++i) values[i] = table[indices[i]];
+        }
+        return values;
+    }
+
+    // true if the next tagged blob holds int8 values (a quantized convolution's weights)
+    bool nextIsInt8() const {
+        uint32_t flag = 0;
+        if (offset + sizeof(flag) <= bytes.size()) std::memcpy(&flag, bytes.data() + offset, sizeof(flag));
+        return flag == kInt8Flag;
+    }
+
+    // tagged int8 blob, padded to 4 bytes
+    std::vector<int8_t> loadInt8(size_t count) {
+        uint32_t flag;
+        read(&flag, sizeof(flag));
+        if (flag != kInt8Flag) throw std::runtime_error("Expected int8 weights in .bin");
+        std::vector<int8_t> values(count);
+        read(values.data(), count);
+        skip((4 - count % 4) % 4);
+        return values;
+    }
+
+    size_t remaining() const { return bytes.size() - offset; }
+
+    static constexpr uint32_t kInt8Flag = 0x000D4B38;
+
+private:
+    void read(void* destination, size_t size) {
+        if (offset + size > bytes.size()) throw std::runtime_error("Model weights file is truncated");
+        std::memcpy(destination, bytes.data() + offset, size);
+        offset += size;
+    }
+
+    void skip(size_t size) {
+        if (offset + size > bytes.size()) throw std::runtime_error("Model weights file is truncated");
+        offset += size;
+    }
+
+    std::vector<unsigned char> bytes;
+    size_t offset = 0;
+};
+
+// writes blobs in the layout ModelBin reads (float32 tagged blobs, int8 blobs, untagged floats)
+class ModelBinWriter {
+public:
+    void write(const std::vector<float>& values, bool tagged) {
+        if (tagged) append(uint32_t(0));
+        append(values.data(), values.size() * sizeof(float));
+    }
+
+    void writeInt8(const std::vector<int8_t>& values) {
+        append(ModelBin::kInt8Flag);
+        append(values.data(), values.size());
+        bytes.resize(bytes.size() + (4 - values.size() % 4) % 4, 0);
+    }
+
+    const std::vector<unsigned char>& data() const { return bytes; }
+
+private:
+    void append(uint32_t value) { append(&value, sizeof(value)); }
+    void append(const void* source, size_t size) {
+        const unsigned char* begin = static_cast<const unsigned char*>(source);
+        bytes.insert(bytes.end(), begin, begin + size);
+    }
+
+    std::vector<unsigned char> bytes;
+};
+
+// ---------------------------------------------------------------------------------------------
+// Layers
+// ---------------------------------------------------------------------------------------------
+
+class Layer {
+public:
+    virtual ~Layer() = default;
+
+    std::string type;
+    std::string name;
+    std::vector<int> bottoms; //input blob indices
+    std::vector<int> tops;    //output blob indices
+
+    virtual void loadParam(const ParamDict&) {}
+    virtual void loadModel(ModelBin&) {}
+    virtual void saveModel(ModelBinWriter&) const {} //inverse of loadModel
+    virtual void forward(const std::vector<Tensor>& inputs, std::vector<Tensor>& outputs, ThreadPool& pool) const = 0;
+
+    // output shapes for the given input shapes; most layers keep the shape of their first input
+    virtual std::vector<TensorShape> outputShapes(const std::vector<TensorShape>& inputs) const {
+        return std::vector<TensorShape>(tops.size(), inputs.at(0));
+    }
+
+    // temporary memory forward() allocates besides its outputs
+    virtual size_t scratchBytes(const std::vector<TensorShape>&) const { return 0; }
+
+    // true if the outputs share the input's storage instead of allocating
+    virtual bool aliasesInput() const { return false; }
+
+protected:
+    // where forward() writes output t: the tensor the net placed there (a channel slice of a concat
+    // buffer, see Net::planConcatBuffers, in the net's storage type) or a new one of type
+    Tensor outputTensor(std::vector<Tensor>& outputs, size_t t, int w, int h, int c, StorageType type = StorageType::Float32) const {
+        if (outputs[t].empty()) return Tensor(w, h, c, type);
+        if (outputs[t].w != w || outputs[t].h != h || outputs[t].c != c) throw std::runtime_error(name + ": planned output has the wrong shape");
+        return outputs[t];
+    }
+};
+
+// ncnn fused activations: 0 none, 1 relu, 2 leaky relu, 3 clip, 4 sigmoid
+inline void applyActivation(float* values, size_t count, int type, const std::vector<float>& params) {
+    switch (type) {
+        case 0:
+            break;
+        case 1:
+            for (size_t i = 0; i < count; ++i) values[i] = std::max(values[i], 0.0f);
+            break;
+        case 2: {
+            float slope = params.empty() ? 0.0f : params[0];
+            for (size_t i = 0; i < count; ++i) values[i] = values[i] > 0 ? values[i] : values[i] * slope;
+            break;
+        }
+        case 3:
+            for (size_t i = 0; i < count; ++i) values[i] = std::clamp(values[i], params.at(0), params.at(1));
+            break;
+        case 4:
+            for (size_t i = 0; i < count; ++i) values[i] = 1.0f / (1.0f + std::exp(-values[i]));
+            break;
+        default:
+            throw std::runtime_error("Unsupported activation type " + std::to_string(type));
+    }
+}
+
+class InputLayer : public Layer {
+public:
+    bool aliasesInput() const override { return true; }
+
+    void forward(const std::vector<Tensor>& inputs, std::vector<Tensor>& outputs, ThreadPool&) const override {
+        outputs[0] = inputs.at(0);
+    }
+};
+
+// how a Convolution layer computes: the direct loops are the reference, GEMM handles any shape,
+// Winograd F(4x4, 3x3) the 3x3 stride-1 layers with enough channels, and Int8 the layers of a
+// quantized model
+enum class ConvAlgorithm { Direct, Gemm, Winograd, Int8 };
+
+inline const char* convAlgorithmName(ConvAlgorithm algorithm) {
+    switch (algorithm) {
+        case ConvAlgorithm::Direct: return "direct";
+        case ConvAlgorithm::Winograd: return "winograd";
+        case ConvAlgorithm::Int8: return "int8";
+        default: return "gemm";
+    }
+}
+
+class ConvolutionLayer : public Layer {
+public:
+    ConvAlgorithm algorithm = ConvAlgorithm::Gemm;
+    int numOutput = 0;
+    int kernelW = 1, kernelH = 1;
+    int dilationW = 1, dilationH = 1;
+    int strideW = 1, strideH = 1;
+    int padLeft = 0, padRight = 0, padTop = 0, padBottom = 0;
+    bool biasTerm = false;
+    int activationType = 0;
+    std::vector<float> activationParams;
+    std::vector<float> weights; //[numOutput][inputChannels][kernelH][kernelW]
+    std::vector<float> bias;
+    PackedWeights packed; //weights in GEMM panel order for the SIMD level active at load
+    WinogradWeights winograd; //transformed weights, only for layers Winograd can run
+    StorageType weightStorage = StorageType::Float32; //precision packed and winograd were rounded to
+
+    //int8 models (ncnn 8=1): weights quantized per output channel, the input with one scale. weights
+    //then holds the dequantized values, so the float algorithms still run the same model
+    bool int8 = false;
+    std::vector<int8_t> quantizedWeights; //[numOutput][inputChannels][kernelH][kernelW]
+    std::vector<float> weightScales;       //per output channel
+    float inputScale = 0.0f;
+    Int8Weights int8Packed;
+
+    //layers folded in by Net::fuseLayers, applied after the activation: a PReLU (one slope per output
+    //channel), then output = outputScale * output + sum of residualCoefficients[k] * bottoms[k + 1]
+    std::vector<float> channelSlopes;
+    float outputScale = 1.0f;
+    std::vector<float> residualCoefficients;
+    std::vector<std::string> fusedLayers;
+
+    void loadParam(const ParamDict& pd) override {
+        numOutput = pd.getInt(0, 0);
+        kernelW = pd.getInt(1, 0);
+        kernelH = pd.getInt(11, kernelW);
+        dilationW = pd.getInt(2, 1);
+        dilationH = pd.getInt(12, dilationW);
+        strideW = pd.getInt(3, 1);
+        strideH = pd.getInt(13, strideW);
+        padLeft = pd.getInt(4, 0);
+        padRight = pd.getInt(15, padLeft);
+        padTop = pd.getInt(14, padLeft);
+        padBottom = pd.getInt(16, padTop);
+        biasTerm = pd.getInt(5, 0) != 0;
+        weightCount = pd.getInt(6, 0);
+        activationType = pd.getInt(9, 0);
+        activationParams = pd.getArray(10);
+
+        if (padLeft < 0 || padTop < 0) throw std::runtime_error(name + ": automatic (SAME) padding is not supported");
+        //1 = weight and input scales; requantized outputs (101) are not supported
+        int scaleTerm = pd.getInt(8, 0);
+        if (scaleTerm != 0 && scaleTerm != 1) throw std::runtime_error(name + ": int8 convolution with output scales is not supported");
+        int8 = scaleTerm == 1;
+    }
+
+    void loadModel(ModelBin& mb) override {
+        //float weights in an int8 layer are quantized here
+        if (int8 && mb.nextIsInt8()) quantizedWeights = mb.loadInt8(weightCount);
+        else weights = mb.load(weightCount, true);
+        if (biasTerm) bias = mb.load(numOutput, false);
+        if (int8) {
+            weightScales = mb.load(numOutput, false);
+            inputScale = mb.load(1, false)[0];
+            if (quantizedWeights.empty()) quantizeWeights();
+            dequantizeWeights();
+        }
+        packWeights();
+    }
+
+    void saveModel(ModelBinWriter& writer) const override {
+        if (int8) writer.writeInt8(quantizedWeights);
+        else writer.write(weights, true);
+        if (biasTerm) writer.write(bias, false);
+        if (int8) {
+            writer.write(weightScales, false);
+            writer.write({inputScale}, false);
+        }
+    }
+
+    // turn this layer into an int8 one; scale maps the input to [-127, 127] (127 / max |input|)
+    void quantize(float scale) {
+        int8 = true;
+        inputScale = scale;
+        weightScales = int8WeightScales(weights.data(), numOutput, inputChannels() * kernelW * kernelH);
+        quantizeWeights();
+        dequantizeWeights();
+        packWeights();
+    }
+
+    bool winogradApplicable() const {
+        return kernelW == 3 && kernelH == 3 && strideW == 1 && strideH == 1 && dilationW == 1 && dilationH == 1;
+    }
+
+    //the transforms cost about as much as a few dozen channels of GEMM work, so thin layers (the RGB
+    //input conv) stay on GEMM; 32+ channels measured 1.2-1.8x faster with AVX-512, see bench-conv
+    bool winogradProfitable() const { return winogradApplicable() && inputChannels() >= 32 && numOutput >= 32; }
+
+    // switch algorithm, e.g. for benchmarks; Winograd and Int8 fall back to GEMM where they do not apply
+    void setAlgorithm(ConvAlgorithm requested) {
+        if (requested == ConvAlgorithm::Int8 && !int8) requested = ConvAlgorithm::Gemm;
+        if (requested == ConvAlgorithm::Winograd && !winogradApplicable()) requested = ConvAlgorithm::Gemm;
+        if (requested == ConvAlgorithm::Winograd && winograd.empty()) {
+            winograd = transformWinogradWeights(storedWeights().data(), numOutput, inputChannels(), activeSimdLevel());
+        }
+        algorithm = requested;
+    }
+
+    // round the GEMM and Winograd weights to type, as a 16-bit model stores them (weights keeps the
+    // loaded values for the direct reference, and Float32 restores them); the algorithm is kept
+    void setWeightStorage(StorageType type) {
+        if (type == weightStorage) return;
+        weightStorage = type;
+        const ConvAlgorithm current = algorithm;
+        packWeights();
+        algorithm = current;
+    }
+
+    int inputChannels() const { return weightCount / (numOutput * kernelW * kernelH); }
+
+    std::vector<TensorShape> outputShapes(const std::vector<TensorShape>& inputs) const override {
+        const TensorShape& in = inputs.at(0);
+        TensorShape out;
+        out.w = (in.w + padLeft + padRight - dilationW * (kernelW - 1) - 1) / strideW + 1;
+        out.h = (in.h + padTop + padBottom - dilationH * (kernelH - 1) - 1) / strideH + 1;
+        out.c = numOutput;
+        return {out};
+    }
+
+    //the zero-padded copy of the input, or its int8 copy (GEMM only needs a fixed-size im2col block
+    //per thread)
+    size_t scratchBytes(const std::vector<TensorShape>& inputs) const override {
+        if (algorithm == ConvAlgorithm::Int8) return inputs.at(0).bytes() / sizeof(float);
+        if (algorithm != ConvAlgorithm::Direct) return 0;
+        if (padLeft == 0 && padRight == 0 && padTop == 0 && padBottom == 0) return 0;
+        const TensorShape& in = inputs.at(0);
+        return TensorShape{in.w + padLeft + padRight, in.h + padTop + padBottom, in.c}.bytes();
+    }
+
+    void forward(const std::vector<Tensor>& inputs, std::vector<Tensor>& outputs, ThreadPool& pool) const override {
+        const Tensor& input = inputs[0];
+        if (input.c != inputChannels()) throw std::runtime_error(name + ": unexpected input channel count");
+        TensorShape shape = outputShapes({TensorShape{input.w, input.h, input.c}})[0];
+        if (inputs.size() != residualCoefficients.size() + 1) throw std::runtime_error(name + ": unexpected input count");
+        for (size_t k = 1; k < inputs.size(); ++k) {
+            if (inputs[k].w != shape.w || inputs[k].h != shape.h || inputs[k].c != shape.c) throw std::runtime_error(name + ": fused add shape mismatch");
+        }
+        if (algorithm == ConvAlgorithm::Direct) {
+            Tensor direct = forwardDirect(input, pool);
+            if (outputs[0].empty() && !hasFusedLayers()) {
+                outputs[0] = direct;
+                return;
+            }
+            Tensor output = outputTensor(outputs, 0, shape.w, shape.h, shape.c);
+            pool.parallelFor(numOutput, [&](int oc) {
+                applyFused(inputs, oc, 0, direct.channel(oc), static_cast<int>(direct.planeSize()));
+                convertChannel(direct, oc, output, oc);
+            });
+            outputs[0] = output;
+            return;
+        }
+
+        Tensor output = outputTensor(outputs, 0, shape.w, shape.h, shape.c);
+        //bias, activation and fused layers while the values are still in cache; 16-bit outputs are
+        //computed in a float buffer (a null output for the drivers) and narrowed here
+        auto epilogue = [&](int oc, size_t offset, float* values, int count) {
+            if (biasTerm) {
+                for (int i = 0; i < count; ++i) values[i] += bias[oc];
+            }
+            applyActivation(values, count, activationType, activationParams);
+            applyFused(inputs, oc, offset, values, count);
+            if (output.data16) narrowRow(values, output.channel16(oc) + offset, count, output.type);
+        };
+        const ConvInput source{input.channelValues(0), input.cstep, input.type};
+        if (algorithm == ConvAlgorithm::Int8) {
+            convolutionInt8(geometry(input), source, inputScale, int8Packed, output.data, output.cstep, pool, epilogue);
+        } else if (algorithm == ConvAlgorithm::Winograd) {
+            convolutionWinograd(geometry(input), source, winograd, output.data, output.cstep, pool, epilogue);
+        } else {
+            convolutionGemm(geometry(input), source, packed, output.data, output.cstep, pool, epilogue);
+        }
+        outputs[0] = output;
+    }
+
+    ConvGeometry geometry(const Tensor& input) const {
+        TensorShape shape = outputShapes({TensorShape{input.w, input.h, input.c}})[0];
+        ConvGeometry g;
+        g.inW = input.w;
+        g.inH = input.h;
+        g.inC = input.c;
+        g.outW = shape.w;
+        g.outH = shape.h;
+        g.kernelW = kernelW;
+        g.kernelH = kernelH;
+        g.strideW = strideW;
+        g.strideH = strideH;
+        g.dilationW = dilationW;
+        g.dilationH = dilationH;
+        g.padLeft = padLeft;
+        g.padTop = padTop;
+        return g;
+    }
+
+    bool hasFusedLayers() const { return !fusedLayers.empty(); }
+
+    // the fused PReLU and adds on count values of channel oc starting at pixel offset
+    void applyFused(const std::vector<Tensor>& inputs, int oc, size_t offset, float* values, int count) const {
+        if (!channelSlopes.empty()) {
+            const float slope = channelSlopes[oc];
+            for (int i = 0; i < count; ++i) values[i] = values[i] > 0 ? values[i] : values[i] * slope;
+        }
+        if (outputScale != 1.0f) {
+            for (int i = 0; i < count; ++i) values[i] *= outputScale;
+        }
+        for (size_t k = 0; k < residualCoefficients.size(); ++k) {
+            const Tensor& source = inputs[k + 1];
+            const float* residual = source.data ? source.channel(oc) + offset : nullptr;
+            if (!residual) {
+                thread_local std::vector<float> wide;
+                wide.resize(count);
+                widenRow(source.channel16(oc) + offset, wide.data(), count, source.type);
+                residual = wide.data();
+            }
+            const float coefficient = residualCoefficients[k];
+            if (coefficient == 1.0f) {
+                for (int i = 0; i < count; ++i) values[i] += residual[i];
+            } else {
+                for (int i = 0; i < count; ++i) values[i] += residual[i] * coefficient;
+            }
+        }
+    }
+
+    // reference direct convolution (bias and activation, not the fused layers), one output channel per task
+    Tensor forwardDirect(const Tensor& input, ThreadPool& pool) const {
+        //zero-pad once (in float) so the inner loops never branch on borders
+        Tensor padded = padInput(input, pool);
+
+        const int outW = (padded.w - dilationW * (kernelW - 1) - 1) / strideW + 1;
+        const int outH = (padded.h - dilationH * (kernelH - 1) - 1) / strideH + 1;
+        Tensor output(outW, outH, numOutput);
+        const int inC = input.c;
+        const int kernelSize = kernelW * kernelH;
+
+        pool.parallelFor(numOutput, [&](int oc) {
+            float* out = output.channel(oc);
+            std::fill(out, out + output.planeSize(), biasTerm ? bias[oc] : 0.0f);
+
+            for (int ic = 0; ic < inC; ++ic) {
+                const float* kernel = &weights[(static_cast<size_t>(oc) * inC + ic) * kernelSize];
+                for (int ky = 0; ky < kernelH; ++ky) {
+                    for (int kx = 0; kx < kernelW; ++kx) {
+                        const float weight = kernel[ky * kernelW + kx];
+                        for (int y = 0; y < outH; ++y) {
+                            const float* src = padded.row(ic, y * strideH + ky * dilationH) + kx * dilationW;
+                            float* dst = out + static_cast<size_t>(y) * outW;
+                            if (strideW == 1) {
+                                for (int x = 0; x < outW; ++x) dst[x] += weight * src[x]; //vectorizes
+                            } else {
+                                for (int x = 0; x < outW; ++x) dst[x] += weight * src[x * strideW];
+                            }
+                        }
+                    }
+                }
+            }
+            applyActivation(out, output.planeSize(), activationType, activationParams);
+        });
+        return output;
+    }
+
+private:
+    int weightCount = 0;
+
+    void quantizeWeights() {
+        const size_t k = weightCount / numOutput;
+        quantizedWeights.resize(weightCount);
+        for (size_t i = 0; i < static_cast<size_t>(weightCount); ++i) quantizedWeights[i] = quantizeInt8(weights[i], weightScales[i / k]);
+    }
+
+    void dequantizeWeights() {
+        const size_t k = weightCount / numOutput;
+        weights.resize(weightCount);
+        for (size_t i = 0; i < static_cast<size_t>(weightCount); ++i) weights[i] = quantizedWeights[i] / weightScales[i / k];
+    }
+
+    // weights as the float algorithms use them: rounded to weightStorage
+    std::vector<float> storedWeights() const {
+        std::vector<float> stored = weights;
+        for (float& value : stored) value = roundToStorage(value, weightStorage);
+        return stored;
+    }
+
+    void packWeights() {
+        const int k = inputChannels() * kernelW * kernelH;
+        const std::vector<float> stored = storedWeights();
+        packed = packGemmWeights(stored.data(), numOutput, k, activeSimdLevel());
+        winograd = WinogradWeights();
+        if (winogradApplicable()) winograd = transformWinogradWeights(stored.data(), numOutput, inputChannels(), activeSimdLevel());
+        int8Packed = Int8Weights();
+        if (int8) int8Packed = packInt8Weights(quantizedWeights.data(), weightScales.data(), numOutput, k, activeSimdLevel());
+        algorithm = int8 ? ConvAlgorithm::Int8 : winogradProfitable() ? ConvAlgorithm::Winograd : ConvAlgorithm::Gemm;
+    }
+
+    Tensor padInput(const Tensor& input, ThreadPool& pool) const {
+        if (padLeft == 0 && padRight == 0 && padTop == 0 && padBottom == 0) return convertTensor(input, StorageType::Float32, pool);
+        Tensor padded(input.w + padLeft + padRight, input.h + padTop + padBottom, input.c);
+        padded.fill(0.0f);
+        for (int q = 0; q < input.c; ++q) {
+            for (int y = 0; y < input.h; ++y) {
+                const float* src = readRow(input, q, y, rowBuffer(0, input.w));
+                std::copy(src, src + input.w, padded.row(q, y + padTop) + padLeft);
+            }
+        }
+        return padded;
+    }
+};
+
+class PReLULayer : public Layer {
+public:
+    std::vector<float> slopes;
+
+    void loadParam(const ParamDict& pd) override { slopeCount = pd.getInt(0, 0); }
+    void loadModel(ModelBin& mb) override { slopes = mb.load(slopeCount, false); }
+    void saveModel(ModelBinWriter& writer) const override { writer.write(slopes, false); }
+
+    void forward(const std::vector<Tensor>& inputs, std::vector<Tensor>& outputs, ThreadPool& pool) const override {
+        const Tensor& input = inputs[0];
+        Tensor output = outputTensor(outputs, 0, input.w, input.h, input.c, input.type);
+        pool.parallelFor(input.c, [&](int q) {
+            float slope = slopes.size() == 1 ? slopes[0] : slopes.at(q);
+            for (int y = 0; y < input.h; ++y) {
+                const float* src = readRow(input, q, y, rowBuffer(0, input.w));
+                float* dst = writeRow(output, q, y, rowBuffer(1, input.w));
+                for (int x = 0; x < input.w; ++x) dst[x] = src[x] > 0 ? src[x] : src[x] * slope;
+                storeRow(output, q, y, dst);
+            }
+        });
+        outputs[0] = output;
+    }
+
+private:
+    int slopeCount = 0;
+};
+
+// max(x, 0), or x * slope below zero when slope is set (ncnn ReLU; Net::fuseLayers folds it into a
+// preceding convolution's activation)
+class ReLULayer : public Layer {
+public:
+    float slope = 0.0f;
+
+    void loadParam(const ParamDict& pd) override { slope = pd.getFloat(0, 0.0f); }
+
+    void forward(const std::vector<Tensor>& inputs, std::vector<Tensor>& outputs, ThreadPool& pool) const override {
+        const Tensor& input = inputs[0];
+        Tensor output = outputTensor(outputs, 0, input.w, input.h, input.c, input.type);
+        pool.parallelFor(input.c, [&](int q) {
+            for (int y = 0; y < input.h; ++y) {
+                const float* src = readRow(input, q, y, rowBuffer(0, input.w));
+                float* dst = writeRow(output, q, y, rowBuffer(1, input.w));
+                for (int x = 0; x < input.w; ++x) dst[x] = src[x] > 0 ? src[x] : src[x] * slope;
+                storeRow(output, q, y, dst);
+            }
+        });
+        outputs[0] = output;
+    }
+};
+
+// max or average over kernel windows (ncnn Pooling), as in the feature stacks of AlexNet and VGG.
+// pad modes: 0 full (the right/bottom padding grows so a partial last window still counts), 1 valid
+// (only the given padding), 2/3 same (output = ceil(input / stride), the odd pixel of padding after
+// or before). padding never wins a max; averages divide by the real pixels in the window, or by the
+// window clipped to the explicit padding when 6=1 (count_include_pad)
+class PoolingLayer : public Layer {
+public:
+    int poolingType = 0; //0 max, 1 average
+    int kernelW = 1, kernelH = 1;
+    int strideW = 1, strideH = 1;
+    int padLeft = 0, padRight = 0, padTop = 0, padBottom = 0;
+    bool globalPooling = false;
+    int padMode = 0;
+    bool countIncludePad = false;
+
+    void loadParam(const ParamDict& pd) override {
+        poolingType = pd.getInt(0, 0);
+        kernelW = pd.getInt(1, 0);
+        kernelH = pd.getInt(11, kernelW);
+        strideW = pd.getInt(2, 1);
+        strideH = pd.getInt(12, strideW);
+        padLeft = pd.getInt(3, 0);
+        padRight = pd.getInt(14, padLeft);
+        padTop = pd.getInt(13, padLeft);
+        padBottom = pd.getInt(15, padTop);
+        globalPooling = pd.getInt(4, 0) != 0;
+        padMode = pd.getInt(5, 0);
+        countIncludePad = pd.getInt(6, 0) != 0;
+        if (poolingType != 0 && poolingType != 1) throw std::runtime_error(name + ": unsupported pooling type");
+        if (pd.getInt(7, 0) != 0) throw std::runtime_error(name + ": adaptive pooling is not supported");
+        if (padMode < 0 || padMode > 3) throw std::runtime_error(name + ": unsupported pad mode");
+        if (!globalPooling && (kernelW <= 0 || kernelH <= 0 || strideW <= 0 || strideH <= 0)) {
+            throw std::runtime_error(name + ": bad kernel or stride");
+        }
+    }
+
+    std::vector<TensorShape> outputShapes(const std::vector<TensorShape>& inputs) const override {
+        const TensorShape& in = inputs.at(0);
+        if (globalPooling) return {TensorShape{1, 1, in.c}};
+        const Window x = window(in.w, kernelW, strideW, padLeft, padRight);
+        const Window y = window(in.h, kernelH, strideH, padTop, padBottom);
+        return {TensorShape{x.outputs, y.outputs, in.c}};
+    }
+
+    void forward(const std::vector<Tensor>& inputs, std::vector<Tensor>& outputs, ThreadPool& pool) const override {
+        const Tensor input = convertTensor(inputs[0], StorageType::Float32, pool);
+        const TensorShape shape = outputShapes({TensorShape{input.w, input.h, input.c}})[0];
+        Tensor output = outputTensor(outputs, 0, shape.w, shape.h, shape.c, inputs[0].type);
+        const Window wx = globalPooling ? Window{input.w, 1, 0, 0, 1} : window(input.w, kernelW, strideW, padLeft, padRight);
+        const Window wy = globalPooling ? Window{input.h, 1, 0, 0, 1} : window(input.h, kernelH, strideH, padTop, padBottom);
+
+        pool.parallelFor(input.c, [&](int q) {
+            for (int oy = 0; oy < output.h; ++oy) {
+                const int top = oy * wy.stride - wy.before;
+                const int y0 = std::max(top, 0), y1 = std::min(top + wy.kernel, input.h);
+                float* dst = writeRow(output, q, oy, rowBuffer(0, output.w));
+                for (int ox = 0; ox < output.w; ++ox) {
+                    const int left = ox * wx.stride - wx.before;
+                    const int x0 = std::max(left, 0), x1 = std::min(left + wx.kernel, input.w);
+                    float value = poolingType == 0 ? -std::numeric_limits<float>::max() : 0.0f;
+                    for (int y = y0; y < y1; ++y) {
+                        const float* src = input.row(q, y);
+                        for (int x = x0; x < x1; ++x) value = poolingType == 0 ? std::max(value, src[x]) : value + src[x];
+                    }
+                    if (poolingType == 1) {
+                        int count = (y1 - y0) * (x1 - x0);
+                        if (countIncludePad) {
+                            //the window clipped to the explicit padding, not to what full mode adds
+                            const int py = std::min(top + wy.kernel, input.h + wy.after) - std::max(top, -wy.before);
+                            const int px = std::min(left + wx.kernel, input.w + wx.after) - std::max(left, -wx.before);
+                            count = py * px;
+                        }
+                        value = count > 0 ? value / count : 0.0f;
+                    }
+                    dst[ox] = value;
+                }
+                storeRow(output, q, oy, dst);
+            }
+        });
+        outputs[0] = output;
+    }
+
+private:
+    // one axis: kernel, stride, padding before and explicit padding after, and the output count
+    struct Window {
+        int kernel, stride, before, after, outputs;
+    };
+
+    Window window(int size, int kernel, int stride, int before, int after) const {
+        if (padMode == 2 || padMode == 3) {
+            const int pad = std::max(0, kernel + (size - 1) / stride * stride - size);
+            before = padMode == 2 ? pad / 2 : pad - pad / 2;
+            after = pad - before;
+        }
+        int padded = size + before + after;
+        if (padMode == 0 && padded >= kernel && (padded - kernel) % stride != 0) padded += stride - (padded - kernel) % stride;
+        if (padded < kernel) throw std::runtime_error(name + ": input smaller than the pooling window");
+        return Window{kernel, stride, before, after, (padded - kernel) / stride + 1};
+    }
+};
+
+// depth to space: channel p * r * r + sy * r + sx becomes pixel (sy, sx) of each r x r block of channel p
+class PixelShuffleLayer : public Layer {
+public:
+    int factor = 1;
+    int mode = 0;
+
+    void loadParam(const ParamDict& pd) override {
+        factor = pd.getInt(0, 1);
+        mode = pd.getInt(1, 0);
+    }
+
+    std::vector<TensorShape> outputShapes(const std::vector<TensorShape>& inputs) const override {
+        const TensorShape& in = inputs.at(0);
+        return {TensorShape{in.w * factor, in.h * factor, in.c / (factor * factor)}};
+    }
+
+    void forward(const std::vector<Tensor>& inputs, std::vector<Tensor>& outputs, ThreadPool& pool) const override {
+        const Tensor& input = inputs[0];
+        const int outC = input.c / (factor * factor);
+        Tensor output = outputTensor(outputs, 0, input.w * factor, input.h * factor, outC, input.type);
+
+        //one output row at a time: it interleaves factor input rows
+        pool.parallelFor(outC, [&](int p) {
+            for (int y = 0; y < output.h; ++y) {
+                const int sy = y % factor;
+                float* dst = writeRow(output, p, y, rowBuffer(0, output.w));
+                for (int sx = 0; sx < factor; ++sx) {
+                    int q = mode == 0 ? (p * factor + sy) * factor + sx : (sy * factor + sx) * outC + p;
+                    const float* src = readRow(input, q, y / factor, rowBuffer(1, input.w));
+                    for (int x = 0; x < input.w; ++x) dst[x * factor + sx] = src[x];
+                }
+                storeRow(output, p, y, dst);
+            }
+        });
+        outputs[0] = output;
+    }
+};
+
+// source position and 4 cubic weights for every output coordinate (half-pixel centers, A = -0.75).
+// the taps are source - 1 .. source + 2 and may fall outside the input; callers clamp them to the
+// edge, which matches ncnn's border handling
+inline void cubicCoefficients(int outputSize, float scale, std::vector<int>& index, std::vector<float>& weights) {
+    index.resize(outputSize);
+    weights.resize(static_cast<size_t>(outputSize) * 4);
+    const float A = -0.75f;
+    for (int o = 0; o < outputSize; ++o) {
+        float f = static_cast<float>((o + 0.5) * scale - 0.5);
+        int s = static_cast<int>(std::floor(f));
+        f -= s;
+        float* w = &weights[static_cast<size_t>(o) * 4];
+        w[0] = ((A * (f + 1) - 5 * A) * (f + 1) + 8 * A) * (f + 1) - 4 * A;
+        w[1] = ((A + 2) * f - (A + 3)) * f * f + 1;
+        w[2] = ((A + 2) * (1 - f) - (A + 3)) * (1 - f) * (1 - f) + 1;
+        w[3] = 1.0f - w[0] - w[1] - w[2];
+        index[o] = s;
+    }
+}
+
+class InterpLayer : public Layer {
+public:
+    int resizeType = 2; //1 nearest, 2 bilinear, 3 bicubic
+    float heightScale = 1.0f;
+    float widthScale = 1.0f;
+    int outputHeight = 0;
+    int outputWidth = 0;
+
+    void loadParam(const ParamDict& pd) override {
+        resizeType = pd.getInt(0, 0);
+        heightScale = pd.getFloat(1, 1.0f);
+        widthScale = pd.getFloat(2, 1.0f);
+        outputHeight = pd.getInt(3, 0);
+        outputWidth = pd.getInt(4, 0);
+        if (pd.getInt(6, 0) != 0) throw std::runtime_error(name + ": align_corner interpolation is not supported");
+        if (resizeType < 1 || resizeType > 3) throw std::runtime_error(name + ": unsupported resize type");
+    }
+
+    std::vector<TensorShape> outputShapes(const std::vector<TensorShape>& inputs) const override {
+        const TensorShape& in = inputs.at(0);
+        return {TensorShape{outputWidth ? outputWidth : static_cast<int>(in.w * widthScale),
+                            outputHeight ? outputHeight : static_cast<int>(in.h * heightScale), in.c}};
+    }
+
+    void forward(const std::vector<Tensor>& inputs, std::vector<Tensor>& outputs, ThreadPool& pool) const override {
+        const Tensor& input = inputs[0];
+        TensorShape shape = outputShapes({TensorShape{input.w, input.h, input.c}})[0];
+        Tensor output = outputTensor(outputs, 0, shape.w, shape.h, input.c, input.type);
+
+        if (resizeType == 1) nearest(input, output, pool);
+        else if (resizeType == 2) bilinear(input, output, pool);
+        else bicubic(input, output, pool);
+        outputs[0] = output;
+    }
+
+private:
+    static void nearest(const Tensor& input, const Tensor& output, ThreadPool& pool) {
+        const float scaleX = static_cast<float>(input.w) / output.w;
+        const float scaleY = static_cast<float>(input.h) / output.h;
+        std::vector<int> xIndex(output.w);
+        for (int x = 0; x < output.w; ++x) xIndex[x] = std::min(static_cast<int>(x * scaleX), input.w - 1);
+
+        pool.parallelFor(input.c, [&](int q) {
+            for (int y = 0; y < output.h; ++y) {
+                const float* src = readRow(input, q, std::min(static_cast<int>(y * scaleY), input.h - 1), rowBuffer(0, input.w));
+                float* dst = writeRow(output, q, y, rowBuffer(1, output.w));
+                for (int x = 0; x < output.w; ++x) dst[x] = src[xIndex[x]];
+                storeRow(output, q, y, dst);
+            }
+        });
+    }
+
+    static void linearCoefficients(int inputSize, int outputSize, std::vector<int>& index, std::vector<float>& weight) {
+        index.resize(outputSize);
+        weight.resize(outputSize);
+        const double scale = static_cast<double>(inputSize) / outputSize;
+        for (int o = 0; o < outputSize; ++o) {
+            float f = static_cast<float>((o + 0.5) * scale - 0.5);
+            int s = static_cast<int>(std::floor(f));
+            f -= s;
+            if (s < 0) {
+                s = 0;
+                f = 0;
+            }
+            if (s >= inputSize - 1) {
+                s = std::max(0, inputSize - 2);
+                f = inputSize > 1 ? 1.0f : 0.0f;
+            }
+            index[o] = s;
+            weight[o] = f;
+        }
+    }
+
+    static void bilinear(const Tensor& input, const Tensor& output, ThreadPool& pool) {
+        std::vector<int> xIndex, yIndex;
+        std::vector<float> xWeight, yWeight;
+        linearCoefficients(input.w, output.w, xIndex, xWeight);
+        linearCoefficients(input.h, output.h, yIndex, yWeight);
+        const int lastX = input.w - 1;
+        const int lastY = input.h - 1;
+
+        pool.parallelFor(input.c, [&](int q) {
+            for (int y = 0; y < output.h; ++y) {
+                const float* row0 = readRow(input, q, yIndex[y], rowBuffer(0, input.w));
+                const float* row1 = readRow(input, q, std::min(yIndex[y] + 1, lastY), rowBuffer(1, input.w));
+                float fy = yWeight[y];
+                float* dst = writeRow(output, q, y, rowBuffer(2, output.w));
+                for (int x = 0; x < output.w; ++x) {
+                    int sx = xIndex[x];
+                    int sx1 = std::min(sx + 1, lastX);
+                    float fx = xWeight[x];
+                    float top = row0[sx] * (1 - fx) + row0[sx1] * fx;
+                    float bottom = row1[sx] * (1 - fx) + row1[sx1] * fx;
+                    dst[x] = top * (1 - fy) + bottom * fy;
+                }
+                storeRow(output, q, y, dst);
+            }
+        });
+    }
+
+    static void bicubic(const Tensor& input, const Tensor& output, ThreadPool& pool) {
+        std::vector<int> xIndex, yIndex;
+        std::vector<float> xWeight, yWeight;
+        cubicCoefficients(output.w, static_cast<float>(static_cast<double>(input.w) / output.w), xIndex, xWeight);
+        cubicCoefficients(output.h, static_cast<float>(static_cast<double>(input.h) / output.h), yIndex, yWeight);
+
+        pool.parallelFor(input.c, [&](int q) {
+            std::vector<float> rows(static_cast<size_t>(output.w) * 4);
+            for (int y = 0; y < output.h; ++y) {
+                //horizontal pass on the 4 source rows, then blend them vertically
+                for (int k = 0; k < 4; ++k) {
+                    const float* src = readRow(input, q, std::clamp(yIndex[y] - 1 + k, 0, input.h - 1), rowBuffer(0, input.w));
+                    float* dst = &rows[static_cast<size_t>(k) * output.w];
+                    for (int x = 0; x < output.w; ++x) {
+                        const float* w = &xWeight[static_cast<size_t>(x) * 4];
+                        int s = xIndex[x];
+                        dst[x] = src[std::clamp(s - 1, 0, input.w - 1)] * w[0] + src[std::clamp(s, 0, input.w - 1)] * w[1] +
+                                 src[std::clamp(s + 1, 0, input.w - 1)] * w[2] + src[std::clamp(s + 2, 0, input.w - 1)] * w[3];
+                    }
+                }
+                const float* w = &yWeight[static_cast<size_t>(y) * 4];
+                float* dst = writeRow(output, q, y, rowBuffer(1, output.w));
+                for (int x = 0; x < output.w; ++x) {
+                    dst[x] = rows[x] * w[0] + rows[output.w + x] * w[1] + rows[2 * output.w + x] * w[2] + rows[3 * output.w + x] * w[3];
+                }
+                storeRow(output, q, y, dst);
+            }
+        });
+    }
+};
+
+class BinaryOpLayer : public Layer {
+public:
+    int opType = 0; //0 add, 1 sub, 2 mul, 3 div, 4 max, 5 min, 6 pow, 7 rsub, 8 rdiv
+    bool withScalar = false;
+    float scalar = 0.0f;
+
+    void loadParam(const ParamDict& pd) override {
+        opType = pd.getInt(0, 0);
+        withScalar = pd.getInt(1, 0) != 0;
+        scalar = pd.getFloat(2, 0.0f);
+        if (opType < 0 || opType > 8) throw std::runtime_error(name + ": unsupported binary op");
+    }
+
+    static float apply(int op, float a, float b) {
+        switch (op) {
+            case 0: return a + b;
+            case 1: return a - b;
+            case 2: return a * b;
+            case 3: return a / b;
+            case 4: return std::max(a, b);
+            case 5: return std::min(a, b);
+            case 6: return std::pow(a, b);
+            case 7: return b - a;
+            default: return b / a;
+        }
+    }
+
+    void forward(const std::vector<Tensor>& inputs, std::vector<Tensor>& outputs, ThreadPool& pool) const override {
+        const Tensor& a = inputs[0];
+        Tensor output = outputTensor(outputs, 0, a.w, a.h, a.c, a.type);
+        if (withScalar) {
+            pool.parallelFor(a.c, [&](int q) {
+                for (int y = 0; y < a.h; ++y) {
+                    const float* src = readRow(a, q, y, rowBuffer(0, a.w));
+                    float* dst = writeRow(output, q, y, rowBuffer(1, a.w));
+                    for (int x = 0; x < a.w; ++x) dst[x] = apply(opType, src[x], scalar);
+                    storeRow(output, q, y, dst);
+                }
+            });
+        } else {
+            const Tensor& b = inputs[1];
+            if (b.w != a.w || b.h != a.h || b.c != a.c) throw std::runtime_error(name + ": broadcasting is not supported");
+            pool.parallelFor(a.c, [&](int q) {
+                for (int y = 0; y < a.h; ++y) {
+                    const float* srcA = readRow(a, q, y, rowBuffer(0, a.w));
+                    const float* srcB = readRow(b, q, y, rowBuffer(1, a.w));
+                    float* dst = writeRow(output, q, y, rowBuffer(2, a.w));
+                    for (int x = 0; x < a.w; ++x) dst[x] = apply(opType, srcA[x], srcB[x]);
+                    storeRow(output, q, y, dst);
+                }
+            });
+        }
+        outputs[0] = output;
+    }
+};
+
+class EltwiseLayer : public Layer {
+public:
+    int opType = 1; //0 prod, 1 sum, 2 max
+    std::vector<float> coefficients;
+
+    void loadParam(const ParamDict& pd) override {
+        opType = pd.getInt(0, 0);
+        coefficients = pd.getArray(1);
+        if (opType < 0 || opType > 2) throw std::runtime_error(name + ": unsupported eltwise op");
+    }
+
+    void forward(const std::vector<Tensor>& inputs, std::vector<Tensor>& outputs, ThreadPool& pool) const override {
+        const Tensor& first = inputs[0];
+        for (const Tensor& input : inputs) {
+            if (input.w != first.w || input.h != first.h || input.c != first.c) throw std::runtime_error(name + ": shape mismatch");
+        }
+        Tensor output = outputTensor(outputs, 0, first.w, first.h, first.c, first.type);
+        pool.parallelFor(first.c, [&](int q) {
+            for (int y = 0; y < first.h; ++y) {
+                float* dst = writeRow(output, q, y, rowBuffer(0, first.w));
+                const int size = first.w;
+                float coeff0 = coefficients.empty() ? 1.0f : coefficients[0];
+                const float* src0 = readRow(inputs[0], q, y, rowBuffer(1, size));
+                for (int i = 0; i < size; ++i) dst[i] = opType == 1 ? src0[i] * coeff0 : src0[i];
+
+                for (size_t b = 1; b < inputs.size(); ++b) {
+                    const float* src = readRow(inputs[b], q, y, rowBuffer(1, size));
+                    float coeff = coefficients.empty() ? 1.0f : coefficients.at(b);
+                    for (int i = 0; i < size; ++i) {
+                        if (opType == 0) dst[i] *= src[i];
+                        else if (opType == 1) dst[i] += src[i] * coeff;
+                        else dst[i] = std::max(dst[i], src[i]);
+                    }
+                }
+                storeRow(output, q, y, dst);
+            }
+        });
+        outputs[0] = output;
+    }
+};
+
+// every output is the input; tensors share storage so nothing is copied
+class SplitLayer : public Layer {
+public:
+    bool aliasesInput() const override { return true; }
+
+    void forward(const std::vector<Tensor>& inputs, std::vector<Tensor>& outputs, ThreadPool&) const override {
+        for (Tensor& output : outputs) output = inputs[0];
+    }
+};
+
+class ConcatLayer : public Layer {
+public:
+    int axis = 0;
+    bool inPlace = false; //the net places the inputs back to back in one buffer, so the output is a view of it
+
+    bool aliasesInput() const override { return inPlace; }
+
+    void loadParam(const ParamDict& pd) override {
+        axis = pd.getInt(0, 0);
+        if (axis != 0) throw std::runtime_error(name + ": only channel concat is supported");
+    }
+
+    std::vector<TensorShape> outputShapes(const std::vector<TensorShape>& inputs) const override {
+        TensorShape out = inputs.at(0);
+        out.c = 0;
+        for (const TensorShape& input : inputs) out.c += input.c;
+        return {out};
+    }
+
+    void forward(const std::vector<Tensor>& inputs, std::vector<Tensor>& outputs, ThreadPool& pool) const override {
+        int channels = 0;
+        for (const Tensor& input : inputs) {
+            if (input.w != inputs[0].w || input.h != inputs[0].h) throw std::runtime_error(name + ": shape mismatch");
+            channels += input.c;
+        }
+        if (inPlace && contiguous(inputs)) {
+            outputs[0] = inputs[0].channelSlice(0, channels);
+            return;
+        }
+        Tensor output = outputTensor(outputs, 0, inputs[0].w, inputs[0].h, channels, inputs[0].type);
+        std::vector<std::pair<const Tensor*, int>> sources;
+        for (const Tensor& input : inputs) {
+            for (int q = 0; q < input.c; ++q) sources.push_back({&input, q});
+        }
+        pool.parallelFor(channels, [&](int q) { convertChannel(*sources[q].first, sources[q].second, output, q); });
+        outputs[0] = output;
+    }
+
+private:
+    // every input starts where the previous one ends, in the same storage
+    static bool contiguous(const std::vector<Tensor>& inputs) {
+        int offset = 0;
+        for (const Tensor& input : inputs) {
+            if (input.storage != inputs[0].storage || input.type != inputs[0].type || input.cstep != inputs[0].cstep) return false;
+            if (input.channelValues(0) != inputs[0].channelValues(offset)) return false;
+            offset += input.c;
+        }
+        return true;
+    }
+};
+
+inline std::unique_ptr<Layer> createLayer(const std::string& type) {
+    if (type == "Input") return std::make_unique<InputLayer>();
+    if (type == "Convolution") return std::make_unique<ConvolutionLayer>();
+    if (type == "PReLU") return std::make_unique<PReLULayer>();
+    if (type == "ReLU") return std::make_unique<ReLULayer>();
+    if (type == "Pooling") return std::make_unique<PoolingLayer>();
+    if (type == "PixelShuffle") return std::make_unique<PixelShuffleLayer>();
+    if (type == "Interp") return std::make_unique<InterpLayer>();
+    if (type == "BinaryOp") return std::make_unique<BinaryOpLayer>();
+    if (type == "Eltwise") return std::make_unique<EltwiseLayer>();
+    if (type == "Split") return std::make_unique<SplitLayer>();
+    if (type == "Concat") return std::make_unique<ConcatLayer>();
+    throw std::runtime_error("Unsupported layer type: " + type);
+}
+
+// the upsampling tail of realesr-animevideov3, found by Net::planUpsampleTail: a PixelShuffle takes
+// the last convolution's features to factor x the input size, the input upscaled by nearest neighbour
+// is added to it (the skip), and the x2 and x3 models then resize the sum with a bicubic Interp. run
+// fused, each output row is made from the features and the input when it is needed, so the shuffled,
+// skip and sum tensors (each as large as the output or larger) are never written. the arithmetic is
+// the layers' own, in the same order, so float results match them bit for bit
+struct UpsampleTail {
+    int firstLayer = -1; //the layers from here on are the tail
+    int featuresBlob = -1;
+    const PixelShuffleLayer* shuffle = nullptr;
+    const InterpLayer* skip = nullptr;
+    const InterpLayer* resize = nullptr; //or null
+
+    bool empty() const { return firstLayer < 0; }
+
+    // run the tail for a w x h output, calling sink(y, rows) with rows[q] the w values of channel q in
+    // output row y. rows are made in parallel bands, so sink is called from several threads at once
+    template <typename Sink>
+    void run(const Tensor& features, const Tensor& input, int w, int h, ThreadPool& pool, const Sink& sink) const {
+        const int factor = shuffle->factor;
+        const int channels = input.c;
+        const int sumW = input.w * factor, sumH = input.h * factor;
+        if (features.c != channels * factor * factor || features.w != input.w || features.h != input.h) {
+            throw std::runtime_error(shuffle->name + ": features do not match the input");
+        }
+
+        //the skip pixel under each sum pixel, mapped as InterpLayer::nearest does
+        const float scaleX = static_cast<float>(input.w) / sumW;
+        const float scaleY = static_cast<float>(input.h) / sumH;
+        std::vector<int> skipX(sumW), skipY(sumH);
+        for (int x = 0; x < sumW; ++x) skipX[x] = std::min(static_cast<int>(x * scaleX), input.w - 1);
+        for (int y = 0; y < sumH; ++y) skipY[y] = std::min(static_cast<int>(y * scaleY), input.h - 1);
+
+        std::vector<int> xIndex, yIndex;
+        std::vector<float> xWeight, yWeight;
+        if (resize) {
+            cubicCoefficients(w, static_cast<float>(static_cast<double>(sumW) / w), xIndex, xWeight);
+            cubicCoefficients(h, static_cast<float>(static_cast<double>(sumH) / h), yIndex, yWeight);
+        }
+
+        parallelRowBands(pool, h, 8, [&](int begin, int end) {
+            std::vector<float> out(static_cast<size_t>(w) * channels), sum(sumW);
+            //horizontally resized sum rows, 4 per channel in slot row % 4: the next output row reuses most
+            std::vector<float> lines(static_cast<size_t>(w) * 4 * channels);
+            std::vector<int> lineRow(static_cast<size_t>(4) * channels, -1);
+            std::vector<float> featureRow(features.w), skipRow(input.w);
+            std::vector<const float*> rows(channels);
+            for (int q = 0; q < channels; ++q) rows[q] = &out[static_cast<size_t>(q) * w];
+
+            //row y of the sum in channel q: the pixel shuffle interleaves factor feature rows
+            auto sumRow = [&](int q, int y) {
+                const int sy = y % factor;
+                for (int sx = 0; sx < factor; ++sx) {
+                    const int p = shuffle->mode == 0 ? (q * factor + sy) * factor + sx : (sy * factor + sx) * channels + q;
+                    const float* src = readRow(features, p, y / factor, featureRow.data());
+                    for (int x = 0; x < features.w; ++x) sum[x * factor + sx] = src[x];
+                }
+                const float* skipped = readRow(input, q, skipY[y], skipRow.data());
+                for (int x = 0; x < sumW; ++x) sum[x] = sum[x] + skipped[skipX[x]];
+            };
+
+            for (int y = begin; y < end; ++y) {
+                for (int q = 0; q < channels; ++q) {
+                    float* dst = &out[static_cast<size_t>(q) * w];
+                    if (!resize) {
+                        sumRow(q, y);
+                        std::copy(sum.begin(), sum.end(), dst);
+                        continue;
+                    }
+                    //as InterpLayer::bicubic: horizontal pass on the 4 sum rows, then blend them vertically
+                    const float* line[4];
+                    for (int k = 0; k < 4; ++k) {
+                        const int r = std::clamp(yIndex[y] - 1 + k, 0, sumH - 1);
+                        const size_t slot = static_cast<size_t>(q) * 4 + r % 4;
+                        float* cached = &lines[slot * w];
+                        line[k] = cached;
+                        if (lineRow[slot] == r) continue;
+                        lineRow[slot] = r;
+                        sumRow(q, r);
+                        for (int x = 0; x < w; ++x) {
+                            const float* wx = &xWeight[static_cast<size_t>(x) * 4];
+                            int s = xIndex[x];
+                            cached[x] = sum[std::clamp(s - 1, 0, sumW - 1)] * wx[0] + sum[std::clamp(s, 0, sumW - 1)] * wx[1] +
+                                        sum[std::clamp(s + 1, 0, sumW - 1)] * wx[2] + sum[std::clamp(s + 2, 0, sumW - 1)] * wx[3];
+                        }
+                    }
+                    const float* wy = &yWeight[static_cast<size_t>(y) * 4];
+                    for (int x = 0; x < w; ++x) {
+                        dst[x] = line[0][x] * wy[0] + line[1][x] * wy[1] + line[2][x] * wy[2] + line[3][x] * wy[3];
+                    }
+                }
+                sink(y, rows.data());
+            }
+        });
+    }
+};
+
+// ---------------------------------------------------------------------------------------------
+// Net
+// ---------------------------------------------------------------------------------------------
+
+// where Net::forward puts its tensors for one input shape
+struct MemoryPlan {
+    struct Buffer {
+        int w = 0, h = 0, c = 0;
+        int first = 0, last = 0; //layers that write it first and use it last; last = layer count for the result
+        size_t bytes = 0;
+        size_t offset = 0;       //in the arena
+    };
+    std::vector<Buffer> buffers;
+    std::vector<TensorShape> shapes;  //of every blob
+    std::vector<int> bufferOf;        //per blob a layer writes (not an alias), its buffer; -1 otherwise
+    std::vector<int> channelOffset;   //per blob, its first channel in the buffer
+    size_t arenaBytes = 0;
+    size_t liveBytes = 0;             //most bytes alive at once: the floor for any packing
+    size_t scratchBytes = 0;          //largest per-layer scratch, allocated outside the arena
+};
+
+class Net {
+public:
+    bool fuseOnLoad = true;        //run fuseLayers() once the weights are loaded
+    bool planConcatsOnLoad = true; //then planConcatBuffers()
+    bool planTailOnLoad = true;    //and planUpsampleTail()
+
+    void loadParam(std::istream& in) {
+        int magic = 0;
+        in >> magic;
+        if (magic != 7767517) throw std::runtime_error("Not an ncnn .param file (bad magic)");
+        int layerCount = 0, blobCount = 0;
+        in >> layerCount >> blobCount;
+        if (!in || layerCount <= 0 || blobCount <= 0) throw std::runtime_error("Malformed .param header");
+
+        layers.clear();
+        blobNames.clear();
+        sliceBuffer.clear();
+        sliceOffset.clear();
+        bufferChannels.clear();
+        tail = UpsampleTail();
+        clearMemoryPlans();
+        std::string line;
+        std::getline(in, line);
+        for (int i = 0; i < layerCount; ++i) {
+            if (!std::getline(in, line)) throw std::runtime_error("Truncated .param file");
+            std::istringstream fields(line);
+            std::string type, name;
+            int bottomCount = 0, topCount = 0;
+            fields >> type >> name >> bottomCount >> topCount;
+
+            std::unique_ptr<Layer> layer = createLayer(type);
+            layer->type = type;
+            layer->name = name;
+            for (int b = 0; b < bottomCount; ++b) {
+                std::string blob;
+                fields >> blob;
+                layer->bottoms.push_back(findBlob(blob));
+            }
+            for (int t = 0; t < topCount; ++t) {
+                std::string blob;
+                fields >> blob;
+                layer->tops.push_back(addBlob(blob));
+            }
+
+            ParamDict pd;
+            std::string token;
+            while (fields >> token) pd.parse(token);
+            layer->loadParam(pd);
+            layers.push_back(std::move(layer));
+        }
+
+        //the blob named "output", or the last layer's first output
+        outputBlob = layers.back()->tops.at(0);
+        for (size_t i = 0; i < blobNames.size(); ++i) {
+            if (blobNames[i] == "output") outputBlob = static_cast<int>(i);
+        }
+    }
+
+    void loadModel(std::vector<unsigned char> bytes) {
+        ModelBin mb(std::move(bytes));
+        for (auto& layer : layers) layer->loadModel(mb);
+        if (mb.remaining() != 0) throw std::runtime_error("Model weights file has unexpected trailing data");
+        if (fuseOnLoad) fuseLayers();
+        if (planConcatsOnLoad) planConcatBuffers();
+        if (planTailOnLoad) planUpsampleTail();
+    }
+
+    // fold the element-wise layers that follow a convolution into its epilogue, so their input is never
+    // written out and read back: ReLU, PReLU (after the weights are loaded), Eltwise sums and BinaryOp adds
+    // whose other operands already exist when the convolution runs. returns the number of layers removed
+    int fuseLayers() {
+        clearMemoryPlans();
+        int fused = 0;
+        for (size_t i = 0; i < layers.size(); ++i) {
+            auto* conv = dynamic_cast<ConvolutionLayer*>(layers[i].get());
+            if (!conv) continue;
+            while (fuseIntoConvolution(i, *conv)) ++fused;
+        }
+        return fused;
+    }
+
+    // make Concat free: the inputs of a Concat are written back to back into one buffer, each by its
+    // producing layer, and the Concat output is a view of them. processing the Concats last to first,
+    // the widest concat of an RRDB dense block (64 + 4 x 32 = 192 channels) gets the buffer and the
+    // narrower ones before it (64, 96, 128, 160 channels) find their inputs already in place; Split
+    // outputs already share their input. returns the number of Concats that became views
+    int planConcatBuffers() {
+        clearMemoryPlans();
+        sliceBuffer.assign(blobNames.size(), -1);
+        sliceOffset.assign(blobNames.size(), 0);
+        bufferChannels.clear();
+
+        //channel counts do not depend on the spatial size
+        std::vector<TensorShape> shapes = blobShapes(16, 16, kPlannedInputChannels);
+        std::vector<int> rootOf(blobNames.size());
+        std::vector<const Layer*> producer(blobNames.size(), nullptr);
+        for (const auto& layer : layers) {
+            for (int top : layer->tops) {
+                rootOf[top] = layer->type == "Split" ? rootOf[layer->bottoms.at(0)] : top;
+                producer[top] = layer.get();
+            }
+        }
+
+        int views = 0;
+        for (auto it = layers.rbegin(); it != layers.rend(); ++it) {
+            auto* concat = dynamic_cast<ConcatLayer*>(it->get());
+            if (!concat) continue;
+            concat->inPlace = false;
+
+            //only layers that write a single new tensor can write into a slice instead
+            std::vector<int> roots;
+            bool eligible = sliceBuffer[concat->tops.at(0)] < 0;
+            for (int b : concat->bottoms) {
+                int root = rootOf[b];
+                const Layer* source = producer[root];
+                eligible = eligible && source && source->type != "Input" && source->type != "Concat" && !source->aliasesInput() &&
+                           source->tops.size() == 1 && std::find(roots.begin(), roots.end(), root) == roots.end();
+                roots.push_back(root);
+            }
+            if (!eligible) continue;
+
+            bool unplaced = true, inOrder = true;
+            int offset = sliceOffset[roots[0]];
+            for (int root : roots) {
+                unplaced = unplaced && sliceBuffer[root] < 0;
+                inOrder = inOrder && sliceBuffer[root] >= 0 && sliceBuffer[root] == sliceBuffer[roots[0]] && sliceOffset[root] == offset;
+                offset += shapes[root].c;
+            }
+            if (unplaced) {
+                const int buffer = static_cast<int>(bufferChannels.size());
+                int channels = 0;
+                for (int root : roots) {
+                    sliceBuffer[root] = buffer;
+                    sliceOffset[root] = channels;
+                    channels += shapes[root].c;
+                }
+                bufferChannels.push_back(channels);
+            } else if (!inOrder) {
+                continue;
+            }
+            concat->inPlace = true;
+            ++views;
+        }
+        return views;
+    }
+
+    // find the realesr-animevideov3 upsampling tail (see UpsampleTail) at the end of the graph and run
+    // it fused from now on: forward() stops at the features and the tail makes the output from them.
+    // returns whether there was one
+    bool planUpsampleTail() {
+        clearMemoryPlans();
+        tail = UpsampleTail();
+        std::vector<int> producer(blobNames.size(), -1);
+        for (size_t i = 0; i < layers.size(); ++i) {
+            for (int top : layers[i]->tops) producer[top] = static_cast<int>(i);
+        }
+        std::vector<int> counts = consumerCounts();
+        auto producedBy = [&](int blob, const std::string& type) -> const Layer* {
+            const Layer* layer = producer[blob] >= 0 ? layers[producer[blob]].get() : nullptr;
+            return layer && layer->type == type && layer->tops.size() == 1 ? layer : nullptr;
+        };
+
+        UpsampleTail found;
+        int sumBlob = outputBlobIndex();
+        const auto* resize = dynamic_cast<const InterpLayer*>(producedBy(sumBlob, "Interp"));
+        if (resize && resize->resizeType == 3 && counts[resize->bottoms.at(0)] == 1) {
+            found.resize = resize;
+            sumBlob = resize->bottoms[0];
+        }
+        const auto* add = dynamic_cast<const BinaryOpLayer*>(producedBy(sumBlob, "BinaryOp"));
+        if (!add || add->opType != 0 || add->withScalar || add->bottoms.size() != 2) return false;
+
+        //the skip reads the net input (through Splits), the shuffled features and the skip only feed the add
+        for (int k = 0; k < 2 && found.shuffle == nullptr; ++k) {
+            const int shuffled = add->bottoms[k], skipped = add->bottoms[1 - k];
+            const auto* shuffle = dynamic_cast<const PixelShuffleLayer*>(producedBy(shuffled, "PixelShuffle"));
+            const auto* skip = dynamic_cast<const InterpLayer*>(producedBy(skipped, "Interp"));
+            if (!shuffle || !skip || counts[shuffled] != 1 || counts[skipped] != 1) continue;
+            int source = skip->bottoms.at(0);
+            while (producer[source] >= 0 && layers[producer[source]]->type == "Split") source = layers[producer[source]]->bottoms.at(0);
+            if (source != inputBlobIndex() || skip->resizeType != 1 || skip->outputWidth || skip->outputHeight ||
+                skip->widthScale != static_cast<float>(shuffle->factor) || skip->heightScale != static_cast<float>(shuffle->factor)) {
+                continue;
+            }
+            found.shuffle = shuffle;
+            found.skip = skip;
+            found.featuresBlob = shuffle->bottoms.at(0);
+        }
+        if (!found.shuffle) return false;
+
+        //and nothing else runs after the tail starts
+        std::vector<const Layer*> members = {found.shuffle, found.skip, add};
+        if (found.resize) members.push_back(found.resize);
+        found.firstLayer = static_cast<int>(layers.size());
+        for (const Layer* member : members) found.firstLayer = std::min(found.firstLayer, producer[member->tops[0]]);
+        for (size_t i = found.firstLayer; i < layers.size(); ++i) {
+            if (std::find(members.begin(), members.end(), layers[i].get()) == members.end()) return false;
+        }
+        tail = found;
+        return true;
+    }
+
+    bool hasFusedTail() const { return !tail.empty(); }
+
+    int fusedLayerCount() const {
+        int count = 0;
+        for (const auto& layer : layers) {
+            if (auto* conv = dynamic_cast<const ConvolutionLayer*>(layer.get())) count += static_cast<int>(conv->fusedLayers.size());
+        }
+        return count;
+    }
+
+    // the weights in .bin layout, as loadModel reads them. fused layers have left the graph, so this
+    // needs a net loaded with fuseOnLoad off
+    std::vector<unsigned char> saveModel() const {
+        if (fusedLayerCount() != 0) throw std::runtime_error("Cannot save the weights of a fused model");
+        ModelBinWriter writer;
+        for (const auto& layer : layers) layer->saveModel(writer);
+        return writer.data();
+    }
+
+    // load <directory>/<name>.param and <directory>/<name>.bin
+    void load(const std::string& directory, const std::string& name) {
+        std::string base = directory + "/" + name;
+        std::ifstream param(base + ".param");
+        if (!param) throw std::runtime_error("Failed to open " + base + ".param");
+        loadParam(param);
+
+        std::ifstream bin(base + ".bin", std::ios::binary);
+        if (!bin) throw std::runtime_error("Failed to open " + base + ".bin");
+        loadModel(std::vector<unsigned char>(std::istreambuf_iterator<char>(bin), std::istreambuf_iterator<char>()));
+    }
+
+    // called with each layer and its inputs just before the layer runs (e.g. to calibrate int8 scales)
+    using LayerObserver = std::function<void(const Layer&, const std::vector<Tensor>&)>;
+
+    // run the whole graph on one input. every tensor a layer writes is a view into one arena laid out by
+    // memoryPlan() for this input shape, so nothing is allocated per layer. a fused tail writes the
+    // output straight from the features (the observer does not see its layers)
+    Tensor forward(const Tensor& input, ThreadPool& pool = globalThreadPool(), const LayerObserver& observer = nullptr) const {
+        std::vector<Tensor> blobs = runLayers(input, pool, observer);
+        const Tensor output = blobs[outputBlobIndex()];
+        if (!tail.empty()) {
+            tail.run(blobs[tail.featuresBlob], input, output.w, output.h, pool, [&](int y, const float* const* rows) {
+                for (int q = 0; q < output.c; ++q) std::copy(rows[q], rows[q] + output.w, output.row(q, y));
+            });
+        }
+        return convertTensor(output, StorageType::Float32, pool);
+    }
+
+    // run the graph and return float copies of the named blobs, in the order asked (the feature maps
+    // lpips.h compares, say). each is copied as soon as its layer has run, since the arena hands its
+    // memory to later layers. a blob folded away by fuseLayers (a convolution's output that went
+    // straight into a PReLU or an add) no longer exists and is an error
+    std::vector<Tensor> forwardBlobs(const Tensor& input, const std::vector<std::string>& names, ThreadPool& pool = globalThreadPool()) const {
+        std::vector<Tensor> copies(names.size());
+        std::vector<int> wanted(names.size());
+        for (size_t i = 0; i < names.size(); ++i) {
+            auto it = std::find(blobNames.begin(), blobNames.end(), names[i]);
+            if (it == blobNames.end()) throw std::runtime_error("Model has no blob named " + names[i]);
+            wanted[i] = static_cast<int>(it - blobNames.begin());
+        }
+        auto copyOut = [&](int blob, const Tensor& tensor) {
+            for (size_t i = 0; i < wanted.size(); ++i) {
+                if (wanted[i] != blob || !copies[i].empty()) continue;
+                copies[i] = Tensor(tensor.w, tensor.h, tensor.c);
+                pool.parallelFor(tensor.c, [&](int q) { convertChannel(tensor, q, copies[i], q); });
+            }
+        };
+        std::vector<Tensor> blobs = runLayers(input, pool, nullptr, copyOut);
+        copyOut(inputBlobIndex(), input);
+        for (size_t i = 0; i < names.size(); ++i) {
+            if (copies[i].empty()) throw std::runtime_error("Blob " + names[i] + " is not produced by forward()");
+        }
+        return copies;
+    }
+
+    // forward() handing the result to sink(y, rows) a row at a time, rows[q] holding channel q's values,
+    // from several threads at once. with a fused tail the rows are made as they are handed out, so the
+    // float output is never stored either (esrganUpscale rounds them straight to 8 bits)
+    template <typename Sink>
+    void forwardRows(const Tensor& input, ThreadPool& pool, const Sink& sink) const {
+        if (!tail.empty()) {
+            std::vector<Tensor> blobs = runLayers(input, pool, nullptr);
+            TensorShape shape = outputShape(input.w, input.h, input.c);
+            tail.run(blobs[tail.featuresBlob], input, shape.w, shape.h, pool, sink);
+            return;
+        }
+        Tensor output = forward(input, pool);
+        parallelRowBands(pool, output.h, 8, [&](int begin, int end) {
+            std::vector<const float*> rows(output.c);
+            for (int y = begin; y < end; ++y) {
+                for (int q = 0; q < output.c; ++q) rows[q] = output.row(q, y);
+                sink(y, rows.data());
+            }
+        });
+    }
+
+    // store activations (every tensor forward() writes into its arena) and convolution weights as
+    // bf16 or fp16 instead of float; the arithmetic stays float: layers widen what they read and narrow
+    // what they write, a block or a row at a time. halves the arena and the bytes each layer moves, at
+    // the cost of the rounding (see bench-conv for both)
+    void setStorage(StorageType type) {
+        clearMemoryPlans();
+        storage = type;
+        for (auto& layer : layers) {
+            if (auto* conv = dynamic_cast<ConvolutionLayer*>(layer.get())) conv->setWeightStorage(type);
+        }
+    }
+
+    StorageType storageType() const { return storage; }
+
+    // shape forward() returns for a w x h x c input
+    TensorShape outputShape(int w, int h, int c = 3) const { return blobShapes(w, h, c)[outputBlobIndex()]; }
+
+    // shape of every blob for a w x h x c input
+    std::vector<TensorShape> blobShapes(int w, int h, int c = 3) const {
+        std::vector<TensorShape> shapes(blobNames.size());
+        int inputBlob = inputBlobIndex();
+        shapes[inputBlob] = TensorShape{w, h, c};
+        for (const auto& layer : layers) {
+            std::vector<TensorShape> inputs;
+            if (layer->type == "Input") inputs.push_back(shapes[inputBlob]);
+            for (int b : layer->bottoms) inputs.push_back(shapes[b]);
+            std::vector<TensorShape> outputs = layer->outputShapes(inputs);
+            for (size_t t = 0; t < layer->tops.size(); ++t) shapes[layer->tops[t]] = outputs[t];
+        }
+        return shapes;
+    }
+
+    // where forward() puts every tensor it writes for a w x h x c input. each allocation (a blob's own
+    // tensor, or a concat buffer shared by several blobs) is live from the layer that first writes it to
+    // the last layer that reads it or anything aliasing it; allocations are then packed greedily, largest
+    // first, at the lowest arena offset that no allocation live at the same time overlaps
+    MemoryPlan memoryPlan(int w, int h, int c = 3) const {
+        MemoryPlan plan;
+        plan.shapes.assign(blobNames.size(), TensorShape());
+        plan.bufferOf.assign(blobNames.size(), -1);
+        plan.channelOffset.assign(blobNames.size(), 0);
+        std::vector<int> owner(blobNames.size(), -1); //allocation holding a blob's data, through aliases
+        const int inputBlob = inputBlobIndex();
+        plan.shapes[inputBlob] = TensorShape{w, h, c};
+
+        const bool planned = !bufferChannels.empty() && c == kPlannedInputChannels;
+        std::vector<int> concatBuffer(bufferChannels.size(), -1);
+        auto newBuffer = [this, &plan](int bw, int bh, int bc, int first) {
+            MemoryPlan::Buffer buffer;
+            buffer.w = bw;
+            buffer.h = bh;
+            buffer.c = bc;
+            buffer.first = buffer.last = first;
+            buffer.bytes = TensorShape{bw, bh, bc}.bytes(storage);
+            plan.buffers.push_back(buffer);
+            return static_cast<int>(plan.buffers.size()) - 1;
+        };
+
+        const int layerCount = plannedLayerCount();
+        for (int i = 0; i < layerCount; ++i) {
+            const Layer& layer = *layers[i];
+            std::vector<TensorShape> inputs;
+            if (layer.type == "Input") inputs.push_back(plan.shapes[inputBlob]);
+            for (int b : layer.bottoms) {
+                inputs.push_back(plan.shapes[b]);
+                if (owner[b] >= 0) plan.buffers[owner[b]].last = std::max(plan.buffers[owner[b]].last, i);
+            }
+            std::vector<TensorShape> outputs = layer.outputShapes(inputs);
+            plan.scratchBytes = std::max(plan.scratchBytes, layer.scratchBytes(inputs));
+            //unplanned, an in-place Concat finds its inputs apart and copies
+            const bool aliases = layer.aliasesInput() && (planned || layer.type != "Concat");
+
+            for (size_t t = 0; t < layer.tops.size(); ++t) {
+                const int top = layer.tops[t];
+                plan.shapes[top] = outputs[t];
+                if (aliases) {
+                    owner[top] = layer.type == "Input" ? -1 : owner[layer.bottoms[0]];
+                } else if (planned && sliceBuffer[top] >= 0) {
+                    int& buffer = concatBuffer[sliceBuffer[top]];
+                    if (buffer < 0) buffer = newBuffer(outputs[t].w, outputs[t].h, bufferChannels[sliceBuffer[top]], i);
+                    plan.buffers[buffer].last = std::max(plan.buffers[buffer].last, i);
+                    owner[top] = plan.bufferOf[top] = buffer;
+                    plan.channelOffset[top] = sliceOffset[top];
+                } else {
+                    owner[top] = plan.bufferOf[top] = newBuffer(outputs[t].w, outputs[t].h, outputs[t].c, i);
+                }
+            }
+        }
+        //the result (or what a fused tail makes it from) outlives the graph
+        const int outputOwner = owner[tail.empty() ? outputBlobIndex() : tail.featuresBlob];
+        if (outputOwner >= 0) plan.buffers[outputOwner].last = layerCount;
+        if (!tail.empty()) {
+            //the tail writes the result as floats, whatever the storage
+            const TensorShape shape = outputShape(w, h, c);
+            const int result = newBuffer(shape.w, shape.h, shape.c, layerCount);
+            plan.buffers[result].bytes = shape.bytes();
+            plan.shapes[outputBlobIndex()] = shape;
+            plan.bufferOf[outputBlobIndex()] = result;
+        }
+
+        for (int i = 0; i <= layerCount; ++i) {
+            size_t live = 0;
+            for (const MemoryPlan::Buffer& buffer : plan.buffers) {
+                if (buffer.first <= i && i <= buffer.last) live += buffer.bytes;
+            }
+            plan.liveBytes = std::max(plan.liveBytes, live);
+        }
+
+        std::vector<int> order(plan.buffers.size());
+        for (size_t k = 0; k < order.size(); ++k) order[k] = static_cast<int>(k);
+        std::stable_sort(order.begin(), order.end(), [&plan](int a, int b) { return plan.buffers[a].bytes > plan.buffers[b].bytes; });
+        std::vector<int> placed;
+        std::vector<std::pair<size_t, size_t>> taken;
+        for (int k : order) {
+            MemoryPlan::Buffer& buffer = plan.buffers[k];
+            taken.clear();
+            for (int j : placed) {
+                const MemoryPlan::Buffer& other = plan.buffers[j];
+                if (other.last >= buffer.first && buffer.last >= other.first) taken.push_back({other.offset, other.offset + other.bytes});
+            }
+            std::sort(taken.begin(), taken.end());
+            size_t offset = 0;
+            for (const auto& [begin, end] : taken) {
+                if (offset + buffer.bytes <= begin) break;
+                offset = std::max(offset, end);
+            }
+            buffer.offset = offset;
+            plan.arenaBytes = std::max(plan.arenaBytes, offset + buffer.bytes);
+            placed.push_back(k);
+        }
+        return plan;
+    }
+
+    // memory forward() uses on a w x h x c input: the input, the arena and the largest layer scratch
+    size_t peakMemoryBytes(int w, int h, int c = 3) const {
+        MemoryPlan plan = memoryPlan(w, h, c);
+        return TensorShape{w, h, c}.bytes() + plan.arenaBytes + plan.scratchBytes;
+    }
+
+    // activation bytes read and written by one forward() on a w x h x c input, counting every layer as
+    // reading each input and writing each output once (layers that alias their input move nothing); a
+    // fused tail reads the features and the input and writes the output
+    size_t trafficBytes(int w, int h, int c = 3) const {
+        std::vector<TensorShape> shapes(blobNames.size());
+        int inputBlob = inputBlobIndex();
+        shapes[inputBlob] = TensorShape{w, h, c};
+        size_t bytes = 0;
+        for (int i = 0; i < plannedLayerCount(); ++i) {
+            const Layer* layer = layers[i].get();
+            std::vector<TensorShape> inputs;
+            if (layer->type == "Input") inputs.push_back(shapes[inputBlob]);
+            for (int b : layer->bottoms) inputs.push_back(shapes[b]);
+            std::vector<TensorShape> outputs = layer->outputShapes(inputs);
+            for (size_t t = 0; t < layer->tops.size(); ++t) shapes[layer->tops[t]] = outputs[t];
+            if (layer->aliasesInput() && (c == kPlannedInputChannels || layer->type != "Concat")) continue;
+            for (int b : layer->bottoms) bytes += shapes[b].bytes(b == inputBlob ? StorageType::Float32 : storage);
+            for (const TensorShape& shape : outputs) bytes += shape.bytes(storage);
+        }
+        if (!tail.empty()) bytes += shapes[tail.featuresBlob].bytes(storage) + shapes[inputBlob].bytes() + outputShape(w, h, c).bytes();
+        return bytes;
+    }
+
+    // make the named convolutions int8, each with its input scale (see nn_quantize.h); returns how many
+    int quantizeConvolutions(const std::map<std::string, float>& inputScales) {
+        clearMemoryPlans(); //int8 layers need scratch for the quantized input
+        int quantized = 0;
+        for (auto& layer : layers) {
+            auto* conv = dynamic_cast<ConvolutionLayer*>(layer.get());
+            auto it = inputScales.find(layer->name);
+            if (!conv || it == inputScales.end()) continue;
+            conv->quantize(it->second);
+            ++quantized;
+        }
+        return quantized;
+    }
+
+    // force one algorithm on every convolution (where it applies), e.g. to compare against direct
+    void setConvAlgorithm(ConvAlgorithm algorithm) {
+        clearMemoryPlans(); //scratch depends on the algorithm
+        for (auto& layer : layers) {
+            if (auto* conv = dynamic_cast<ConvolutionLayer*>(layer.get())) conv->setAlgorithm(algorithm);
+        }
+    }
+
+    const std::vector<std::unique_ptr<Layer>>& layerList() const { return layers; }
+    const std::vector<std::string>& blobList() const { return blobNames; }
+
+    int inputBlobIndex() const {
+        for (const auto& layer : layers) {
+            if (layer->type == "Input") return layer->tops.at(0);
+        }
+        throw std::runtime_error("Model has no Input layer");
+    }
+
+    int outputBlobIndex() const {
+        if (outputBlob < 0) throw std::runtime_error("No model loaded");
+        return outputBlob;
+    }
+
+private:
+    // called with a blob and its tensor right after the layer writing it has run
+    using BlobObserver = std::function<void(int, const Tensor&)>;
+
+    // the layers up to the tail (all of them without one) on input; returns every blob still needed:
+    // the result, or the tail's features and the arena tensor it writes the result to
+    std::vector<Tensor> runLayers(const Tensor& input, ThreadPool& pool, const LayerObserver& observer,
+                                  const BlobObserver& written = nullptr) const {
+        std::shared_ptr<const MemoryPlan> plan = cachedMemoryPlan(input.w, input.h, input.c);
+        std::vector<Tensor> blobs(blobNames.size());
+        std::vector<int> remaining = consumerCounts();
+        int inputBlob = inputBlobIndex();
+        int outputBlob = outputBlobIndex();
+        blobs[inputBlob] = input;
+
+        unsigned char* arena = static_cast<unsigned char*>(::operator new(std::max<size_t>(1, plan->arenaBytes), std::align_val_t(kImageAlignment)));
+        std::shared_ptr<void> memory(arena, [](void* p) { ::operator delete(p, std::align_val_t(kImageAlignment)); });
+
+        for (int i = 0; i < plannedLayerCount(); ++i) {
+            const Layer* layer = layers[i].get();
+            std::vector<Tensor> inputs;
+            if (layer->type == "Input") inputs.push_back(blobs[inputBlob]);
+            for (int b : layer->bottoms) {
+                if (blobs[b].empty()) throw std::runtime_error(layer->name + ": input blob " + blobNames[b] + " is not available");
+                inputs.push_back(blobs[b]);
+            }
+            std::vector<Tensor> outputs(layer->tops.size());
+            for (size_t t = 0; t < outputs.size(); ++t) {
+                const int top = layer->tops[t];
+                const int buffer = plan->bufferOf[top];
+                if (buffer < 0) continue;
+                const MemoryPlan::Buffer& placement = plan->buffers[buffer];
+                Tensor whole(placement.w, placement.h, placement.c, arena + placement.offset, memory, storage);
+                outputs[t] = whole.channelSlice(plan->channelOffset[top], plan->shapes[top].c);
+            }
+            if (observer) observer(*layer, inputs);
+            layer->forward(inputs, outputs, pool);
+
+            inputs.clear();
+            for (int b : layer->bottoms) {
+                if (--remaining[b] == 0 && b != outputBlob) blobs[b] = Tensor();
+            }
+            for (size_t t = 0; t < outputs.size(); ++t) {
+                blobs[layer->tops[t]] = outputs[t];
+                if (written) written(layer->tops[t], outputs[t]);
+            }
+        }
+        if (!tail.empty()) {
+            const MemoryPlan::Buffer& placement = plan->buffers[plan->bufferOf[outputBlob]];
+            blobs[outputBlob] = Tensor(placement.w, placement.h, placement.c, arena + placement.offset, memory, StorageType::Float32);
+        }
+        return blobs;
+    }
+
+    // the layers forward() runs one by one: those before a fused tail
+    int plannedLayerCount() const { return tail.empty() ? static_cast<int>(layers.size()) : tail.firstLayer; }
+
+    std::shared_ptr<const MemoryPlan> cachedMemoryPlan(int w, int h, int c) const {
+        std::lock_guard<std::mutex> lock(planMutex);
+        const std::tuple<int, int, int> key(w, h, c);
+        auto it = plans.find(key);
+        if (it != plans.end()) return it->second;
+        if (plans.size() >= 16) plans.clear(); //tiles come in a handful of sizes; don't grow without bound
+        auto plan = std::make_shared<const MemoryPlan>(memoryPlan(w, h, c));
+        plans[key] = plan;
+        return plan;
+    }
+
+    void clearMemoryPlans() {
+        std::lock_guard<std::mutex> lock(planMutex);
+        plans.clear();
+    }
+
+    // fold the single consumer of conv's output into conv, if it is a layer the epilogue can run
+    bool fuseIntoConvolution(size_t index, ConvolutionLayer& conv) {
+        const int top = conv.tops.at(0);
+        if (top == outputBlob) return false;
+        size_t consumer = 0;
+        int uses = 0;
+        for (size_t j = index + 1; j < layers.size(); ++j) {
+            for (int b : layers[j]->bottoms) {
+                if (b == top) {
+                    consumer = j;
+                    ++uses;
+                }
+            }
+        }
+        if (uses != 1 || layers[consumer]->tops.size() != 1) return false;
+        Layer& next = *layers[consumer];
+
+        if (auto* prelu = dynamic_cast<PReLULayer*>(&next)) {
+            //the slope applies right after the conv's own activation, so nothing else may be fused yet
+            if (conv.activationType != 0 || conv.hasFusedLayers() || prelu->slopes.empty()) return false;
+            if (prelu->slopes.size() != 1 && static_cast<int>(prelu->slopes.size()) != conv.numOutput) return false;
+            conv.channelSlopes = prelu->slopes.size() == 1 ? std::vector<float>(conv.numOutput, prelu->slopes[0]) : prelu->slopes;
+        } else if (auto* relu = dynamic_cast<ReLULayer*>(&next)) {
+            //becomes the conv's own activation
+            if (conv.activationType != 0 || conv.hasFusedLayers()) return false;
+            conv.activationType = relu->slope == 0.0f ? 1 : 2;
+            conv.activationParams = {relu->slope};
+        } else if (auto* eltwise = dynamic_cast<EltwiseLayer*>(&next)) {
+            if (eltwise->opType != 1) return false;
+            std::vector<float> coefficients = eltwise->coefficients;
+            if (coefficients.empty()) coefficients.assign(next.bottoms.size(), 1.0f);
+            if (!fuseAdd(index, conv, next.bottoms, coefficients)) return false;
+        } else if (auto* binary = dynamic_cast<BinaryOpLayer*>(&next)) {
+            if (binary->opType != 0 || binary->withScalar) return false;
+            if (!fuseAdd(index, conv, next.bottoms, {1.0f, 1.0f})) return false;
+        } else {
+            return false;
+        }
+
+        conv.fusedLayers.push_back(next.name);
+        conv.tops[0] = next.tops[0];
+        layers.erase(layers.begin() + static_cast<std::ptrdiff_t>(consumer));
+        return true;
+    }
+
+    // sum of coefficients[k] * bottoms[k] where one bottom is conv's output; the others become extra
+    // conv inputs, so they must be produced before conv runs
+    bool fuseAdd(size_t index, ConvolutionLayer& conv, const std::vector<int>& bottoms, const std::vector<float>& coefficients) {
+        if (coefficients.size() != bottoms.size()) return false;
+        const int top = conv.tops.at(0);
+        for (int b : bottoms) {
+            if (b == top) continue;
+            bool available = false;
+            for (size_t j = 0; j < index && !available; ++j) {
+                for (int t : layers[j]->tops) available = available || t == b;
+            }
+            if (!available) return false;
+        }
+        for (size_t k = 0; k < bottoms.size(); ++k) {
+            if (bottoms[k] == top) {
+                conv.outputScale *= coefficients[k];
+                for (float& coefficient : conv.residualCoefficients) coefficient *= coefficients[k];
+            }
+        }
+        for (size_t k = 0; k < bottoms.size(); ++k) {
+            if (bottoms[k] == top) continue;
+            conv.bottoms.push_back(bottoms[k]);
+            conv.residualCoefficients.push_back(coefficients[k]);
+        }
+        return true;
+    }
+
+    int findBlob(const std::string& blob) const {
+        for (size_t i = 0; i < blobNames.size(); ++i) {
+            if (blobNames[i] == blob) return static_cast<int>(i);
+        }
+        throw std::runtime_error("Blob " + blob + " is used before it is produced");
+    }
+
+    int addBlob(const std::string& blob) {
+        blobNames.push_back(blob);
+        return static_cast<int>(blobNames.size()) - 1;
+    }
+
+    std::vector<int> consumerCounts() const {
+        std::vector<int> counts(blobNames.size(), 0);
+        for (const auto& layer : layers) {
+            for (int b : layer->bottoms) ++counts[b];
+        }
+        return counts;
+    }
+
+    std::vector<std::unique_ptr<Layer>> layers;
+    std::vector<std::string> blobNames;
+    int outputBlob = -1;
+    StorageType storage = StorageType::Float32; //of the activations forward() writes, see setStorage
+
+    //concat buffers from planConcatBuffers, for RGB input: the buffer and channel offset each blob is
+    //written to (-1 for a tensor of its own), and each buffer's channels
+    static constexpr int kPlannedInputChannels = 3;
+    std::vector<int> sliceBuffer, sliceOffset;
+    std::vector<int> bufferChannels;
+
+    UpsampleTail tail; //from planUpsampleTail
+
+    //memory plans by input shape, made on first use
+    mutable std::mutex planMutex;
+    mutable std::map<std::tuple<int, int, int>, std::shared_ptr<const MemoryPlan>> plans;
+};
+
+// ---------------------------------------------------------------------------------------------
+// Image <-> tensor and whole-image upscaling
+// ---------------------------------------------------------------------------------------------
+
+// interleaved 8-bit RGB to planar floats in [0, 1], as the Real-ESRGAN models expect
+inline Tensor imageToTensor(const ConstImageView& image) {
+    Tensor tensor(image.width, image.height, image.channels);
+    for (int y = 0; y < image.height; ++y) {
+        const unsigned char* src = image.row(y);
+        for (int q = 0; q < image.channels; ++q) {
+            float* dst = tensor.row(q, y);
+            for (int x = 0; x < image.width; ++x) dst[x] = src[x * image.channels + q] * (1.0f / 255.0f);
+        }
+    }
+    return tensor;
+}
+
+// one row of planar floats in [0, 1] (rows[q] for channel q) to interleaved 8-bit, rounded and clamped
+inline void rowToImage(const float* const* rows, unsigned char* dst, int width, int channels) {
+    for (int q = 0; q < channels; ++q) {
+        const float* src = rows[q];
+        for (int x = 0; x < width; ++x) {
+            dst[x * channels + q] = static_cast<unsigned char>(std::clamp(src[x] * 255.0f + 0.5f, 0.0f, 255.0f));
+        }
+    }
+}
+
+// planar floats in [0, 1] back to interleaved 8-bit, rounded and clamped
+inline void tensorToImage(const Tensor& tensor, const ImageView& image) {
+    std::vector<const float*> rows(image.channels);
+    for (int y = 0; y < image.height; ++y) {
+        for (int q = 0; q < image.channels; ++q) rows[q] = tensor.row(q, y);
+        rowToImage(rows.data(), image.row(y), image.width, image.channels);
+    }
+}
+
+// run a loaded Real-ESRGAN model on a whole RGB image; the rows go to 8 bits as they come out of the
+// net (with a fused tail, no float copy of the output is ever made)
+inline Image esrganUpscale(const Net& net, const ConstImageView& input, ThreadPool& pool = globalThreadPool()) {
+    TensorShape shape = net.outputShape(input.width, input.height, input.channels);
+    if (shape.c != input.channels) throw std::runtime_error("Model output has an unexpected channel count");
+    Image output(shape.w, shape.h, input.channels);
+    ImageView view = output.view();
+    net.forwardRows(imageToTensor(input), pool, [&](int y, const float* const* rows) {
+        rowToImage(rows, view.row(y), view.width, view.channels);
+    });
+    return output;
+}
@@ -0,0 +1,116 @@
+// int8 post-training quantization of the float models (calibrate-int8)
+//
+// the float model runs on sample crops while an observer records the range of the values each
+// convolution reads; the input scale is 127 / that range, and the weights get per-output-channel
+// scales when the layer is quantized (ConvolutionLayer::quantize). the first convolution (raw RGB
+// in, a few % of the work) and the last one (the residual added to the interpolated image, where any
+// error shows up directly in the output) stay float. the result is written as an ncnn int8 model:
+// the .param gets 8=1 on the quantized layers and their .bin blobs hold int8 weights and the scales.
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <istream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <utility>
+#include <vector>
+#include "image.h"
+#include "nn_engine.h"
+#include "resample.h"
+#include "thread_pool.h"
+
+// clipping range of every convolution's input over the samples, by layer name: the |value| that
+// coverage of the values stay below. the few outliers past it saturate, which buys finer steps for
+// everything else; plain max |value| lost ~0.3 dB on realesr-animevideov3 against ~0.1 dB for this
+inline std::map<std::string, float> calibrateConvolutionInputs(const Net& net, const std::vector<Tensor>& samples,
+                                                               double coverage = 0.9999, ThreadPool& pool = globalThreadPool()) {
+    //one pass for the range, one for a histogram of |value| over it
+    std::map<std::string, float> absMax;
+    for (const Tensor& sample : samples) {
+        net.forward(sample, pool, [&](const Layer& layer, const std::vector<Tensor>& inputs) {
+            if (layer.type != "Convolution") return;
+            const Tensor& input = inputs.at(0);
+            float& value = absMax[layer.name];
+            for (int c = 0; c < input.c; ++c) {
+                const float* plane = input.channel(c);
+                for (size_t i = 0; i < input.planeSize(); ++i) value = std::max(value, std::fabs(plane[i]));
+            }
+        });
+    }
+
+    constexpr int bins = 2048;
+    std::map<std::string, std::vector<size_t>> histograms;
+    for (const Tensor& sample : samples) {
+        net.forward(sample, pool, [&](const Layer& layer, const std::vector<Tensor>& inputs) {
+            if (layer.type != "Convolution") return;
+            const Tensor& input = inputs.at(0);
+            std::vector<size_t>& histogram = histograms[layer.name];
+            histogram.resize(bins);
+            const float range = absMax[layer.name];
+            if (range <= 0.0f) return;
+            for (int c = 0; c < input.c; ++c) {
+                const float* plane = input.channel(c);
+                for (size_t i = 0; i < input.planeSize(); ++i) {
+                    histogram[std::min(bins - 1, static_cast<int>(std::fabs(plane[i]) / range * bins))]++;
+                }
+            }
+        });
+    }
+
+    std::map<std::string, float> clip;
+    for (const auto& [name, histogram] : histograms) {
+        size_t total = 0;
+        for (size_t count : histogram) total += count;
+        size_t seen = 0;
+        int bin = 0;
+        for (; bin < bins - 1; ++bin) {
+            seen += histogram[bin];
+            if (seen >= coverage * total) break;
+        }
+        clip[name] = absMax[name] * (bin + 1) / bins;
+    }
+    return clip;
+}
+
+// input scales for every convolution but the first and last
+inline std::map<std::string, float> int8InputScales(const Net& net, const std::map<std::string, float>& clip) {
+    std::vector<std::string> convolutions;
+    for (const auto& layer : net.layerList()) {
+        if (layer->type == "Convolution") convolutions.push_back(layer->name);
+    }
+    std::map<std::string, float> scales;
+    for (size_t i = 1; i + 1 < convolutions.size(); ++i) {
+        auto it = clip.find(convolutions[i]);
+        if (it != clip.end() && it->second > 0.0f) scales[convolutions[i]] = 127.0f / it->second;
+    }
+    return scales;
+}
+
+// the .param of the quantized model: the original text with 8=1 on the quantized convolutions
+inline std::string int8ParamText(std::istream& param, const std::map<std::string, float>& quantized) {
+    std::ostringstream out;
+    std::string line;
+    for (int i = 0; std::getline(param, line); ++i) {
+        std::istringstream fields(line);
+        std::string type, name;
+        fields >> type >> name;
+        if (i >= 2 && type == "Convolution" && quantized.count(name)) line += " 8=1";
+        out << line << "\n";
+    }
+    return out.str();
+}
+
+// top-left corners of up to count size x size crops on an evenly spaced grid; phase (0..1) shifts the
+// grid so calibration and evaluation can use different crops of the same frame
+inline std::vector<std::pair<int, int>> gridCropOrigins(int width, int height, int size, int count, float phase) {
+    std::vector<std::pair<int, int>> origins;
+    const int side = std::max(1, static_cast<int>(std::ceil(std::sqrt(static_cast<double>(count)))));
+    for (int i = 0; i < count; ++i) {
+        const float fx = (i % side + phase) / side;
+        const float fy = (i / side % side + phase) / side;
+        origins.emplace_back(static_cast<int>(fx * std::max(0, width - size)), static_cast<int>(fy * std::max(0, height - size)));
+    }
+    return origins;
+}
@@ -0,0 +1,195 @@
+// Tiled inference for the native Real-ESRGAN engine
+//
+// whole-frame inference keeps several 64-channel float feature maps of the full input alive, which is
+// gigabytes on a photo. instead the input is cut into a grid of tiles, each tile is run with `overlap`
+// extra input pixels of context on every side, and neighbouring tiles are cross-faded over a seam
+// band half as wide as the overlap (linear weights that sum to 1). only the seam bands are kept in
+// float until every tile touching them has run; everything else is written straight to 8-bit rows,
+// so memory is one tile's activations plus one tile row of output, whatever the image size.
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+#include <stdexcept>
+#include <vector>
+#include "image.h"
+#include "nn_engine.h"
+#include "thread_pool.h"
+
+struct TileOptions {
+    int tileSize = 0;             //input pixels per tile side, 0 to pick from memoryBudgetMB
+    int overlap = 12;             //context pixels added on each side of a tile
+    size_t memoryBudgetMB = 512;  //activation memory allowed for one tile
+    bool report = true;           //print the tile grid of every image
+};
+
+// largest square tile (multiple of 16 input pixels) whose inference fits the budget
+inline int chooseTileSize(const Net& net, int overlap, size_t memoryBudgetMB, int channels = 3) {
+    const size_t budget = memoryBudgetMB << 20;
+    const int minimum = std::max(16, (2 * overlap + 15) / 16 * 16);
+    int best = minimum;
+    //peak memory grows with the tile area, so the first tile over budget ends the search
+    for (int size = minimum; size <= 4096; size += 16) {
+        int side = size + 2 * overlap;
+        if (net.peakMemoryBytes(side, side, channels) > budget) break;
+        best = size;
+    }
+    return best;
+}
+
+// tile boundaries along one axis: count + 1 positions from 0 to size, tiles as equal as possible
+inline std::vector<int> tileBoundaries(int size, int tileSize) {
+    int count = std::max(1, (size + tileSize - 1) / tileSize);
+    std::vector<int> bounds(count + 1);
+    for (int i = 0; i <= count; ++i) bounds[i] = static_cast<int>(static_cast<long long>(size) * i / count);
+    return bounds;
+}
+
+// cross-fade weight of the tile whose core is [begin, end) (output pixels) at position p,
+// with seams of half-width `half` at the interior edges
+inline float seamWeight(int p, int begin, int end, int half, bool hasBefore, bool hasAfter) {
+    float weight = 1.0f;
+    if (hasBefore && p < begin + half) weight = (p - (begin - half) + 0.5f) / (2 * half);
+    if (hasAfter && p >= end - half) weight = std::min(weight, (end + half - p - 0.5f) / (2 * half));
+    return weight;
+}
+
+// float accumulator for a band of output pixels; finished bands are rounded into the image
+struct SeamBuffer {
+    int x = 0, y = 0, width = 0, height = 0, channels = 0;
+    std::vector<float> values;
+
+    void reset(int bandX, int bandY, int bandWidth, int bandHeight, int bandChannels) {
+        x = bandX;
+        y = bandY;
+        width = std::max(0, bandWidth);
+        height = std::max(0, bandHeight);
+        channels = bandChannels;
+        values.assign(static_cast<size_t>(width) * height * channels, 0.0f);
+    }
+
+    bool contains(int px, int py) const { return px >= x && px < x + width && py >= y && py < y + height; }
+    float& at(int px, int py, int q) { return values[(static_cast<size_t>(py - y) * width + (px - x)) * channels + q]; }
+
+    // into output, whose first row is image row top
+    void flush(const ImageView& output, int top = 0) const {
+        for (int py = 0; py < height; ++py) {
+            unsigned char* dst = output.row(y + py - top) + static_cast<size_t>(x) * channels;
+            const float* src = &values[static_cast<size_t>(py) * width * channels];
+            for (int i = 0; i < width * channels; ++i) {
+                dst[i] = static_cast<unsigned char>(std::clamp(src[i] * 255.0f + 0.5f, 0.0f, 255.0f));
+            }
+        }
+    }
+};
+
+// run the model tile by tile and hand each finished output row to sink(y, row), top to bottom, on
+// the calling thread. a row is finished once the tile row below it has run (the seam band between two
+// tile rows needs both), so only the rows of one tile row and a seam are held: the output is never
+// in memory as a whole
+template <typename Sink>
+inline void esrganUpscaleTiledRows(const Net& net, const ConstImageView& input, const TileOptions& options, ThreadPool& pool,
+                                   const Sink& sink) {
+    const int overlap = std::max(0, options.overlap);
+    int tileSize = options.tileSize > 0 ? options.tileSize : chooseTileSize(net, overlap, options.memoryBudgetMB, input.channels);
+    tileSize = std::max(tileSize, 2 * overlap); //seams must fit inside the neighbouring tiles
+
+    //the scale factor is a property of the model; take it from the output shape of a 16x16 input
+    TensorShape probe = net.outputShape(16, 16, input.channels);
+    const int scale = probe.w / 16;
+    if (scale < 1 || probe.w != 16 * scale || probe.h != 16 * scale) throw std::runtime_error("Model does not have an integer scale factor");
+
+    const std::vector<int> xs = tileBoundaries(input.width, tileSize);
+    const std::vector<int> ys = tileBoundaries(input.height, tileSize);
+    const int columns = static_cast<int>(xs.size()) - 1;
+    const int rows = static_cast<int>(ys.size()) - 1;
+    const int half = overlap / 2 * scale; //seam half-width in output pixels
+    const int channels = input.channels;
+
+    if (options.report) {
+        std::cout << "Tiled inference: " << columns << "x" << rows << " tiles of " << tileSize << " px, overlap " << overlap
+                  << ", ~" << (net.peakMemoryBytes(tileSize + 2 * overlap, tileSize + 2 * overlap, channels) >> 20) << " MB per tile\n";
+    }
+
+    //the rows one tile row writes or finishes: from the seam above it to the seam below it
+    const int outWidth = input.width * scale;
+    int windowRows = 0;
+    for (int j = 0; j + 1 < static_cast<int>(ys.size()); ++j) windowRows = std::max(windowRows, (ys[j + 1] - ys[j]) * scale + 2 * half);
+    Image window(outWidth, std::min(windowRows, input.height * scale), channels);
+    ImageView out = window.view();
+    int windowTop = 0; //output row held in the window's first row
+
+    //horizontal seam bands above and below the current tile row, vertical seam bands left and right of the current tile
+    SeamBuffer above, below, left, right;
+    above.reset(0, 0, 0, 0, channels);
+
+    for (int j = 0; j < rows; ++j) {
+        const int coreTop = ys[j] * scale, coreBottom = ys[j + 1] * scale;
+        const bool hasAbove = j > 0, hasBelow = j + 1 < rows;
+        const int bandTop = hasAbove ? coreTop + half : coreTop;           //rows only this tile row writes
+        const int bandBottom = hasBelow ? coreBottom - half : coreBottom;
+        if (hasBelow) below.reset(0, coreBottom - half, outWidth, 2 * half, channels);
+        else below.reset(0, 0, 0, 0, channels);
+        left.reset(0, 0, 0, 0, channels);
+
+        for (int i = 0; i < columns; ++i) {
+            const int coreLeft = xs[i] * scale, coreRight = xs[i + 1] * scale;
+            const bool hasLeft = i > 0, hasRight = i + 1 < columns;
+            if (hasRight) right.reset(coreRight - half, bandTop, 2 * half, bandBottom - bandTop, channels);
+            else right.reset(0, 0, 0, 0, channels);
+
+            //run the tile with its context
+            const int x0 = std::max(0, xs[i] - overlap), x1 = std::min(input.width, xs[i + 1] + overlap);
+            const int y0 = std::max(0, ys[j] - overlap), y1 = std::min(input.height, ys[j + 1] + overlap);
+            Tensor result = net.forward(imageToTensor(input.crop(x0, y0, x1 - x0, y1 - y0)), pool);
+            if (result.w != (x1 - x0) * scale || result.h != (y1 - y0) * scale) throw std::runtime_error("Unexpected tile output size");
+
+            const int writeLeft = hasLeft ? coreLeft - half : coreLeft;
+            const int writeRight = hasRight ? coreRight + half : coreRight;
+            const int writeTop = hasAbove ? coreTop - half : coreTop;
+            const int writeBottom = hasBelow ? coreBottom + half : coreBottom;
+
+            parallelRowBands(pool, writeBottom - writeTop, 16, [&](int begin, int end) {
+                for (int py = writeTop + begin; py < writeTop + end; ++py) {
+                    const float wy = seamWeight(py, coreTop, coreBottom, half, hasAbove, hasBelow);
+                    SeamBuffer* rowBand = above.contains(0, py) ? &above : below.contains(0, py) ? &below : nullptr;
+                    for (int px = writeLeft; px < writeRight; ++px) {
+                        const float weight = wy * seamWeight(px, coreLeft, coreRight, half, hasLeft, hasRight);
+                        SeamBuffer* band = rowBand ? rowBand : left.contains(px, py) ? &left : right.contains(px, py) ? &right : nullptr;
+                        for (int q = 0; q < channels; ++q) {
+                            float value = result.row(q, py - y0 * scale)[px - x0 * scale];
+                            if (band) {
+                                band->at(px, py, q) += weight * value;
+                            } else {
+                                out.row(py - windowTop)[static_cast<size_t>(px) * channels + q] =
+                                    static_cast<unsigned char>(std::clamp(value * 255.0f + 0.5f, 0.0f, 255.0f));
+                            }
+                        }
+                    }
+                }
+            });
+
+            //both tiles of the left seam are done
+            left.flush(out, windowTop);
+            std::swap(left, right);
+        }
+        above.flush(out, windowTop);
+        std::swap(above, below);
+
+        //everything above the seam below this tile row is final
+        for (int py = windowTop; py < bandBottom; ++py) sink(py, static_cast<const unsigned char*>(out.row(py - windowTop)));
+        windowTop = bandBottom;
+    }
+}
+
+// run the model tile by tile; the output is the same size as whole-frame inference
+inline Image esrganUpscaleTiled(const Net& net, const ConstImageView& input, const TileOptions& options,
+                                ThreadPool& pool = globalThreadPool()) {
+    TensorShape shape = net.outputShape(input.width, input.height, input.channels);
+    Image output(shape.w, shape.h, input.channels);
+    esrganUpscaleTiledRows(net, input, options, pool, [&](int y, const unsigned char* row) {
+        std::copy(row, row + output.rowBytes(), output.row(y));
+    });
+    return output;
+}
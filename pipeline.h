@@ -0,0 +1,187 @@
+// Dependency-graph executor for the upscaling pipeline
+//
+// stages are declared up front as nodes with typed inputs (load -> resample -> metric -> encode).
+// values flow between nodes in memory; a node is submitted to the scheduler as soon as all of its
+// inputs are ready, and a node's value is released as soon as its last consumer has finished, so
+// large intermediate images do not outlive their use. nodes without consumers keep their value so
+// results can be read back after run(). if a node throws, everything downstream of it is skipped.
+// sinks (nodes returning void, e.g. PNG writes) are low priority: they run when a thread has nothing
+// else to do, so they stay off the path to the metrics.
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "thread_pool.h"
+
+// typed handle to a node's output
+template <typename T>
+struct PipelineNode {
+    int id = -1;
+};
+
+class Pipeline {
+public:
+    enum class Status { Pending, Done, Failed, Skipped };
+
+    // add a node computing fn(inputs...); fn gets const references to the input values
+    // returns a handle to the node's output, or a handle of void for sinks
+    template <typename Fn, typename... Inputs>
+    auto add(const std::string& name, Fn fn, PipelineNode<Inputs>... inputs) {
+        return addNode(name, false, std::move(fn), inputs...);
+    }
+
+    // same as add() for nodes that mostly wait (e.g. on a child process); they run on their
+    // own thread so they do not hold a scheduler worker
+    template <typename Fn, typename... Inputs>
+    auto addBlocking(const std::string& name, Fn fn, PipelineNode<Inputs>... inputs) {
+        return addNode(name, true, std::move(fn), inputs...);
+    }
+
+    // run every node, overlapping independent ones, and wait for all of them
+    void run(ThreadPool& pool) {
+        start = std::chrono::steady_clock::now();
+        TaskGroup group;
+        for (auto& node : nodes) {
+            node->remainingInputs = static_cast<int>(node->inputs.size());
+            node->remainingConsumers = static_cast<int>(node->consumers.size());
+        }
+        for (auto it = nodes.rbegin(); it != nodes.rend(); ++it) {
+            if ((*it)->inputs.empty()) schedule(pool, group, **it);
+        }
+        pool.wait(group);
+    }
+
+    template <typename T>
+    bool succeeded(PipelineNode<T> node) const { return nodes[node.id]->status == Status::Done; }
+
+    // value of a node with no consumers, after run()
+    template <typename T>
+    const T& result(PipelineNode<T> node) const {
+        const Node& n = *nodes[node.id];
+        if (n.status != Status::Done || !n.value) throw std::runtime_error("No result for " + n.name);
+        return *static_cast<const T*>(n.value.get());
+    }
+
+    // per-node start/end times relative to run(), in declaration order
+    void printTimeline(std::ostream& out) const {
+        std::ios::fmtflags flags = out.flags();
+        std::streamsize precision = out.precision();
+        out << "Pipeline timeline (ms):\n";
+        for (const auto& node : nodes) {
+            out << "  " << std::left << std::setw(40) << node->name << std::right;
+            if (node->status == Status::Done) {
+                out << std::setw(9) << std::fixed << std::setprecision(1) << node->startMs
+                    << " -> " << std::setw(9) << node->endMs;
+            } else {
+                out << (node->status == Status::Failed ? "   failed: " + node->error : "   skipped");
+            }
+            out << "\n";
+        }
+        out.flags(flags);
+        out.precision(precision);
+    }
+
+private:
+    struct Node {
+        std::string name;
+        bool blocking = false;
+        bool lowPriority = false;
+        std::vector<int> inputs;
+        std::vector<int> consumers;
+        std::function<std::shared_ptr<void>(const std::vector<const void*>&)> compute;
+
+        std::shared_ptr<void> value;
+        Status status = Status::Pending;
+        std::string error;
+        std::atomic<int> remainingInputs{0};
+        std::atomic<int> remainingConsumers{0};
+        double startMs = 0;
+        double endMs = 0;
+    };
+
+    template <typename Fn, typename... Inputs>
+    auto addNode(const std::string& name, bool blocking, Fn fn, PipelineNode<Inputs>... inputs) {
+        using Result = std::invoke_result_t<Fn, const Inputs&...>;
+
+        auto node = std::make_unique<Node>();
+        node->name = name;
+        node->blocking = blocking;
+        node->lowPriority = std::is_void_v<Result>;
+        node->inputs = {inputs.id...};
+        int id = static_cast<int>(nodes.size());
+        for (int input : node->inputs) nodes[input]->consumers.push_back(id);
+
+        node->compute = [fn = std::move(fn)](const std::vector<const void*>& values) -> std::shared_ptr<void> {
+            return invokeWith<Result, Inputs...>(fn, values, std::index_sequence_for<Inputs...>{});
+        };
+        nodes.push_back(std::move(node));
+        return PipelineNode<Result>{id};
+    }
+
+    template <typename Result, typename... Inputs, typename Fn, size_t... I>
+    static std::shared_ptr<void> invokeWith(const Fn& fn, const std::vector<const void*>& values,
+                                            std::index_sequence<I...>) {
+        if constexpr (std::is_void_v<Result>) {
+            fn(*static_cast<const Inputs*>(values[I])...);
+            return nullptr;
+        } else {
+            return std::make_shared<Result>(fn(*static_cast<const Inputs*>(values[I])...));
+        }
+    }
+
+    double elapsedMs() const {
+        return std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    void schedule(ThreadPool& pool, TaskGroup& group, Node& node) {
+        auto task = [this, &pool, &group, &node] { execute(pool, group, node); };
+        if (node.blocking) pool.submitBlocking(group, task);
+        else pool.submit(group, task, node.lowPriority);
+    }
+
+    void execute(ThreadPool& pool, TaskGroup& group, Node& node) {
+        bool inputsOk = true;
+        std::vector<const void*> values;
+        for (int input : node.inputs) {
+            inputsOk = inputsOk && nodes[input]->status == Status::Done;
+            values.push_back(nodes[input]->value.get());
+        }
+
+        if (!inputsOk) {
+            node.status = Status::Skipped;
+        } else {
+            node.startMs = elapsedMs();
+            try {
+                node.value = node.compute(values);
+                node.status = Status::Done;
+            } catch (const std::exception& e) {
+                node.status = Status::Failed;
+                node.error = e.what();
+            }
+            node.endMs = elapsedMs();
+        }
+
+        //release inputs this was the last consumer of
+        for (int input : node.inputs) {
+            if (nodes[input]->remainingConsumers.fetch_sub(1) == 1) nodes[input]->value.reset();
+        }
+        //the scheduler pops its own deque newest first, so queue consumers in reverse to start
+        //them in declaration order (metrics are declared before the encode sinks)
+        for (auto it = node.consumers.rbegin(); it != node.consumers.rend(); ++it) {
+            if (nodes[*it]->remainingInputs.fetch_sub(1) == 1) schedule(pool, group, *nodes[*it]);
+        }
+    }
+
+    std::vector<std::unique_ptr<Node>> nodes;
+    std::chrono::steady_clock::time_point start;
+};
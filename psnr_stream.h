@@ -0,0 +1,125 @@
+// Streaming PSNR: an upscale scored against the nearest-neighbour upscale of the original without
+// either image in memory
+//
+// the whole-image path needs the 4x ground truth and the 4x candidate decoded side by side, which is
+// gigabytes for a 16K output. here the candidate is handed in a row at a time as its producer makes it
+// (bilinearRows, esrganUpscaleTiledRows, ...), from any thread and in any order; the matching ground
+// truth row is made from the original on the spot and the squared error goes into an integer total.
+// integer sums do not depend on the order, so the MSE is the one computeMSE gives on the two whole
+// images, bit for bit. memory is a truth row and whatever the producer holds per thread (the bilinear
+// row cache: a few MB at 16K) instead of two full frames.
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "cpu_features.h"
+#include "image.h"
+#include "metrics.h"
+#include "resample.h"
+#include "thread_pool.h"
+
+class StreamingPSNR {
+public:
+    // the ground truth is original upscaled by scaleFactor with nearest neighbour; original must outlive this
+    StreamingPSNR(const ConstImageView& original, int scaleFactor, SimdLevel level = activeSimdLevel())
+        : original(original), scale(scaleFactor), kernel(squaredErrorKernel(level)),
+          seen(static_cast<size_t>(original.height) * scaleFactor, 0) {
+        if (scaleFactor < 1) throw std::runtime_error("Scale factor must be at least 1");
+    }
+
+    int width() const { return original.width * scale; }
+    int height() const { return original.height * scale; }
+    int channels() const { return original.channels; }
+    size_t rowBytes() const { return static_cast<size_t>(width()) * channels(); }
+
+    // score candidate row y (rowBytes() bytes); safe to call from several threads at once
+    void addRow(int y, const unsigned char* row) {
+        if (y < 0 || y >= height()) throw std::runtime_error("Row " + std::to_string(y) + " is outside the image");
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (seen[y]) throw std::runtime_error("Row " + std::to_string(y) + " was scored twice");
+            seen[y] = 1;
+        }
+        total += kernel(truthRow(y / scale), row, rowBytes());
+        ++rows;
+    }
+
+    // every row has been scored
+    bool complete() const { return rows == height(); }
+
+    uint64_t squaredError() const { return total; }
+
+    double mse() const {
+        if (!complete()) throw std::runtime_error("Streaming PSNR is missing " + std::to_string(height() - rows) + " rows");
+        return rowBytes() == 0 || height() == 0 ? 0.0 : static_cast<double>(total) / (static_cast<double>(rowBytes()) * height());
+    }
+
+    double psnr() const { return psnrFromMSE(mse()); }
+
+    // bytes held per thread for the ground truth (one row)
+    size_t workingBytes() const { return rowBytes(); }
+
+private:
+    // ground truth row for source row sourceY, kept per thread: the scale rows it covers usually
+    // land in the same band, one after the other
+    const unsigned char* truthRow(int sourceY) const {
+        thread_local struct {
+            uint64_t owner = 0;
+            int sourceY = -1;
+            std::vector<unsigned char> row;
+        } cached;
+        if (cached.owner != id || cached.sourceY != sourceY) {
+            const unsigned char* src = original.row(sourceY);
+            const int numChannels = original.channels;
+            cached.row.resize(rowBytes());
+            for (int x = 0; x < width(); ++x) {
+                const unsigned char* pixel = src + (x / scale) * numChannels;
+                for (int c = 0; c < numChannels; ++c) cached.row[static_cast<size_t>(x) * numChannels + c] = pixel[c];
+            }
+            cached.owner = id;
+            cached.sourceY = sourceY;
+        }
+        return cached.row.data();
+    }
+
+    // tells the scorers apart in the per-thread cache (an address could be reused by the next one)
+    static uint64_t nextId() {
+        static std::atomic<uint64_t> counter{0};
+        return ++counter;
+    }
+
+    const uint64_t id = nextId();
+    const ConstImageView original;
+    const int scale;
+    const SquaredErrorKernel kernel;
+    std::atomic<uint64_t> total{0};
+    std::atomic<int> rows{0};
+    std::mutex mutex;
+    std::vector<char> seen; //rows already scored, so a producer bug cannot count a row twice
+};
+
+// PSNR of the bilinear upscale of input (float or fixed-point) against original, one row per thread at a time
+inline double streamBilinearPSNR(const ConstImageView& original, const ConstImageView& input, int scaleFactor, bool fixedPoint = false,
+                                 SimdLevel level = activeSimdLevel(), ThreadPool& pool = globalThreadPool()) {
+    if (input.width != original.width || input.height != original.height || input.channels != original.channels) {
+        throw std::runtime_error("Images must have the same dimensions for PSNR");
+    }
+    StreamingPSNR score(original, scaleFactor, level);
+    auto target = [&](int) {
+        thread_local std::vector<unsigned char> row;
+        row.resize(score.rowBytes());
+        return row.data();
+    };
+    auto done = [&](int y, const unsigned char* row) { score.addRow(y, row); };
+    if (fixedPoint) {
+        bilinearRowsFixed(input, scaleFactor, level, pool, target, done);
+    } else {
+        bilinearRows(input, scaleFactor, level, pool, target, done);
+    }
+    return score.psnr();
+}
@@ -0,0 +1,488 @@
+// Separable bilinear resampling engine used by bilinearUpscaling
+#pragma once
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <cstdint>
+#include "cpu_features.h"
+#include "image.h"
+#include "thread_pool.h"
+
+// source indices and weights for every output coordinate along one axis
+// computed once per image instead of once per channel per pixel
+struct BilinearAxis {
+    std::vector<int> index0;
+    std::vector<int> index1;
+    std::vector<float> weight0; // (1 - d)
+    std::vector<float> weight1; // d
+};
+
+inline BilinearAxis buildBilinearAxis(int inputSize, int outputSize, int scaleFactor) {
+    BilinearAxis axis;
+    axis.index0.resize(outputSize);
+    axis.index1.resize(outputSize);
+    axis.weight0.resize(outputSize);
+    axis.weight1.resize(outputSize);
+
+    for (int o = 0; o < outputSize; ++o) {
+        //same sample position, clamping and weights as bilinearSample
+        float sample = o / static_cast<float>(scaleFactor);
+        int i0 = static_cast<int>(floor(sample));
+        int i1 = i0 + 1;
+        i0 = std::clamp(i0, 0, inputSize - 1);
+        i1 = std::clamp(i1, 0, inputSize - 1);
+
+        float d = sample - i0;
+        axis.index0[o] = i0;
+        axis.index1[o] = i1;
+        axis.weight0[o] = 1 - d;
+        axis.weight1[o] = d;
+    }
+    return axis;
+}
+
+// one source row resampled horizontally to the output width
+// left holds A * (1 - dx) and right holds B * dx for every output byte, so the vertical
+// blend can evaluate the exact same float expression as bilinearSample
+struct HorizontalRow {
+    int sourceY = -1;
+    std::vector<float> left;
+    std::vector<float> right;
+};
+
+inline void horizontalPass(const ConstImageView& input, const BilinearAxis& xAxis, int sourceY, HorizontalRow& row) {
+    const int outputWidth = static_cast<int>(xAxis.index0.size());
+    const int numChannels = input.channels;
+    const unsigned char* srcRow = input.row(sourceY);
+
+    row.sourceY = sourceY;
+    row.left.resize(static_cast<size_t>(outputWidth) * numChannels);
+    row.right.resize(static_cast<size_t>(outputWidth) * numChannels);
+
+    for (int x = 0; x < outputWidth; ++x) {
+        const unsigned char* a = srcRow + xAxis.index0[x] * numChannels;
+        const unsigned char* b = srcRow + xAxis.index1[x] * numChannels;
+        float w0 = xAxis.weight0[x];
+        float w1 = xAxis.weight1[x];
+        for (int c = 0; c < numChannels; ++c) {
+            row.left[x * numChannels + c] = static_cast<float>(a[c]) * w0;
+            row.right[x * numChannels + c] = static_cast<float>(b[c]) * w1;
+        }
+    }
+}
+
+// vertical blend of two cached rows into one 8-bit output row
+// evaluated as A*(1-dx)*(1-dy) + B*dx*(1-dy) + C*(1-dx)*dy + D*dx*dy, left to right, so the
+// result is bit-identical to calling bilinearSample per channel
+using VerticalBlendKernel = void (*)(const float* l0, const float* r0, const float* l1, const float* r1,
+                                     float weight0, float weight1, unsigned char* outputRow, size_t count);
+
+inline void verticalBlendScalar(const float* l0, const float* r0, const float* l1, const float* r1,
+                                float weight0, float weight1, unsigned char* outputRow, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        float value = l0[i] * weight0 + r0[i] * weight0 + l1[i] * weight1 + r1[i] * weight1;
+        outputRow[i] = static_cast<unsigned char>(std::clamp(value, 0.0f, 255.0f));
+    }
+}
+
+// the SIMD kernels run the same mul/add sequence lane-wise, clamp with max/min and truncate,
+// so every ISA produces the same bytes as the scalar kernel
+// rows are interleaved RGB but the vertical weights are shared by the whole row, so no
+// deinterleaving is needed: each lane is one output byte
+#if defined(UPSCALER_X86)
+UPSCALER_TARGET("sse2")
+inline void verticalBlendSSE2(const float* l0, const float* r0, const float* l1, const float* r1,
+                              float weight0, float weight1, unsigned char* outputRow, size_t count) {
+    const __m128 w0 = _mm_set1_ps(weight0);
+    const __m128 w1 = _mm_set1_ps(weight1);
+    const __m128 lo = _mm_setzero_ps();
+    const __m128 hi = _mm_set1_ps(255.0f);
+
+    size_t i = 0;
+    //16 output bytes per iteration
+    for (; i + 16 <= count; i += 16) {
+        __m128i q[4];
+        for (int k = 0; k < 4; ++k) {
+            size_t j = i + k * 4;
+            __m128 v = _mm_add_ps(_mm_mul_ps(_mm_loadu_ps(l0 + j), w0), _mm_mul_ps(_mm_loadu_ps(r0 + j), w0));
+            v = _mm_add_ps(v, _mm_mul_ps(_mm_loadu_ps(l1 + j), w1));
+            v = _mm_add_ps(v, _mm_mul_ps(_mm_loadu_ps(r1 + j), w1));
+            v = _mm_min_ps(_mm_max_ps(v, lo), hi);
+            q[k] = _mm_cvttps_epi32(v);
+        }
+        __m128i packed = _mm_packus_epi16(_mm_packs_epi32(q[0], q[1]), _mm_packs_epi32(q[2], q[3]));
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(outputRow + i), packed);
+    }
+    verticalBlendScalar(l0 + i, r0 + i, l1 + i, r1 + i, weight0, weight1, outputRow + i, count - i);
+}
+
+UPSCALER_TARGET("avx2")
+inline void verticalBlendAVX2(const float* l0, const float* r0, const float* l1, const float* r1,
+                              float weight0, float weight1, unsigned char* outputRow, size_t count) {
+    const __m256 w0 = _mm256_set1_ps(weight0);
+    const __m256 w1 = _mm256_set1_ps(weight1);
+    const __m256 lo = _mm256_setzero_ps();
+    const __m256 hi = _mm256_set1_ps(255.0f);
+    //packs/packus work per 128-bit lane, this puts the dwords back in order
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+    size_t i = 0;
+    //32 output bytes per iteration
+    for (; i + 32 <= count; i += 32) {
+        __m256i q[4];
+        for (int k = 0; k < 4; ++k) {
+            size_t j = i + k * 8;
+            __m256 v = _mm256_add_ps(_mm256_mul_ps(_mm256_loadu_ps(l0 + j), w0), _mm256_mul_ps(_mm256_loadu_ps(r0 + j), w0));
+            v = _mm256_add_ps(v, _mm256_mul_ps(_mm256_loadu_ps(l1 + j), w1));
+            v = _mm256_add_ps(v, _mm256_mul_ps(_mm256_loadu_ps(r1 + j), w1));
+            v = _mm256_min_ps(_mm256_max_ps(v, lo), hi);
+            q[k] = _mm256_cvttps_epi32(v);
+        }
+        __m256i packed = _mm256_packus_epi16(_mm256_packs_epi32(q[0], q[1]), _mm256_packs_epi32(q[2], q[3]));
+        packed = _mm256_permutevar8x32_epi32(packed, order);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(outputRow + i), packed);
+    }
+    verticalBlendSSE2(l0 + i, r0 + i, l1 + i, r1 + i, weight0, weight1, outputRow + i, count - i);
+}
+
+UPSCALER_TARGET("avx512f")
+inline void verticalBlendAVX512(const float* l0, const float* r0, const float* l1, const float* r1,
+                                float weight0, float weight1, unsigned char* outputRow, size_t count) {
+    const __m512 w0 = _mm512_set1_ps(weight0);
+    const __m512 w1 = _mm512_set1_ps(weight1);
+    const __m512 lo = _mm512_setzero_ps();
+    const __m512 hi = _mm512_set1_ps(255.0f);
+
+    size_t i = 0;
+    //16 output bytes per vector, two vectors per iteration
+    for (; i + 32 <= count; i += 32) {
+        for (int k = 0; k < 2; ++k) {
+            size_t j = i + k * 16;
+            __m512 v = _mm512_add_ps(_mm512_mul_ps(_mm512_loadu_ps(l0 + j), w0), _mm512_mul_ps(_mm512_loadu_ps(r0 + j), w0));
+            v = _mm512_add_ps(v, _mm512_mul_ps(_mm512_loadu_ps(l1 + j), w1));
+            v = _mm512_add_ps(v, _mm512_mul_ps(_mm512_loadu_ps(r1 + j), w1));
+            v = _mm512_min_ps(_mm512_max_ps(v, lo), hi);
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(outputRow + j), _mm512_cvtusepi32_epi8(_mm512_cvttps_epi32(v)));
+        }
+    }
+    verticalBlendSSE2(l0 + i, r0 + i, l1 + i, r1 + i, weight0, weight1, outputRow + i, count - i);
+}
+#endif
+
+inline VerticalBlendKernel verticalBlendKernel(SimdLevel level) {
+#if defined(UPSCALER_X86)
+    switch (level) {
+        case SimdLevel::AVX512: return verticalBlendAVX512;
+        case SimdLevel::AVX2: return verticalBlendAVX2;
+        case SimdLevel::SSE2: return verticalBlendSSE2;
+        default: break;
+    }
+#endif
+    return verticalBlendScalar;
+}
+
+// returns the cached row for sourceY, resampling it into whichever slot does not hold keepY
+inline const HorizontalRow& cachedRow(HorizontalRow (&cache)[2], const ConstImageView& input,
+                                      const BilinearAxis& xAxis, int sourceY, int keepY) {
+    for (HorizontalRow& row : cache) {
+        if (row.sourceY == sourceY) return row;
+    }
+    HorizontalRow& row = (cache[0].sourceY == keepY) ? cache[1] : cache[0];
+    horizontalPass(input, xAxis, sourceY, row);
+    return row;
+}
+
+// the rows of an upscale of input by an integer factor (scaleFactor times larger), made in bands on
+// the pool: row y is blended into target(y) and then handed to done(y, row). bilinearResize writes
+// straight into its output; a streaming consumer (psnr_stream.h) blends into a row of its own and
+// uses it up, so the upscaled image never exists as a whole.
+// each source row is resampled horizontally once per band and reused by every output row that needs
+// it; every row is computed the same way whichever band it lands in, so the result does not depend
+// on the thread count
+template <typename Target, typename Done>
+inline void bilinearRows(const ConstImageView& input, int scaleFactor, SimdLevel level, ThreadPool& pool,
+                         const Target& target, const Done& done) {
+    const int outputWidth = input.width * scaleFactor, outputHeight = input.height * scaleFactor;
+    const BilinearAxis xAxis = buildBilinearAxis(input.width, outputWidth, scaleFactor);
+    const BilinearAxis yAxis = buildBilinearAxis(input.height, outputHeight, scaleFactor);
+    const VerticalBlendKernel blend = verticalBlendKernel(level);
+    const size_t rowBytes = static_cast<size_t>(outputWidth) * input.channels;
+
+    parallelRowBands(pool, outputHeight, scaleFactor * 8, [&](int rowBegin, int rowEnd) {
+        HorizontalRow cache[2];
+        for (int outputY = rowBegin; outputY < rowEnd; ++outputY) {
+            int y0 = yAxis.index0[outputY];
+            int y1 = yAxis.index1[outputY];
+            const HorizontalRow& top = cachedRow(cache, input, xAxis, y0, y1);
+            const HorizontalRow& bottom = cachedRow(cache, input, xAxis, y1, y0);
+
+            unsigned char* row = target(outputY);
+            blend(top.left.data(), top.right.data(), bottom.left.data(), bottom.right.data(),
+                  yAxis.weight0[outputY], yAxis.weight1[outputY], row, rowBytes);
+            done(outputY, static_cast<const unsigned char*>(row));
+        }
+    });
+}
+
+// upscale an interleaved 8-bit image by an integer factor into output (scaleFactor times larger)
+inline void bilinearResize(const ConstImageView& input, const ImageView& output, int scaleFactor,
+                           SimdLevel level = activeSimdLevel(), ThreadPool& pool = globalThreadPool()) {
+    bilinearRows(input, scaleFactor, level, pool, [&](int y) { return output.row(y); }, [](int, const unsigned char*) {});
+}
+
+// same, for tightly packed buffers
+inline void bilinearResize(const unsigned char* imageData, int inputWidth, int inputHeight, int numChannels,
+                           unsigned char* outputData, int scaleFactor, SimdLevel level = activeSimdLevel(),
+                           ThreadPool& pool = globalThreadPool()) {
+    bilinearResize(ConstImageView(imageData, inputWidth, inputHeight, numChannels),
+                   ImageView(outputData, inputWidth * scaleFactor, inputHeight * scaleFactor, numChannels),
+                   scaleFactor, level, pool);
+}
+
+// nearest-neighbour upscale by an integer factor (copying true pixel values)
+// each output row is built once per source row and the remaining scaleFactor - 1 rows are copies
+inline void nearestResize(const ConstImageView& input, const ImageView& output, int scaleFactor,
+                          ThreadPool& pool = globalThreadPool()) {
+    const int numChannels = input.channels;
+    const size_t rowBytes = output.rowBytes();
+
+    //bands are whole source rows so the copied rows never cross a band
+    parallelRowBands(pool, input.height, 8, [&](int srcBegin, int srcEnd) {
+        for (int srcY = srcBegin; srcY < srcEnd; ++srcY) {
+            const unsigned char* srcRow = input.row(srcY);
+            unsigned char* firstRow = output.row(srcY * scaleFactor);
+
+            for (int x = 0; x < output.width; ++x) {
+                const unsigned char* pixel = srcRow + (x / scaleFactor) * numChannels;
+                for (int c = 0; c < numChannels; ++c) {
+                    firstRow[x * numChannels + c] = pixel[c];
+                }
+            }
+            for (int k = 1; k < scaleFactor; ++k) {
+                std::copy(firstRow, firstRow + rowBytes, output.row(srcY * scaleFactor + k));
+            }
+        }
+    });
+}
+
+inline void nearestResize(const unsigned char* imageData, int inputWidth, int inputHeight, int numChannels,
+                          unsigned char* outputData, int scaleFactor, ThreadPool& pool = globalThreadPool()) {
+    nearestResize(ConstImageView(imageData, inputWidth, inputHeight, numChannels),
+                  ImageView(outputData, inputWidth * scaleFactor, inputHeight * scaleFactor, numChannels),
+                  scaleFactor, pool);
+}
+
+// box-filter downscale by an integer factor (the low-resolution input for a frame)
+inline Image downscaleBox(const ConstImageView& image, int factor) {
+    Image output(image.width / factor, image.height / factor, image.channels);
+    const int area = factor * factor;
+    for (int y = 0; y < output.height; ++y) {
+        unsigned char* dst = output.row(y);
+        for (int x = 0; x < output.width; ++x) {
+            for (int ch = 0; ch < image.channels; ++ch) {
+                int sum = 0;
+                for (int dy = 0; dy < factor; ++dy) {
+                    const unsigned char* src = image.row(y * factor + dy) + static_cast<size_t>(x) * factor * image.channels + ch;
+                    for (int dx = 0; dx < factor; ++dx) sum += src[dx * image.channels];
+                }
+                dst[x * image.channels + ch] = static_cast<unsigned char>((sum + area / 2) / area);
+            }
+        }
+    }
+    return output;
+}
+
+// ---------------------------------------------------------------------------------------------
+// Fixed-point integer path for 8-bit images
+//
+// weights are stored as 14-bit fractions (1.0 = 16384) with weight0 + weight1 == 16384 exactly.
+// the horizontal pass accumulates in 32 bits and rounds each cached value to 7 fractional bits,
+// which fits a 16-bit lane (max 255 * 128). the vertical blend multiplies pairs of those with the
+// 14-bit row weights in 32-bit lanes (pmaddwd) and truncates with a shift, so the hot loop never
+// converts to float and moves half the bytes of the float row cache.
+//
+// tolerance: weight quantization and the 7-bit rounding add less than 1/50 LSB of error before
+// truncation, so every output byte is within +-1 of the float path for any scale factor. at
+// scales where the float weights are exact (powers of two, e.g. the default 4x) most bytes match
+// and the rest differ only where float rounding falls just below an integer.
+// ---------------------------------------------------------------------------------------------
+
+constexpr int kFixedWeightBits = 14;
+constexpr int kFixedRowBits = 7;
+constexpr int kFixedOne = 1 << kFixedWeightBits;
+
+struct FixedAxis {
+    std::vector<int> index0;
+    std::vector<int> index1;
+    std::vector<int16_t> weight0;
+    std::vector<int16_t> weight1;
+};
+
+inline FixedAxis buildFixedAxis(int inputSize, int outputSize, int scaleFactor) {
+    BilinearAxis floatAxis = buildBilinearAxis(inputSize, outputSize, scaleFactor);
+    FixedAxis axis;
+    axis.index0 = floatAxis.index0;
+    axis.index1 = floatAxis.index1;
+    axis.weight0.resize(outputSize);
+    axis.weight1.resize(outputSize);
+
+    for (int o = 0; o < outputSize; ++o) {
+        //round d and derive (1 - d) from it so the pair always sums to exactly 1.0
+        int w1 = static_cast<int>(std::lround(floatAxis.weight1[o] * kFixedOne));
+        w1 = std::clamp(w1, 0, kFixedOne);
+        axis.weight0[o] = static_cast<int16_t>(kFixedOne - w1);
+        axis.weight1[o] = static_cast<int16_t>(w1);
+    }
+    return axis;
+}
+
+// one source row resampled horizontally, A * (1 - dx) + B * dx with 7 fractional bits
+struct FixedRow {
+    int sourceY = -1;
+    std::vector<int16_t> values;
+};
+
+inline void horizontalPassFixed(const ConstImageView& input, const FixedAxis& xAxis, int sourceY, FixedRow& row) {
+    const int outputWidth = static_cast<int>(xAxis.index0.size());
+    const int numChannels = input.channels;
+    const unsigned char* srcRow = input.row(sourceY);
+    const int shift = kFixedWeightBits - kFixedRowBits;
+    const int half = 1 << (shift - 1);
+
+    row.sourceY = sourceY;
+    row.values.resize(static_cast<size_t>(outputWidth) * numChannels);
+
+    for (int x = 0; x < outputWidth; ++x) {
+        const unsigned char* a = srcRow + xAxis.index0[x] * numChannels;
+        const unsigned char* b = srcRow + xAxis.index1[x] * numChannels;
+        int w0 = xAxis.weight0[x];
+        int w1 = xAxis.weight1[x];
+        for (int c = 0; c < numChannels; ++c) {
+            row.values[x * numChannels + c] = static_cast<int16_t>((a[c] * w0 + b[c] * w1 + half) >> shift);
+        }
+    }
+}
+
+using FixedBlendKernel = void (*)(const int16_t* top, const int16_t* bottom, int16_t weight0, int16_t weight1,
+                                  unsigned char* outputRow, size_t count);
+
+constexpr int kFixedBlendShift = kFixedWeightBits + kFixedRowBits;
+
+//max value is 255 * 128 * 16384 >> 21 == 255, so no clamp is needed
+inline void verticalBlendFixedScalar(const int16_t* top, const int16_t* bottom, int16_t weight0, int16_t weight1,
+                                     unsigned char* outputRow, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        int value = top[i] * weight0 + bottom[i] * weight1;
+        outputRow[i] = static_cast<unsigned char>(value >> kFixedBlendShift);
+    }
+}
+
+#if defined(UPSCALER_X86)
+UPSCALER_TARGET("sse2")
+inline void verticalBlendFixedSSE2(const int16_t* top, const int16_t* bottom, int16_t weight0, int16_t weight1,
+                                   unsigned char* outputRow, size_t count) {
+    //(weight0, weight1) pairs line up with interleaved (top, bottom) pairs for pmaddwd
+    const __m128i weights = _mm_set1_epi32(static_cast<int>((static_cast<uint32_t>(static_cast<uint16_t>(weight1)) << 16) |
+                                                            static_cast<uint16_t>(weight0)));
+    size_t i = 0;
+    //16 output bytes per iteration
+    for (; i + 16 <= count; i += 16) {
+        __m128i q[2];
+        for (int k = 0; k < 2; ++k) {
+            __m128i t = _mm_loadu_si128(reinterpret_cast<const __m128i*>(top + i + k * 8));
+            __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(bottom + i + k * 8));
+            __m128i lo = _mm_srai_epi32(_mm_madd_epi16(_mm_unpacklo_epi16(t, b), weights), kFixedBlendShift);
+            __m128i hi = _mm_srai_epi32(_mm_madd_epi16(_mm_unpackhi_epi16(t, b), weights), kFixedBlendShift);
+            q[k] = _mm_packs_epi32(lo, hi);
+        }
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(outputRow + i), _mm_packus_epi16(q[0], q[1]));
+    }
+    verticalBlendFixedScalar(top + i, bottom + i, weight0, weight1, outputRow + i, count - i);
+}
+
+UPSCALER_TARGET("avx2")
+inline void verticalBlendFixedAVX2(const int16_t* top, const int16_t* bottom, int16_t weight0, int16_t weight1,
+                                   unsigned char* outputRow, size_t count) {
+    const __m256i weights = _mm256_set1_epi32(static_cast<int>((static_cast<uint32_t>(static_cast<uint16_t>(weight1)) << 16) |
+                                                               static_cast<uint16_t>(weight0)));
+    size_t i = 0;
+    //32 output bytes per iteration
+    for (; i + 32 <= count; i += 32) {
+        __m256i q[2];
+        for (int k = 0; k < 2; ++k) {
+            __m256i t = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(top + i + k * 16));
+            __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(bottom + i + k * 16));
+            //unpack and pack are both per 128-bit lane, so they cancel out and keep the order
+            __m256i lo = _mm256_srai_epi32(_mm256_madd_epi16(_mm256_unpacklo_epi16(t, b), weights), kFixedBlendShift);
+            __m256i hi = _mm256_srai_epi32(_mm256_madd_epi16(_mm256_unpackhi_epi16(t, b), weights), kFixedBlendShift);
+            q[k] = _mm256_packs_epi32(lo, hi);
+        }
+        __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(q[0], q[1]), 0xD8);
+        _mm256_storeu_si256(reinterpret_cast<__m256i*>(outputRow + i), packed);
+    }
+    verticalBlendFixedSSE2(top + i, bottom + i, weight0, weight1, outputRow + i, count - i);
+}
+#endif
+
+//the 16-bit blend has no AVX-512F form (it needs AVX-512BW), so AVX512 uses the AVX2 kernel
+inline FixedBlendKernel verticalBlendFixedKernel(SimdLevel level) {
+#if defined(UPSCALER_X86)
+    switch (level) {
+        case SimdLevel::AVX512:
+        case SimdLevel::AVX2: return verticalBlendFixedAVX2;
+        case SimdLevel::SSE2: return verticalBlendFixedSSE2;
+        default: break;
+    }
+#endif
+    return verticalBlendFixedScalar;
+}
+
+inline const FixedRow& cachedFixedRow(FixedRow (&cache)[2], const ConstImageView& input,
+                                      const FixedAxis& xAxis, int sourceY, int keepY) {
+    for (FixedRow& row : cache) {
+        if (row.sourceY == sourceY) return row;
+    }
+    FixedRow& row = (cache[0].sourceY == keepY) ? cache[1] : cache[0];
+    horizontalPassFixed(input, xAxis, sourceY, row);
+    return row;
+}
+
+// integer-only version of bilinearRows, within +-1 of the float rows (see above)
+template <typename Target, typename Done>
+inline void bilinearRowsFixed(const ConstImageView& input, int scaleFactor, SimdLevel level, ThreadPool& pool,
+                              const Target& target, const Done& done) {
+    const int outputWidth = input.width * scaleFactor, outputHeight = input.height * scaleFactor;
+    const FixedAxis xAxis = buildFixedAxis(input.width, outputWidth, scaleFactor);
+    const FixedAxis yAxis = buildFixedAxis(input.height, outputHeight, scaleFactor);
+    const FixedBlendKernel blend = verticalBlendFixedKernel(level);
+    const size_t rowBytes = static_cast<size_t>(outputWidth) * input.channels;
+
+    parallelRowBands(pool, outputHeight, scaleFactor * 8, [&](int rowBegin, int rowEnd) {
+        FixedRow cache[2];
+        for (int outputY = rowBegin; outputY < rowEnd; ++outputY) {
+            int y0 = yAxis.index0[outputY];
+            int y1 = yAxis.index1[outputY];
+            const FixedRow& top = cachedFixedRow(cache, input, xAxis, y0, y1);
+            const FixedRow& bottom = cachedFixedRow(cache, input, xAxis, y1, y0);
+
+            unsigned char* row = target(outputY);
+            blend(top.values.data(), bottom.values.data(), yAxis.weight0[outputY], yAxis.weight1[outputY], row, rowBytes);
+            done(outputY, static_cast<const unsigned char*>(row));
+        }
+    });
+}
+
+// integer-only version of bilinearResize, within +-1 of the float output (see above)
+inline void bilinearResizeFixed(const ConstImageView& input, const ImageView& output, int scaleFactor,
+                                SimdLevel level = activeSimdLevel(), ThreadPool& pool = globalThreadPool()) {
+    bilinearRowsFixed(input, scaleFactor, level, pool, [&](int y) { return output.row(y); }, [](int, const unsigned char*) {});
+}
+
+inline void bilinearResizeFixed(const unsigned char* imageData, int inputWidth, int inputHeight, int numChannels,
+                                unsigned char* outputData, int scaleFactor, SimdLevel level = activeSimdLevel(),
+                                ThreadPool& pool = globalThreadPool()) {
+    bilinearResizeFixed(ConstImageView(imageData, inputWidth, inputHeight, numChannels),
+                        ImageView(outputData, inputWidth * scaleFactor, inputHeight * scaleFactor, numChannels),
+                        scaleFactor, level, pool);
+}
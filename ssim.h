@@ -0,0 +1,453 @@
+// SSIM and MS-SSIM of 8-bit images (Wang et al.): structural similarity, which PSNR does not see
+//
+// the local means, variances and covariance come from an 11x11 Gaussian window (sigma 1.5) applied
+// as two 1-D passes by SIMD kernels: a vertical pass over a ring of the last 11 rows, which also forms
+// x^2, y^2 and xy, then a horizontal pass. only windows that fit inside the image count ("valid"), so
+// the map is (width - 10) x (height - 10). every channel is scored and the channels are averaged.
+// tiles (a band of rows by 512 columns) run on the pool and their sums are added up in a fixed order,
+// and the kernels do the same float operations in the same order at every SIMD level, so the result
+// depends on neither the thread count nor the CPU.
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "cpu_features.h"
+#include "image.h"
+#include "resample.h"
+#include "thread_pool.h"
+
+constexpr int kSsimWindow = 11;
+constexpr float kSsimC1 = (0.01f * 255) * (0.01f * 255);
+constexpr float kSsimC2 = (0.03f * 255) * (0.03f * 255);
+
+// normalized 11-tap Gaussian, sigma 1.5
+inline const float* ssimWeights() {
+    static const std::vector<float> weights = [] {
+        std::vector<double> g(kSsimWindow);
+        double sum = 0;
+        for (int i = 0; i < kSsimWindow; ++i) {
+            const double d = i - kSsimWindow / 2;
+            g[i] = std::exp(-d * d / (2 * 1.5 * 1.5));
+            sum += g[i];
+        }
+        std::vector<float> w(kSsimWindow);
+        for (int i = 0; i < kSsimWindow; ++i) w[i] = static_cast<float>(g[i] / sum);
+        return w;
+    }();
+    return weights.data();
+}
+
+// vertical pass: the window sums of x, y, x^2, y^2 and xy down 11 rows of x (rows1) and y (rows2).
+// every kernel adds the taps in the same order, starting from 0, so all levels agree to the bit
+inline void ssimVerticalScalar(const float* const* rows1, const float* const* rows2, const float* weights, float* mu1, float* mu2,
+                               float* xx, float* yy, float* xy, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        float s1 = 0, s2 = 0, s11 = 0, s22 = 0, s12 = 0;
+        for (int k = 0; k < kSsimWindow; ++k) {
+            float p = rows1[k][i], q = rows2[k][i], w = weights[k];
+            s1 += w * p;
+            s2 += w * q;
+            s11 += w * (p * p);
+            s22 += w * (q * q);
+            s12 += w * (p * q);
+        }
+        mu1[i] = s1;
+        mu2[i] = s2;
+        xx[i] = s11;
+        yy[i] = s22;
+        xy[i] = s12;
+    }
+}
+
+// horizontal pass: out[i] = sum of weights[k] * in[i + k]
+inline void ssimHorizontalScalar(const float* in, const float* weights, float* out, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        //the window is symmetric, so taps k and 10 - k share a weight
+        float sum = weights[5] * in[i + 5];
+        for (int k = 0; k < 5; ++k) sum += weights[k] * (in[i + k] + in[i + 10 - k]);
+        out[i] = sum;
+    }
+}
+
+// ssim and contrast-structure (cs) of every window from its filtered x, y, x^2, y^2 and xy
+inline void ssimFormulaScalar(const float* mu1, const float* mu2, const float* xx, const float* yy, const float* xy,
+                              float* ssim, float* cs, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+        float mu12 = mu1[i] * mu2[i];
+        float mu11 = mu1[i] * mu1[i];
+        float mu22 = mu2[i] * mu2[i];
+        float luminance = 2.0f * mu12 + kSsimC1, luminanceDen = (mu11 + mu22) + kSsimC1;
+        float contrast = 2.0f * (xy[i] - mu12) + kSsimC2, contrastDen = ((xx[i] - mu11) + (yy[i] - mu22)) + kSsimC2;
+        //one division for both terms
+        float inverse = 1.0f / (luminanceDen * contrastDen);
+        ssim[i] = (luminance * contrast) * inverse;
+        cs[i] = (contrast * luminanceDen) * inverse;
+    }
+}
+
+#if defined(UPSCALER_X86)
+UPSCALER_TARGET("sse2")
+inline void ssimVerticalSSE2(const float* const* rows1, const float* const* rows2, const float* weights, float* mu1, float* mu2,
+                             float* xx, float* yy, float* xy, size_t count) {
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128 s1 = _mm_setzero_ps(), s2 = _mm_setzero_ps(), s11 = _mm_setzero_ps(), s22 = _mm_setzero_ps(), s12 = _mm_setzero_ps();
+        for (int k = 0; k < kSsimWindow; ++k) {
+            __m128 p = _mm_loadu_ps(rows1[k] + i), q = _mm_loadu_ps(rows2[k] + i), w = _mm_set1_ps(weights[k]);
+            s1 = _mm_add_ps(s1, _mm_mul_ps(w, p));
+            s2 = _mm_add_ps(s2, _mm_mul_ps(w, q));
+            s11 = _mm_add_ps(s11, _mm_mul_ps(w, _mm_mul_ps(p, p)));
+            s22 = _mm_add_ps(s22, _mm_mul_ps(w, _mm_mul_ps(q, q)));
+            s12 = _mm_add_ps(s12, _mm_mul_ps(w, _mm_mul_ps(p, q)));
+        }
+        _mm_storeu_ps(mu1 + i, s1);
+        _mm_storeu_ps(mu2 + i, s2);
+        _mm_storeu_ps(xx + i, s11);
+        _mm_storeu_ps(yy + i, s22);
+        _mm_storeu_ps(xy + i, s12);
+    }
+    if (i == count) return;
+    const float* tail1[kSsimWindow];
+    const float* tail2[kSsimWindow];
+    for (int k = 0; k < kSsimWindow; ++k) {
+        tail1[k] = rows1[k] + i;
+        tail2[k] = rows2[k] + i;
+    }
+    ssimVerticalScalar(tail1, tail2, weights, mu1 + i, mu2 + i, xx + i, yy + i, xy + i, count - i);
+}
+
+UPSCALER_TARGET("sse2")
+inline void ssimHorizontalSSE2(const float* in, const float* weights, float* out, size_t count) {
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128 sum = _mm_mul_ps(_mm_set1_ps(weights[5]), _mm_loadu_ps(in + i + 5));
+        for (int k = 0; k < 5; ++k) {
+            sum = _mm_add_ps(sum, _mm_mul_ps(_mm_set1_ps(weights[k]), _mm_add_ps(_mm_loadu_ps(in + i + k), _mm_loadu_ps(in + i + 10 - k))));
+        }
+        _mm_storeu_ps(out + i, sum);
+    }
+    ssimHorizontalScalar(in + i, weights, out + i, count - i);
+}
+
+UPSCALER_TARGET("sse2")
+inline void ssimFormulaSSE2(const float* mu1, const float* mu2, const float* xx, const float* yy, const float* xy,
+                            float* ssim, float* cs, size_t count) {
+    const __m128 one = _mm_set1_ps(1.0f), two = _mm_set1_ps(2.0f), c1 = _mm_set1_ps(kSsimC1), c2 = _mm_set1_ps(kSsimC2);
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m128 m1 = _mm_loadu_ps(mu1 + i), m2 = _mm_loadu_ps(mu2 + i);
+        __m128 mu12 = _mm_mul_ps(m1, m2), mu11 = _mm_mul_ps(m1, m1), mu22 = _mm_mul_ps(m2, m2);
+        __m128 luminance = _mm_add_ps(_mm_mul_ps(two, mu12), c1);
+        __m128 luminanceDen = _mm_add_ps(_mm_add_ps(mu11, mu22), c1);
+        __m128 contrast = _mm_add_ps(_mm_mul_ps(two, _mm_sub_ps(_mm_loadu_ps(xy + i), mu12)), c2);
+        __m128 contrastDen = _mm_add_ps(_mm_add_ps(_mm_sub_ps(_mm_loadu_ps(xx + i), mu11), _mm_sub_ps(_mm_loadu_ps(yy + i), mu22)), c2);
+        __m128 inverse = _mm_div_ps(one, _mm_mul_ps(luminanceDen, contrastDen));
+        _mm_storeu_ps(ssim + i, _mm_mul_ps(_mm_mul_ps(luminance, contrast), inverse));
+        _mm_storeu_ps(cs + i, _mm_mul_ps(_mm_mul_ps(contrast, luminanceDen), inverse));
+    }
+    ssimFormulaScalar(mu1 + i, mu2 + i, xx + i, yy + i, xy + i, ssim + i, cs + i, count - i);
+}
+
+UPSCALER_TARGET("avx2")
+inline void ssimVerticalAVX2(const float* const* rows1, const float* const* rows2, const float* weights, float* mu1, float* mu2,
+                             float* xx, float* yy, float* xy, size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 s1 = _mm256_setzero_ps(), s2 = _mm256_setzero_ps(), s11 = _mm256_setzero_ps(), s22 = _mm256_setzero_ps(), s12 = _mm256_setzero_ps();
+        for (int k = 0; k < kSsimWindow; ++k) {
+            __m256 p = _mm256_loadu_ps(rows1[k] + i), q = _mm256_loadu_ps(rows2[k] + i), w = _mm256_set1_ps(weights[k]);
+            s1 = _mm256_add_ps(s1, _mm256_mul_ps(w, p));
+            s2 = _mm256_add_ps(s2, _mm256_mul_ps(w, q));
+            s11 = _mm256_add_ps(s11, _mm256_mul_ps(w, _mm256_mul_ps(p, p)));
+            s22 = _mm256_add_ps(s22, _mm256_mul_ps(w, _mm256_mul_ps(q, q)));
+            s12 = _mm256_add_ps(s12, _mm256_mul_ps(w, _mm256_mul_ps(p, q)));
+        }
+        _mm256_storeu_ps(mu1 + i, s1);
+        _mm256_storeu_ps(mu2 + i, s2);
+        _mm256_storeu_ps(xx + i, s11);
+        _mm256_storeu_ps(yy + i, s22);
+        _mm256_storeu_ps(xy + i, s12);
+    }
+    if (i == count) return;
+    const float* tail1[kSsimWindow];
+    const float* tail2[kSsimWindow];
+    for (int k = 0; k < kSsimWindow; ++k) {
+        tail1[k] = rows1[k] + i;
+        tail2[k] = rows2[k] + i;
+    }
+    ssimVerticalScalar(tail1, tail2, weights, mu1 + i, mu2 + i, xx + i, yy + i, xy + i, count - i);
+}
+
+UPSCALER_TARGET("avx2")
+inline void ssimHorizontalAVX2(const float* in, const float* weights, float* out, size_t count) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 sum = _mm256_mul_ps(_mm256_set1_ps(weights[5]), _mm256_loadu_ps(in + i + 5));
+        for (int k = 0; k < 5; ++k) {
+            sum = _mm256_add_ps(sum, _mm256_mul_ps(_mm256_set1_ps(weights[k]), _mm256_add_ps(_mm256_loadu_ps(in + i + k), _mm256_loadu_ps(in + i + 10 - k))));
+        }
+        _mm256_storeu_ps(out + i, sum);
+    }
+    ssimHorizontalScalar(in + i, weights, out + i, count - i);
+}
+
+UPSCALER_TARGET("avx2")
+inline void ssimFormulaAVX2(const float* mu1, const float* mu2, const float* xx, const float* yy, const float* xy,
+                            float* ssim, float* cs, size_t count) {
+    const __m256 one = _mm256_set1_ps(1.0f), two = _mm256_set1_ps(2.0f), c1 = _mm256_set1_ps(kSsimC1), c2 = _mm256_set1_ps(kSsimC2);
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        __m256 m1 = _mm256_loadu_ps(mu1 + i), m2 = _mm256_loadu_ps(mu2 + i);
+        __m256 mu12 = _mm256_mul_ps(m1, m2), mu11 = _mm256_mul_ps(m1, m1), mu22 = _mm256_mul_ps(m2, m2);
+        __m256 luminance = _mm256_add_ps(_mm256_mul_ps(two, mu12), c1);
+        __m256 luminanceDen = _mm256_add_ps(_mm256_add_ps(mu11, mu22), c1);
+        __m256 contrast = _mm256_add_ps(_mm256_mul_ps(two, _mm256_sub_ps(_mm256_loadu_ps(xy + i), mu12)), c2);
+        __m256 contrastDen = _mm256_add_ps(_mm256_add_ps(_mm256_sub_ps(_mm256_loadu_ps(xx + i), mu11), _mm256_sub_ps(_mm256_loadu_ps(yy + i), mu22)), c2);
+        __m256 inverse = _mm256_div_ps(one, _mm256_mul_ps(luminanceDen, contrastDen));
+        _mm256_storeu_ps(ssim + i, _mm256_mul_ps(_mm256_mul_ps(luminance, contrast), inverse));
+        _mm256_storeu_ps(cs + i, _mm256_mul_ps(_mm256_mul_ps(contrast, luminanceDen), inverse));
+    }
+    ssimFormulaScalar(mu1 + i, mu2 + i, xx + i, yy + i, xy + i, ssim + i, cs + i, count - i);
+}
+
+UPSCALER_TARGET("avx512f")
+inline void ssimVerticalAVX512(const float* const* rows1, const float* const* rows2, const float* weights, float* mu1, float* mu2,
+                             float* xx, float* yy, float* xy, size_t count) {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m512 s1 = _mm512_setzero_ps(), s2 = _mm512_setzero_ps(), s11 = _mm512_setzero_ps(), s22 = _mm512_setzero_ps(), s12 = _mm512_setzero_ps();
+        for (int k = 0; k < kSsimWindow; ++k) {
+            __m512 p = _mm512_loadu_ps(rows1[k] + i), q = _mm512_loadu_ps(rows2[k] + i), w = _mm512_set1_ps(weights[k]);
+            s1 = _mm512_add_ps(s1, _mm512_mul_ps(w, p));
+            s2 = _mm512_add_ps(s2, _mm512_mul_ps(w, q));
+            s11 = _mm512_add_ps(s11, _mm512_mul_ps(w, _mm512_mul_ps(p, p)));
+            s22 = _mm512_add_ps(s22, _mm512_mul_ps(w, _mm512_mul_ps(q, q)));
+            s12 = _mm512_add_ps(s12, _mm512_mul_ps(w, _mm512_mul_ps(p, q)));
+        }
+        _mm512_storeu_ps(mu1 + i, s1);
+        _mm512_storeu_ps(mu2 + i, s2);
+        _mm512_storeu_ps(xx + i, s11);
+        _mm512_storeu_ps(yy + i, s22);
+        _mm512_storeu_ps(xy + i, s12);
+    }
+    if (i == count) return;
+    const float* tail1[kSsimWindow];
+    const float* tail2[kSsimWindow];
+    for (int k = 0; k < kSsimWindow; ++k) {
+        tail1[k] = rows1[k] + i;
+        tail2[k] = rows2[k] + i;
+    }
+    ssimVerticalScalar(tail1, tail2, weights, mu1 + i, mu2 + i, xx + i, yy + i, xy + i, count - i);
+}
+
+UPSCALER_TARGET("avx512f")
+inline void ssimHorizontalAVX512(const float* in, const float* weights, float* out, size_t count) {
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m512 sum = _mm512_mul_ps(_mm512_set1_ps(weights[5]), _mm512_loadu_ps(in + i + 5));
+        for (int k = 0; k < 5; ++k) {
+            sum = _mm512_add_ps(sum, _mm512_mul_ps(_mm512_set1_ps(weights[k]), _mm512_add_ps(_mm512_loadu_ps(in + i + k), _mm512_loadu_ps(in + i + 10 - k))));
+        }
+        _mm512_storeu_ps(out + i, sum);
+    }
+    ssimHorizontalScalar(in + i, weights, out + i, count - i);
+}
+
+UPSCALER_TARGET("avx512f")
+inline void ssimFormulaAVX512(const float* mu1, const float* mu2, const float* xx, const float* yy, const float* xy,
+                              float* ssim, float* cs, size_t count) {
+    const __m512 one = _mm512_set1_ps(1.0f), two = _mm512_set1_ps(2.0f), c1 = _mm512_set1_ps(kSsimC1), c2 = _mm512_set1_ps(kSsimC2);
+    size_t i = 0;
+    for (; i + 16 <= count; i += 16) {
+        __m512 m1 = _mm512_loadu_ps(mu1 + i), m2 = _mm512_loadu_ps(mu2 + i);
+        __m512 mu12 = _mm512_mul_ps(m1, m2), mu11 = _mm512_mul_ps(m1, m1), mu22 = _mm512_mul_ps(m2, m2);
+        __m512 luminance = _mm512_add_ps(_mm512_mul_ps(two, mu12), c1);
+        __m512 luminanceDen = _mm512_add_ps(_mm512_add_ps(mu11, mu22), c1);
+        __m512 contrast = _mm512_add_ps(_mm512_mul_ps(two, _mm512_sub_ps(_mm512_loadu_ps(xy + i), mu12)), c2);
+        __m512 contrastDen = _mm512_add_ps(_mm512_add_ps(_mm512_sub_ps(_mm512_loadu_ps(xx + i), mu11), _mm512_sub_ps(_mm512_loadu_ps(yy + i), mu22)), c2);
+        __m512 inverse = _mm512_div_ps(one, _mm512_mul_ps(luminanceDen, contrastDen));
+        _mm512_storeu_ps(ssim + i, _mm512_mul_ps(_mm512_mul_ps(luminance, contrast), inverse));
+        _mm512_storeu_ps(cs + i, _mm512_mul_ps(_mm512_mul_ps(contrast, luminanceDen), inverse));
+    }
+    ssimFormulaScalar(mu1 + i, mu2 + i, xx + i, yy + i, xy + i, ssim + i, cs + i, count - i);
+}
+#endif
+
+struct SsimKernels {
+    void (*vertical)(const float* const*, const float* const*, const float*, float*, float*, float*, float*, float*, size_t);
+    void (*horizontal)(const float*, const float*, float*, size_t);
+    void (*formula)(const float*, const float*, const float*, const float*, const float*, float*, float*, size_t);
+};
+
+inline SsimKernels ssimKernels(SimdLevel level) {
+#if defined(UPSCALER_X86)
+    switch (level) {
+        case SimdLevel::AVX512: return {ssimVerticalAVX512, ssimHorizontalAVX512, ssimFormulaAVX512};
+        case SimdLevel::AVX2: return {ssimVerticalAVX2, ssimHorizontalAVX2, ssimFormulaAVX2};
+        case SimdLevel::SSE2: return {ssimVerticalSSE2, ssimHorizontalSSE2, ssimFormulaSSE2};
+        default: break;
+    }
+#endif
+    return {ssimVerticalScalar, ssimHorizontalScalar, ssimFormulaScalar};
+}
+
+// per-window SSIM, averaged over the channels; (width - 10) x (height - 10)
+struct SsimMap {
+    int width = 0, height = 0;
+    std::vector<float> values;
+    float at(int x, int y) const { return values[static_cast<size_t>(y) * width + x]; }
+};
+
+// mean SSIM and mean contrast-structure term over all windows and channels (MS-SSIM needs both)
+struct SsimStats {
+    double ssim = 0;
+    double cs = 0;
+};
+
+// double sum of a row in four interleaved parts, so the adds do not wait on each other
+inline double sumRow(const float* values, int count) {
+    double parts[4] = {0, 0, 0, 0};
+    int x = 0;
+    for (; x + 4 <= count; x += 4) {
+        for (int k = 0; k < 4; ++k) parts[k] += values[x + k];
+    }
+    for (; x < count; ++x) parts[0] += values[x];
+    return (parts[0] + parts[1]) + (parts[2] + parts[3]);
+}
+
+// output columns per tile: the ring of input rows for a tile (11 rows of x and y per channel) then
+// stays in L2 however wide the image is
+constexpr int kSsimTileWidth = 512;
+
+inline SsimStats ssimStats(const ConstImageView& a, const ConstImageView& b, SsimMap* map = nullptr,
+                           SimdLevel level = activeSimdLevel(), ThreadPool& pool = globalThreadPool()) {
+    if (a.width != b.width || a.height != b.height || a.channels != b.channels) {
+        throw std::runtime_error("Image sizes do not match for SSIM");
+    }
+    if (a.width < kSsimWindow || a.height < kSsimWindow) {
+        throw std::runtime_error("SSIM needs images of at least " + std::to_string(kSsimWindow) + "x" + std::to_string(kSsimWindow));
+    }
+    const int channels = a.channels;
+    const int outWidth = a.width - (kSsimWindow - 1), outHeight = a.height - (kSsimWindow - 1);
+    const int tileCount = (outWidth + kSsimTileWidth - 1) / kSsimTileWidth;
+    const float* weights = ssimWeights();
+    const SsimKernels kernels = ssimKernels(level);
+    if (map) {
+        map->width = outWidth;
+        map->height = outHeight;
+        map->values.assign(static_cast<size_t>(outWidth) * outHeight, 0.0f);
+    }
+
+    //the sums of every output row of every tile, added up in a fixed order at the end
+    std::vector<double> tileSsim(static_cast<size_t>(outHeight) * tileCount), tileCs(tileSsim.size());
+    //tiles are a band of rows by kSsimTileWidth columns; a band walks its tiles left to right
+    parallelRowBands(pool, outHeight, 32, [&](int begin, int end) {
+        const size_t planeSize = kSsimTileWidth + kSsimWindow - 1;
+        std::vector<float> ring(static_cast<size_t>(kSsimWindow) * channels * 2 * planeSize);
+        std::vector<float> vertical(5 * planeSize), filtered(5 * static_cast<size_t>(kSsimTileWidth));
+        std::vector<float> ssim(kSsimTileWidth), cs(kSsimTileWidth), mapRow(kSsimTileWidth);
+        auto plane = [&](int y, int c, int p) { return ring.data() + ((static_cast<size_t>(y % kSsimWindow) * channels + c) * 2 + p) * planeSize; };
+
+        for (int tile = 0; tile < tileCount; ++tile) {
+            const int x0 = tile * kSsimTileWidth;
+            const int tileWidth = std::min(kSsimTileWidth, outWidth - x0);
+            const int inWidth = tileWidth + kSsimWindow - 1;
+            //x and y of every channel as float planes, the last 11 input rows
+            auto loadRow = [&](int y) {
+                const unsigned char* rowA = a.row(y) + static_cast<size_t>(x0) * channels;
+                const unsigned char* rowB = b.row(y) + static_cast<size_t>(x0) * channels;
+                float* planes1[4];
+                float* planes2[4];
+                for (int c = 0; c < channels; ++c) {
+                    planes1[c] = plane(y, c, 0);
+                    planes2[c] = plane(y, c, 1);
+                }
+                for (int x = 0; x < inWidth; ++x) {
+                    for (int c = 0; c < channels; ++c) {
+                        planes1[c][x] = rowA[x * channels + c];
+                        planes2[c][x] = rowB[x * channels + c];
+                    }
+                }
+            };
+            for (int y = begin; y < begin + kSsimWindow - 1; ++y) loadRow(y);
+
+            for (int y = begin; y < end; ++y) {
+                loadRow(y + kSsimWindow - 1);
+                double ssimSum = 0, csSum = 0;
+                for (int c = 0; c < channels; ++c) {
+                    const float* rows1[kSsimWindow];
+                    const float* rows2[kSsimWindow];
+                    for (int k = 0; k < kSsimWindow; ++k) {
+                        rows1[k] = plane(y + k, c, 0);
+                        rows2[k] = plane(y + k, c, 1);
+                    }
+                    float* v = vertical.data();
+                    kernels.vertical(rows1, rows2, weights, v, v + planeSize, v + 2 * planeSize, v + 3 * planeSize, v + 4 * planeSize, inWidth);
+                    float* f = filtered.data();
+                    for (int p = 0; p < 5; ++p) kernels.horizontal(v + p * planeSize, weights, f + p * kSsimTileWidth, tileWidth);
+                    kernels.formula(f, f + kSsimTileWidth, f + 2 * kSsimTileWidth, f + 3 * kSsimTileWidth, f + 4 * kSsimTileWidth,
+                                    ssim.data(), cs.data(), tileWidth);
+                    ssimSum += sumRow(ssim.data(), tileWidth);
+                    csSum += sumRow(cs.data(), tileWidth);
+                    if (map) {
+                        for (int x = 0; x < tileWidth; ++x) mapRow[x] = (c == 0 ? 0.0f : mapRow[x]) + ssim[x];
+                    }
+                }
+                tileSsim[static_cast<size_t>(y) * tileCount + tile] = ssimSum;
+                tileCs[static_cast<size_t>(y) * tileCount + tile] = csSum;
+                if (map) {
+                    float* dst = map->values.data() + static_cast<size_t>(y) * outWidth + x0;
+                    for (int x = 0; x < tileWidth; ++x) dst[x] = mapRow[x] / channels;
+                }
+            }
+        }
+    });
+
+    SsimStats stats;
+    for (size_t i = 0; i < tileSsim.size(); ++i) {
+        stats.ssim += tileSsim[i];
+        stats.cs += tileCs[i];
+    }
+    const double windows = static_cast<double>(outWidth) * outHeight * channels;
+    stats.ssim /= windows;
+    stats.cs /= windows;
+    return stats;
+}
+
+// mean SSIM in [-1, 1] (1 = identical); pass map to also get the SSIM of every window
+inline double computeSSIM(const ConstImageView& a, const ConstImageView& b, SsimMap* map = nullptr,
+                          SimdLevel level = activeSimdLevel(), ThreadPool& pool = globalThreadPool()) {
+    return ssimStats(a, b, map, level, pool).ssim;
+}
+
+// MS-SSIM over 5 scales with the weights of Wang et al.: the contrast-structure term at each scale and
+// full SSIM at the coarsest, halving both images with a 2x2 box (rounded to 8 bits) between scales.
+// negative terms are clamped to 0 so the product stays real
+constexpr int kMsSsimScales = 5;
+
+inline double computeMSSSIM(const ConstImageView& a, const ConstImageView& b, SimdLevel level = activeSimdLevel(),
+                            ThreadPool& pool = globalThreadPool()) {
+    static const double scaleWeights[kMsSsimScales] = {0.0448, 0.2856, 0.3001, 0.2363, 0.1333};
+    const int smallest = kSsimWindow << (kMsSsimScales - 1);
+    if (a.width < smallest || a.height < smallest) {
+        throw std::runtime_error("MS-SSIM needs images of at least " + std::to_string(smallest) + "x" + std::to_string(smallest));
+    }
+    Image scaledA, scaledB;
+    ConstImageView viewA = a, viewB = b;
+    double result = 1.0;
+    for (int scale = 0; scale < kMsSsimScales; ++scale) {
+        SsimStats stats = ssimStats(viewA, viewB, nullptr, level, pool);
+        const double term = scale == kMsSsimScales - 1 ? stats.ssim : stats.cs;
+        result *= std::pow(std::max(term, 0.0), scaleWeights[scale]);
+        if (scale == kMsSsimScales - 1) break;
+        scaledA = downscaleBox(viewA, 2);
+        scaledB = downscaleBox(viewB, 2);
+        viewA = scaledA.view();
+        viewB = scaledB.view();
+    }
+    return result;
+}
@@ -0,0 +1,115 @@
+// Bounded queues and stage threads for streaming many images through the pipeline (batch mode)
+//
+// Pipeline (pipeline.h) runs a graph of nodes once, for one image. batch mode instead streams any
+// number of items down a chain of stages, each on a thread of its own, joined by bounded queues: a
+// full queue blocks the stage feeding it, so at most `capacity` items wait between two stages and
+// memory stays flat however many files there are. the stages still use the thread pool for their
+// inner loops, and the slowest stage sets the pace of the whole chain.
+#pragma once
+
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iomanip>
+#include <mutex>
+#include <optional>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+template <typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : capacity(capacity ? capacity : 1) {}
+
+    // wait for room, then queue item; false (and item dropped) once the queue is closed
+    bool push(T item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [this] { return closed || items.size() < capacity; });
+        if (closed) return false;
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+        return true;
+    }
+
+    // wait for an item; nothing once the queue is closed and drained
+    std::optional<T> pop() {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [this] { return closed || !items.empty(); });
+        if (items.empty()) return std::nullopt;
+        T item = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return item;
+    }
+
+    // no more pushes; pop() still hands out what is queued
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+
+private:
+    const size_t capacity;
+    std::mutex mutex;
+    std::condition_variable notEmpty, notFull;
+    std::deque<T> items;
+    bool closed = false;
+};
+
+// what one stage did over a run; only its own thread writes it
+struct StageStats {
+    std::string name;
+    size_t items = 0;
+    size_t failed = 0;
+    double busySeconds = 0; //in the stage function, not waiting on a queue
+};
+
+// run stage(item) on every item popped from in, on a new thread, and push it on to out (if any);
+// out is closed once in is drained. an item the stage throws on goes to onError and no further
+template <typename T, typename Stage>
+std::thread startStage(StageStats& stats, BoundedQueue<T>& in, BoundedQueue<T>* out, Stage stage,
+                       std::function<void(const T&, const std::exception&)> onError) {
+    return std::thread([&stats, &in, out, stage = std::move(stage), onError = std::move(onError)] {
+        while (std::optional<T> item = in.pop()) {
+            auto begin = std::chrono::steady_clock::now();
+            bool ok = true;
+            try {
+                stage(*item);
+            } catch (const std::exception& e) {
+                ok = false;
+                ++stats.failed;
+                if (onError) onError(*item, e);
+            }
+            stats.busySeconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+            if (!ok) continue;
+            ++stats.items;
+            if (out && !out->push(std::move(*item))) break;
+        }
+        if (out) out->close();
+    });
+}
+
+// images/sec of every stage over its busy time, and of the whole chain over the wall time
+inline void printStageStats(std::ostream& out, const std::vector<StageStats>& stages, size_t images, double wallSeconds) {
+    std::ios::fmtflags flags = out.flags();
+    std::streamsize precision = out.precision();
+    out << std::left << std::setw(20) << "stage" << std::right << std::setw(8) << "images" << std::setw(8) << "failed"
+        << std::setw(10) << "busy s" << std::setw(12) << "images/s" << "\n";
+    for (const StageStats& stage : stages) {
+        out << std::left << std::setw(20) << stage.name << std::right << std::setw(8) << stage.items << std::setw(8) << stage.failed
+            << std::fixed << std::setprecision(2) << std::setw(10) << stage.busySeconds << std::setw(12)
+            << (stage.busySeconds > 0 ? stage.items / stage.busySeconds : 0.0) << "\n";
+    }
+    out << std::left << std::setw(20) << "all stages" << std::right << std::setw(8) << images << std::setw(8) << "" << std::fixed
+        << std::setprecision(2) << std::setw(10) << wallSeconds << std::setw(12) << (wallSeconds > 0 ? images / wallSeconds : 0.0) << "\n";
+    out.flags(flags);
+    out.precision(precision);
+}
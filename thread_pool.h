@@ -0,0 +1,369 @@
+// Work-stealing task scheduler shared by every pipeline stage
+//
+// each worker owns a deque: it pushes and pops its own tasks at the back (newest first, so nested
+// work stays cache-hot) and idle workers steal from the front of other deques (oldest first, which
+// tends to be the biggest piece of work). threads that are not workers, like main(), submit into
+// slot 0 and help run tasks while they wait, so nested parallelFor calls never deadlock.
+// low priority tasks (pipeline sinks such as PNG writes) sit in a second queue per slot that a
+// worker only takes from once every normal deque is empty, and wait() never does (unless the pool
+// has no workers to run them), so a thread waiting on its own work cannot get stuck in one.
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// tasks submitted together; wait() returns when all of them have run
+class TaskGroup {
+public:
+    TaskGroup() = default;
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+
+private:
+    friend class ThreadPool;
+    std::atomic<int> pending{0};
+    std::mutex errorMutex;
+    std::exception_ptr error;
+};
+
+// per-slot utilization counters; slot 0 is shared by all non-worker threads
+struct WorkerStats {
+    unsigned long long tasksRun = 0;
+    unsigned long long tasksStolen = 0;
+    double busySeconds = 0.0;
+};
+
+class ThreadPool {
+public:
+    // threadCount includes the calling thread, which always helps with the work
+    explicit ThreadPool(int threadCount) : slots(std::max(1, threadCount)) {
+        startTime = std::chrono::steady_clock::now();
+        for (int i = 1; i < static_cast<int>(slots.size()); ++i) {
+            workers.emplace_back([this, i] { workerLoop(i); });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            stopping = true;
+        }
+        wake.notify_all();
+        for (std::thread& worker : workers) worker.join();
+        for (BlockingThread& blocking : blockingThreads) blocking.thread.join();
+    }
+
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int threadCount() const { return static_cast<int>(slots.size()); }
+
+    // queue a task on the calling thread's deque; it may run on any thread
+    // low priority tasks go to the slot's low priority queue and run when nothing else is queued
+    void submit(TaskGroup& group, std::function<void()> task, bool lowPriority = false) {
+        group.pending.fetch_add(1);
+        Slot& slot = slots[currentSlot()];
+        {
+            std::lock_guard<std::mutex> lock(slot.mutex);
+            (lowPriority ? slot.lowTasks : slot.tasks).push_back(Task{std::move(task), &group});
+        }
+        (lowPriority ? lowQueued : queued).fetch_add(1);
+        {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+        }
+        wake.notify_one();
+    }
+
+    // run a task that mostly waits (e.g. on a child process) on its own thread so it does not
+    // hold a worker; it still counts towards the group. finished threads are joined by the next
+    // submitBlocking or wait, so a long-lived pool does not collect them
+    void submitBlocking(TaskGroup& group, std::function<void()> task) {
+        reapBlockingThreads();
+        group.pending.fetch_add(1);
+        auto done = std::make_shared<std::atomic<bool>>(false);
+        std::lock_guard<std::mutex> lock(blockingMutex);
+        blockingThreads.push_back(BlockingThread{std::thread([this, &group, done, task = std::move(task)] {
+            runGuarded(group, task);
+            //marked done before the group is told, so the wait() it releases can already join this thread
+            done->store(true);
+            blockingDone.fetch_add(1);
+            finishTask(group);
+        }), done});
+    }
+
+    // blocking threads started and not joined yet (finished ones included until they are reaped)
+    size_t blockingThreadCount() {
+        std::lock_guard<std::mutex> lock(blockingMutex);
+        return blockingThreads.size();
+    }
+
+    // run queued tasks until every task in the group has finished, then rethrow the first error
+    void wait(TaskGroup& group) {
+        int self = currentSlot();
+        const bool takeLow = slots.size() == 1; //no worker would ever run them otherwise
+        while (group.pending.load() > 0) {
+            if (runOne(self, takeLow)) continue;
+
+            //nothing to steal: the rest of the group is running elsewhere
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            finished.wait_for(lock, std::chrono::milliseconds(1),
+                              [&] { return group.pending.load() == 0 || queued.load() > 0 || (takeLow && lowQueued.load() > 0); });
+        }
+        if (blockingDone.load() > 0) reapBlockingThreads();
+        if (group.error) std::rethrow_exception(group.error);
+    }
+
+    // run task(i) for every i in [0, count) and wait for all of them
+    // which thread runs which index is not fixed, so tasks must only write their own output
+    void parallelFor(int count, const std::function<void(int)>& task) {
+        if (count <= 0) return;
+        if (count == 1 || slots.size() == 1) {
+            for (int i = 0; i < count; ++i) task(i);
+            return;
+        }
+        TaskGroup group;
+        for (int i = 0; i < count; ++i) {
+            submit(group, [&task, i] { task(i); });
+        }
+        wait(group);
+    }
+
+    std::vector<WorkerStats> stats() const {
+        std::vector<WorkerStats> result(slots.size());
+        for (size_t i = 0; i < slots.size(); ++i) {
+            result[i].tasksRun = slots[i].tasksRun.load();
+            result[i].tasksStolen = slots[i].tasksStolen.load();
+            result[i].busySeconds = slots[i].busyNanoseconds.load() * 1e-9;
+        }
+        return result;
+    }
+
+    // seconds since the pool was created, to turn busy time into utilization
+    double uptimeSeconds() const {
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+    }
+
+private:
+    struct Task {
+        std::function<void()> work;
+        TaskGroup* group;
+    };
+
+    struct Slot {
+        std::mutex mutex;
+        std::deque<Task> tasks;
+        std::deque<Task> lowTasks; //same order as tasks: the owner takes the newest, thieves the oldest
+        std::atomic<unsigned long long> tasksRun{0};
+        std::atomic<unsigned long long> tasksStolen{0};
+        std::atomic<unsigned long long> busyNanoseconds{0};
+    };
+
+    struct ThreadState {
+        const ThreadPool* pool = nullptr;
+        int slot = 0;
+        int depth = 0; //nesting of tasks on this thread, busy time is only counted at the top level
+    };
+
+    static ThreadState& threadState() {
+        thread_local ThreadState state;
+        return state;
+    }
+
+    int currentSlot() const {
+        const ThreadState& state = threadState();
+        return state.pool == this ? state.slot : 0;
+    }
+
+    bool popOwn(int self, Task& task, std::deque<Task> Slot::*queue = &Slot::tasks) {
+        Slot& slot = slots[self];
+        std::lock_guard<std::mutex> lock(slot.mutex);
+        std::deque<Task>& tasks = slot.*queue;
+        if (tasks.empty()) return false;
+        task = std::move(tasks.back());
+        tasks.pop_back();
+        return true;
+    }
+
+    bool steal(int self, Task& task, std::deque<Task> Slot::*queue = &Slot::tasks) {
+        int count = static_cast<int>(slots.size());
+        for (int offset = 1; offset < count; ++offset) {
+            Slot& victim = slots[(self + offset) % count];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            std::deque<Task>& tasks = victim.*queue;
+            if (tasks.empty()) continue;
+            task = std::move(tasks.front());
+            tasks.pop_front();
+            return true;
+        }
+        return false;
+    }
+
+    // run one task from our own deque or stolen from another; with takeLow, a low priority one once
+    // every normal deque is empty. false if there was nothing to run
+    bool runOne(int self, bool takeLow) {
+        Task task;
+        bool stolen = false;
+        if (popOwn(self, task)) {
+            queued.fetch_sub(1);
+        } else if (steal(self, task)) {
+            queued.fetch_sub(1);
+            stolen = true;
+        } else if (!takeLow || lowQueued.load() == 0) {
+            return false;
+        } else if (popOwn(self, task, &Slot::lowTasks)) {
+            lowQueued.fetch_sub(1);
+        } else if (steal(self, task, &Slot::lowTasks)) {
+            lowQueued.fetch_sub(1);
+            stolen = true;
+        } else {
+            return false;
+        }
+
+        ThreadState& state = threadState();
+        const ThreadPool* previousPool = state.pool;
+        int previousSlot = state.slot;
+        state.pool = this;
+        state.slot = self;
+        bool topLevel = state.depth++ == 0;
+        auto start = std::chrono::steady_clock::now();
+
+        runGuarded(*task.group, task.work);
+
+        if (topLevel) {
+            auto elapsed = std::chrono::steady_clock::now() - start;
+            slots[self].busyNanoseconds.fetch_add(
+                std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count());
+        }
+        --state.depth;
+        state.pool = previousPool;
+        state.slot = previousSlot;
+
+        slots[self].tasksRun.fetch_add(1);
+        if (stolen) slots[self].tasksStolen.fetch_add(1);
+
+        finishTask(*task.group);
+        return true;
+    }
+
+    // keep the first exception of a group for wait() to rethrow
+    static void runGuarded(TaskGroup& group, const std::function<void()>& work) {
+        try {
+            work();
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(group.errorMutex);
+            if (!group.error) group.error = std::current_exception();
+        }
+    }
+
+    void finishTask(TaskGroup& group) {
+        if (group.pending.fetch_sub(1) == 1) {
+            std::lock_guard<std::mutex> lock(sleepMutex);
+            finished.notify_all();
+        }
+    }
+
+    void workerLoop(int self) {
+        ThreadState& state = threadState();
+        state.pool = this;
+        state.slot = self;
+
+        while (true) {
+            if (runOne(self, true)) continue;
+
+            std::unique_lock<std::mutex> lock(sleepMutex);
+            wake.wait(lock, [this] { return stopping || queued.load() > 0 || lowQueued.load() > 0; });
+            if (stopping) return;
+        }
+    }
+
+    std::vector<Slot> slots;
+    std::vector<std::thread> workers;
+    std::mutex blockingMutex;
+    struct BlockingThread {
+        std::thread thread;
+        std::shared_ptr<std::atomic<bool>> done;
+    };
+
+    // join the blocking threads whose task has finished
+    void reapBlockingThreads() {
+        if (blockingDone.load() == 0) return;
+        std::lock_guard<std::mutex> lock(blockingMutex);
+        for (auto it = blockingThreads.begin(); it != blockingThreads.end();) {
+            if (!it->done->load()) {
+                ++it;
+                continue;
+            }
+            it->thread.join();
+            it = blockingThreads.erase(it);
+            blockingDone.fetch_sub(1);
+        }
+    }
+
+    std::vector<BlockingThread> blockingThreads;
+    std::atomic<int> blockingDone{0}; //finished and not yet joined
+    std::atomic<int> queued{0};
+    std::atomic<int> lowQueued{0};
+    std::mutex sleepMutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    bool stopping = false;
+    std::chrono::steady_clock::time_point startTime;
+};
+
+inline std::unique_ptr<ThreadPool>& globalThreadPoolStorage() {
+    static std::unique_ptr<ThreadPool> pool;
+    return pool;
+}
+
+// pool shared by every stage; defaults to one thread per hardware thread
+inline ThreadPool& globalThreadPool() {
+    std::unique_ptr<ThreadPool>& pool = globalThreadPoolStorage();
+    if (!pool) pool = std::make_unique<ThreadPool>(static_cast<int>(std::thread::hardware_concurrency()));
+    return *pool;
+}
+
+// replace the shared pool, e.g. from --threads N
+inline void setGlobalThreadCount(int threadCount) {
+    globalThreadPoolStorage() = std::make_unique<ThreadPool>(threadCount);
+}
+
+// split [0, rows) into contiguous bands and run band(begin, end) for each on the pool
+// bands are a fixed function of rows and the thread count, so results do not depend on scheduling
+inline void parallelRowBands(ThreadPool& pool, int rows, int minRowsPerBand,
+                             const std::function<void(int, int)>& band) {
+    if (rows <= 0) return;
+    //a few bands per thread so stealing can even out bands that run slower
+    int bandCount = std::min(pool.threadCount() * 4, std::max(1, rows / std::max(1, minRowsPerBand)));
+    int rowsPerBand = (rows + bandCount - 1) / bandCount;
+    bandCount = (rows + rowsPerBand - 1) / rowsPerBand;
+
+    pool.parallelFor(bandCount, [&](int index) {
+        int begin = index * rowsPerBand;
+        int end = std::min(rows, begin + rowsPerBand);
+        band(begin, end);
+    });
+}
+
+// per-thread busy time and steals since the pool started
+inline void printSchedulerStats(const ThreadPool& pool) {
+    std::vector<WorkerStats> stats = pool.stats();
+    double uptime = pool.uptimeSeconds();
+    std::cout << "Scheduler: " << pool.threadCount() << " threads, " << uptime << " s\n";
+    for (size_t i = 0; i < stats.size(); ++i) {
+        std::cout << "  " << (i == 0 ? "caller  " : "worker " + std::to_string(i))
+                  << " tasks " << stats[i].tasksRun
+                  << ", stolen " << stats[i].tasksStolen
+                  << ", busy " << (uptime > 0 ? 100.0 * stats[i].busySeconds / uptime : 0.0) << "%\n";
+    }
+}